@@ -0,0 +1,113 @@
+// Microbenchmark for the base64 codecs in codec.cc against the OpenSSL
+// BIO chain crypto.cc used before.
+//
+//   g++ -O2 -I. -o base64_bench bench/base64_bench.cc codec.cc -lcrypto && ./base64_bench
+
+#include "codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <openssl/evp.h>
+
+static int
+legacy_base64(unsigned char *input, int length, char* out)
+{
+  BIO *bmem, *b64;
+  BUF_MEM *bptr;
+
+  b64 = BIO_new(BIO_f_base64());
+  bmem = BIO_new(BIO_s_mem());
+  b64 = BIO_push(b64, bmem);
+  BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+  BIO_write(b64, input, length);
+  (void) BIO_flush(b64);
+  BIO_get_mem_ptr(b64, &bptr);
+  int len = bptr->length;
+  memcpy(out, bptr->data, len);
+  BIO_free_all(b64);
+  return len;
+}
+
+static int
+legacy_unbase64(char *input, int length, unsigned char* out)
+{
+  BIO *b64, *bmem;
+
+  b64 = BIO_new(BIO_f_base64());
+  BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+  bmem = BIO_new_mem_buf(input, length);
+  bmem = BIO_push(b64, bmem);
+  int len = BIO_read(bmem, out, length);
+  BIO_free_all(bmem);
+  return len;
+}
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Repeats stmt until about 0.2s have passed and returns MB/s of binary data.
+#define MEASURE(result, bytes, stmt)                          \
+  do {                                                        \
+    long iters = 0;                                           \
+    double start = now(), elapsed;                            \
+    do {                                                      \
+      for (int k_ = 0; k_ < 64; k_++) { stmt; }               \
+      iters += 64;                                            \
+      elapsed = now() - start;                                \
+    } while (elapsed < 0.2);                                  \
+    result = (double) (bytes) * iters / elapsed / 1e6;        \
+  } while (0)
+
+int
+main()
+{
+  static const size_t sizes[] = { 16, 20, 32, 64, 256, 1024, 16384, 1048576 };
+  size_t max = sizes[sizeof(sizes)/sizeof(sizes[0]) - 1];
+
+  unsigned char *bin = (unsigned char *) malloc(max);
+  char *b64 = (char *) malloc(base64_encoded_len(max) + 1);
+  char *b64_ref = (char *) malloc(base64_encoded_len(max) + 1);
+  unsigned char *back = (unsigned char *) malloc(base64_decoded_max(base64_encoded_len(max)));
+  for (size_t i = 0; i < max; i++) bin[i] = (unsigned char) (rand() >> 7);
+
+  codec_init();
+
+  // Sanity check before timing anything.
+  size_t enc_len = base64_encoded_len(max);
+  base64_encode_raw(bin, max, b64);
+  if (legacy_base64(bin, max, b64_ref) != (int) enc_len ||
+      memcmp(b64, b64_ref, enc_len) != 0 ||
+      base64_decode_raw(b64, enc_len, back, BASE64_STRICT) != (ssize_t) max ||
+      memcmp(back, bin, max) != 0) {
+    fprintf(stderr, "codec mismatch\n");
+    return 1;
+  }
+
+  printf("%8s %14s %14s %14s %14s %14s %14s\n", "bytes",
+         "enc bio", "enc table", "enc simd",
+         "dec bio", "dec table", "dec simd");
+  for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    size_t m = base64_encoded_len(n);
+    double r[6];
+    MEASURE(r[0], n, legacy_base64(bin, n, b64_ref));
+    MEASURE(r[1], n, base64_encode_scalar(bin, n, b64));
+    MEASURE(r[2], n, base64_encode_raw(bin, n, b64));
+    MEASURE(r[3], n, legacy_unbase64(b64, m, back));
+    MEASURE(r[4], n, base64_decode_scalar(b64, m, back, 0));
+    MEASURE(r[5], n, base64_decode_raw(b64, m, back, 0));
+    printf("%8lu", (unsigned long) n);
+    for (int i = 0; i < 6; i++) printf(" %9.0f MB/s", r[i]);
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Microbenchmark for the hex codecs in codec.cc against the per-byte
+// sprintf encoder and hex2i decoder crypto.cc used before.
+//
+//   g++ -O2 -I. -o hex_bench bench/hex_bench.cc codec.cc && ./hex_bench
+
+#include "codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static void
+legacy_hex_encode(unsigned char *md_value, int md_len, char* out)
+{
+  for(int i = 0; i < md_len; i++) {
+    sprintf((char *)(out + (i*2)), "%02x",  md_value[i]);
+  }
+}
+
+#define hex2i(c) ((c) <= '9' ? ((c) - '0') : (c) <= 'Z' ? ((c) - 'A' + 10) : ((c) - 'a' + 10))
+static void
+legacy_hex_decode(unsigned char *input, int length, char* b)
+{
+  for(int i = 0; i < length-1; i+=2) {
+    b[i/2]  = (hex2i(input[i])<<4) | (hex2i(input[i+1]));
+  }
+}
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Repeats fn until about 0.2s have passed and returns MB/s of input.
+#define MEASURE(result, bytes, stmt)                          \
+  do {                                                        \
+    long iters = 0;                                           \
+    double start = now(), elapsed;                            \
+    do {                                                      \
+      for (int k_ = 0; k_ < 64; k_++) { stmt; }               \
+      iters += 64;                                            \
+      elapsed = now() - start;                                \
+    } while (elapsed < 0.2);                                  \
+    result = (double) (bytes) * iters / elapsed / 1e6;        \
+  } while (0)
+
+int
+main()
+{
+  static const size_t sizes[] = { 16, 20, 32, 64, 256, 1024, 16384, 1048576 };
+  size_t max = sizes[sizeof(sizes)/sizeof(sizes[0]) - 1];
+
+  unsigned char *bin = (unsigned char *) malloc(max);
+  char *hex = (char *) malloc(2*max + 1);
+  char *hex_ref = (char *) malloc(2*max + 1);
+  unsigned char *back = (unsigned char *) malloc(max);
+  for (size_t i = 0; i < max; i++) bin[i] = (unsigned char) (rand() >> 7);
+
+  codec_init();
+
+  // Sanity check before timing anything.
+  legacy_hex_encode(bin, max, hex_ref);
+  hex_encode_raw(bin, max, hex);
+  if (memcmp(hex, hex_ref, 2*max) != 0 ||
+      hex_decode_raw(hex, 2*max, back) != (ssize_t) max ||
+      memcmp(back, bin, max) != 0) {
+    fprintf(stderr, "codec mismatch\n");
+    return 1;
+  }
+
+  printf("%8s %14s %14s %14s %14s %14s %14s\n", "bytes",
+         "enc sprintf", "enc table", "enc simd",
+         "dec hex2i", "dec table", "dec simd");
+  for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    double r[6];
+    MEASURE(r[0], n, legacy_hex_encode(bin, n, hex_ref));
+    MEASURE(r[1], n, hex_encode_scalar(bin, n, hex));
+    MEASURE(r[2], n, hex_encode_raw(bin, n, hex));
+    MEASURE(r[3], n, legacy_hex_decode((unsigned char *) hex, 2*n, (char *) back));
+    MEASURE(r[4], n, hex_decode_scalar(hex, 2*n, back));
+    MEASURE(r[5], n, hex_decode_raw(hex, 2*n, back));
+    printf("%8lu", (unsigned long) n);
+    for (int i = 0; i < 6; i++) printf(" %9.0f MB/s", r[i]);
+    printf("\n");
+  }
+  return 0;
+}
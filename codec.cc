@@ -0,0 +1,728 @@
+#include "codec.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CODEC_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Two output characters per input byte.
+static char hex_encode_table[256][2];
+
+// Nibble value per input character, -1 for anything that is not a hex digit.
+static signed char hex_decode_table[256];
+
+static const char base64_chars[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Sextet value per input character. Anything else is negative: -2 for
+// whitespace, -3 for '=' and -1 for the rest.
+#define B64_BAD -1
+#define B64_SPACE -2
+#define B64_PAD -3
+static signed char base64_decode_table[256];
+
+static bool tables_ready = false;
+
+static void
+init_tables()
+{
+  for (int i = 0; i < 256; i++) {
+    hex_encode_table[i][0] = hex_digits[i >> 4];
+    hex_encode_table[i][1] = hex_digits[i & 0x0f];
+    hex_decode_table[i] = -1;
+  }
+  for (int i = 0; i < 10; i++) {
+    hex_decode_table['0' + i] = i;
+  }
+  for (int i = 0; i < 6; i++) {
+    hex_decode_table['a' + i] = 10 + i;
+    hex_decode_table['A' + i] = 10 + i;
+  }
+  for (int i = 0; i < 256; i++) {
+    base64_decode_table[i] = B64_BAD;
+  }
+  for (int i = 0; i < 64; i++) {
+    base64_decode_table[(unsigned char) base64_chars[i]] = i;
+  }
+  base64_decode_table[' '] = B64_SPACE;
+  base64_decode_table['\t'] = B64_SPACE;
+  base64_decode_table['\r'] = B64_SPACE;
+  base64_decode_table['\n'] = B64_SPACE;
+  base64_decode_table['='] = B64_PAD;
+  tables_ready = true;
+}
+
+void
+hex_encode_scalar(const unsigned char *in, size_t len, char *out)
+{
+  if (!tables_ready) init_tables();
+  for (size_t i = 0; i < len; i++) {
+    memcpy(out + 2*i, hex_encode_table[in[i]], 2);
+  }
+}
+
+ssize_t
+hex_decode_scalar(const char *in, size_t len, unsigned char *out)
+{
+  if (!tables_ready) init_tables();
+  if (len % 2 != 0)
+    return -1;
+
+  // OR the lookups together so the loop has no data dependent branch;
+  // any -1 sets the sign bit. The byte is built from the masked nibbles,
+  // as shifting -1 is undefined; it is thrown away in that case anyway.
+  int bad = 0;
+  for (size_t i = 0; i < len; i += 2) {
+    int hi = hex_decode_table[(unsigned char) in[i]];
+    int lo = hex_decode_table[(unsigned char) in[i+1]];
+    bad |= hi | lo;
+    out[i/2] = (unsigned char) ((((unsigned) hi & 0xf) << 4) | ((unsigned) lo & 0xf));
+  }
+  return bad < 0 ? -1 : (ssize_t) (len / 2);
+}
+
+void
+base64_encode_scalar(const unsigned char *in, size_t len, char *out)
+{
+  size_t i = 0;
+  for (; i + 3 <= len; i += 3) {
+    uint32_t v = (in[i] << 16) | (in[i+1] << 8) | in[i+2];
+    *out++ = base64_chars[v >> 18];
+    *out++ = base64_chars[(v >> 12) & 0x3f];
+    *out++ = base64_chars[(v >> 6) & 0x3f];
+    *out++ = base64_chars[v & 0x3f];
+  }
+  if (i < len) {
+    uint32_t v = in[i] << 16;
+    if (i + 1 < len) v |= in[i+1] << 8;
+    *out++ = base64_chars[v >> 18];
+    *out++ = base64_chars[(v >> 12) & 0x3f];
+    *out++ = i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=';
+    *out++ = '=';
+  }
+}
+
+ssize_t
+base64_decode_scalar(const char *in, size_t len, unsigned char *out, int flags)
+{
+  if (!tables_ready) init_tables();
+  bool strict = flags & BASE64_STRICT;
+  if (strict && len % 4 != 0)
+    return -1;
+
+  const unsigned char *p = (const unsigned char *) in;
+  unsigned char *o = out;
+  size_t i = 0;
+
+  // Whole quartets of alphabet characters; stop at the first one that
+  // holds anything else and let the loop below sort it out.
+  for (; i + 4 <= len; i += 4) {
+    int a = base64_decode_table[p[i]];
+    int b = base64_decode_table[p[i+1]];
+    int c = base64_decode_table[p[i+2]];
+    int d = base64_decode_table[p[i+3]];
+    if ((a | b | c | d) < 0)
+      break;
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    *o++ = v >> 16;
+    *o++ = v >> 8;
+    *o++ = v;
+  }
+
+  uint32_t acc = 0;
+  int n = 0;
+  int pad = 0;
+  for (; i < len; i++) {
+    int v = base64_decode_table[p[i]];
+    if (v >= 0) {
+      if (pad) return -1;
+      acc = (acc << 6) | v;
+      if (++n == 4) {
+        *o++ = acc >> 16;
+        *o++ = acc >> 8;
+        *o++ = acc;
+        acc = 0;
+        n = 0;
+      }
+    } else if (v == B64_PAD) {
+      // Padding only ever follows two or three characters of a quartet.
+      if (n < 2 || n + ++pad > 4) return -1;
+    } else if (v == B64_SPACE && !strict) {
+      continue;
+    } else {
+      return -1;
+    }
+  }
+
+  if (n == 1)
+    return -1;
+  if (n > 1) {
+    if (strict && (n + pad != 4 || (acc & ((1 << (6 * n - 8 * (n - 1))) - 1))))
+      return -1;
+    acc >>= 6 * n - 8 * (n - 1);
+    if (n == 3) *o++ = acc >> 8;
+    *o++ = acc;
+  }
+  return o - out;
+}
+
+
+#ifdef CODEC_X86
+
+// Nibbles 0-15 to '0'-'9', 'a'-'f': add '0', plus another 39 for 10-15.
+__attribute__((target("sse2")))
+static inline __m128i
+nibbles_to_hex_sse2(__m128i n)
+{
+  __m128i gt9 = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+  return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+                      _mm_and_si128(gt9, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("sse2")))
+static void
+hex_encode_sse2(const unsigned char *in, size_t len, char *out)
+{
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+    __m128i hi = nibbles_to_hex_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = nibbles_to_hex_sse2(_mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *) (out + 2*i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *) (out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  hex_encode_scalar(in + i, len - i, out + 2*i);
+}
+
+// 16 hex characters to their nibble values; *valid gets 0xff in every
+// lane that held a hex digit.
+__attribute__((target("sse2")))
+static inline __m128i
+hex_to_nibbles_sse2(__m128i c, __m128i *valid)
+{
+  __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)),
+                                   _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+  __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)),
+                                    _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+  *valid = _mm_or_si128(is_digit, is_letter);
+  return _mm_or_si128(_mm_and_si128(is_digit, d),
+                      _mm_and_si128(is_letter, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// Even lanes hold the high nibble, odd lanes the low one.
+__attribute__((target("sse2")))
+static inline __m128i
+pack_nibbles_sse2(__m128i n)
+{
+  __m128i hi = _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4);
+  __m128i lo = _mm_srli_epi16(n, 8);
+  return _mm_or_si128(hi, lo);
+}
+
+__attribute__((target("sse2")))
+static ssize_t
+hex_decode_sse2(const char *in, size_t len, unsigned char *out)
+{
+  if (len % 2 != 0)
+    return -1;
+
+  __m128i valid_all = _mm_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m128i v0, v1;
+    __m128i n0 = hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *) (in + i)), &v0);
+    __m128i n1 = hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *) (in + i + 16)), &v1);
+    valid_all = _mm_and_si128(valid_all, _mm_and_si128(v0, v1));
+    _mm_storeu_si128((__m128i *) (out + i/2),
+                     _mm_packus_epi16(pack_nibbles_sse2(n0), pack_nibbles_sse2(n1)));
+  }
+  if (_mm_movemask_epi8(valid_all) != 0xffff)
+    return -1;
+  if (hex_decode_scalar(in + i, len - i, out + i/2) < 0)
+    return -1;
+  return len / 2;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+nibbles_to_hex_avx2(__m256i n)
+{
+  __m256i gt9 = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+  return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')),
+                         _mm256_and_si256(gt9, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("avx2")))
+static void
+hex_encode_avx2(const unsigned char *in, size_t len, char *out)
+{
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+    __m256i hi = nibbles_to_hex_avx2(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = nibbles_to_hex_avx2(_mm256_and_si256(v, mask));
+    // unpack works within 128 bit lanes, so put the halves back in order.
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *) (out + 2*i), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + 2*i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  hex_encode_sse2(in + i, len - i, out + 2*i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+hex_to_nibbles_avx2(__m256i c, __m256i *valid)
+{
+  __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8(-1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8(10), d));
+  __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  __m256i is_letter = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8(-1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8(6), l));
+  *valid = _mm256_or_si256(is_digit, is_letter);
+  return _mm256_or_si256(_mm256_and_si256(is_digit, d),
+                         _mm256_and_si256(is_letter, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+pack_nibbles_avx2(__m256i n)
+{
+  __m256i hi = _mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00ff)), 4);
+  __m256i lo = _mm256_srli_epi16(n, 8);
+  return _mm256_or_si256(hi, lo);
+}
+
+__attribute__((target("avx2")))
+static ssize_t
+hex_decode_avx2(const char *in, size_t len, unsigned char *out)
+{
+  if (len % 2 != 0)
+    return -1;
+
+  __m256i valid_all = _mm256_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m256i v0, v1;
+    __m256i n0 = hex_to_nibbles_avx2(_mm256_loadu_si256((const __m256i *) (in + i)), &v0);
+    __m256i n1 = hex_to_nibbles_avx2(_mm256_loadu_si256((const __m256i *) (in + i + 32)), &v1);
+    valid_all = _mm256_and_si256(valid_all, _mm256_and_si256(v0, v1));
+    // packus works within 128 bit lanes, so put the quarters back in order.
+    __m256i packed = _mm256_packus_epi16(pack_nibbles_avx2(n0), pack_nibbles_avx2(n1));
+    _mm256_storeu_si256((__m256i *) (out + i/2), _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  if (_mm256_movemask_epi8(valid_all) != -1)
+    return -1;
+  if (hex_decode_sse2(in + i, len - i, out + i/2) < 0)
+    return -1;
+  return len / 2;
+}
+
+// Base64 after Mula and Lemire, "Faster Base64 Encoding and Decoding
+// using AVX2 Instructions". Each step handles 24 bytes / 32 characters.
+
+__attribute__((target("avx2")))
+static void
+base64_encode_avx2(const unsigned char *in, size_t len, char *out)
+{
+  // Spread each 3 byte group over 4 lanes, then pull the sextets out
+  // with multiplies instead of per-lane shifts.
+  const __m256i spread = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  // Added to a sextet to get its character, indexed by range.
+  const __m256i shift = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+      '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+      '/' - 63, 'A', 0, 0);
+
+  size_t i = 0;
+  // The second load reads 4 bytes past the 24 consumed.
+  for (; i + 28 <= len; i += 24) {
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (in + i))),
+        _mm_loadu_si128((const __m128i *) (in + i + 12)), 1);
+    v = _mm256_shuffle_epi8(v, spread);
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                    _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                    _mm256_set1_epi32(0x01000010));
+    v = _mm256_or_si256(t0, t1);
+
+    __m256i idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), v);
+    idx = _mm256_or_si256(idx, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    v = _mm256_add_epi8(v, _mm256_shuffle_epi8(shift, idx));
+    _mm256_storeu_si256((__m256i *) (out + i/3*4), v);
+  }
+  base64_encode_scalar(in + i, len - i, out + i/3*4);
+}
+
+__attribute__((target("avx2")))
+static ssize_t
+base64_decode_avx2(const char *in, size_t len, unsigned char *out, int flags)
+{
+  if ((flags & BASE64_STRICT) && len % 4 != 0)
+    return -1;
+
+  // Nibble lookups whose AND is non-zero for anything outside the
+  // alphabet, and the offset to add per high nibble ('/' is special).
+  const __m256i lut_lo = _mm256_setr_epi8(
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  const __m256i pack = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+  size_t i = 0;
+  unsigned char *o = out;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, mask_2f));
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      break;
+    __m256i eq_2f = _mm256_cmpeq_epi8(v, mask_2f);
+    v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, pack);
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm_storeu_si128((__m128i *) o, _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i *) (o + 16), _mm256_extracti128_si256(v, 1));
+    o += 24;
+  }
+  ssize_t r = base64_decode_scalar(in + i, len - i, o, flags);
+  if (r < 0)
+    return -1;
+  return (o - out) + r;
+}
+
+#endif  // CODEC_X86
+
+
+static void (*hex_encode_impl)(const unsigned char *, size_t, char *) = hex_encode_scalar;
+static ssize_t (*hex_decode_impl)(const char *, size_t, unsigned char *) = hex_decode_scalar;
+static void (*base64_encode_impl)(const unsigned char *, size_t, char *) = base64_encode_scalar;
+static ssize_t (*base64_decode_impl)(const char *, size_t, unsigned char *, int) = base64_decode_scalar;
+
+void
+codec_init()
+{
+  if (!tables_ready) init_tables();
+
+#ifdef CODEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    hex_encode_impl = hex_encode_avx2;
+    hex_decode_impl = hex_decode_avx2;
+    base64_encode_impl = base64_encode_avx2;
+    base64_decode_impl = base64_decode_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    hex_encode_impl = hex_encode_sse2;
+    hex_decode_impl = hex_decode_sse2;
+  }
+#endif
+}
+
+void
+hex_encode_raw(const unsigned char *in, size_t len, char *out)
+{
+  hex_encode_impl(in, len, out);
+}
+
+ssize_t
+hex_decode_raw(const char *in, size_t len, unsigned char *out)
+{
+  return hex_decode_impl(in, len, out);
+}
+
+void
+hex_encode(unsigned char *md_value, int md_len, char** md_hexdigest, int* md_hex_len)
+{
+  *md_hex_len = (2*(md_len));
+  *md_hexdigest = (char *) malloc(*md_hex_len + 1);
+  hex_encode_impl(md_value, md_len, *md_hexdigest);
+  (*md_hexdigest)[*md_hex_len] = 0;
+}
+
+int
+hex_decode(unsigned char *input, int length, char** buf64, int* buf64_len)
+{
+  *buf64 = (char*) malloc(length/2 + 1);
+  ssize_t r = hex_decode_impl((const char *) input, length, (unsigned char *) *buf64);
+  if (r < 0) {
+    free(*buf64);
+    *buf64 = NULL;
+    *buf64_len = 0;
+    return -1;
+  }
+  *buf64_len = r;
+  return 0;
+}
+
+void
+base64_encode_raw(const unsigned char *in, size_t len, char *out)
+{
+  base64_encode_impl(in, len, out);
+}
+
+ssize_t
+base64_decode_raw(const char *in, size_t len, unsigned char *out, int flags)
+{
+  return base64_decode_impl(in, len, out, flags);
+}
+
+void
+base64(unsigned char *input, int length, char** buf64, int* buf64_len)
+{
+  *buf64_len = base64_encoded_len(length);
+  *buf64 = (char *) malloc(*buf64_len + 1);
+  base64_encode_impl(input, length, *buf64);
+  (*buf64)[*buf64_len] = 0;
+}
+
+int
+unbase64(unsigned char *input, int length, char** buffer, int* buffer_len, int flags)
+{
+  *buffer = (char *) malloc(base64_decoded_max(length));
+  ssize_t r = base64_decode_impl((const char *) input, length, (unsigned char *) *buffer, flags);
+  if (r < 0) {
+    free(*buffer);
+    *buffer = NULL;
+    *buffer_len = 0;
+    return -1;
+  }
+  *buffer_len = r;
+  return 0;
+}
+
+// From LengthWithoutIncompleteUtf8 in V8's d8-posix.cc
+// see http://v8.googlecode.com/svn/trunk/src/d8-posix.cc
+size_t
+utf8_complete_len(const unsigned char *buffer, size_t len)
+{
+  size_t answer = len;
+  int multi_byte_bytes_seen = 0;
+  while (answer > 0) {
+    int c = buffer[answer - 1];
+    // Ends in valid single-byte sequence?
+    if ((c & 0x80) == 0x00) return answer;
+    // Ends in one or more subsequent bytes of a multi-byte value?
+    if ((c & 0xc0) == 0x80) {
+      multi_byte_bytes_seen++;
+      answer--;
+    } else {
+      int need;
+      if ((c & 0xe0) == 0xc0) {
+        need = 1;
+      } else if ((c & 0xf0) == 0xe0) {
+        need = 2;
+      } else if ((c & 0xf8) == 0xf0) {
+        need = 3;
+      } else {
+        return answer;  // Malformed UTF-8.
+      }
+      if (multi_byte_bytes_seen >= need) {
+        return answer + need;
+      }
+      return answer - 1;
+    }
+  }
+  return 0;
+}
+
+void
+stream_codec_init(struct stream_codec *c, int type)
+{
+  c->type = type;
+  c->carry_len = 0;
+  c->ended = false;
+}
+
+size_t
+stream_encode(struct stream_codec *c, const unsigned char *in, size_t len,
+              char *out, bool final)
+{
+  char *o = out;
+
+  switch (c->type) {
+    case STREAM_HEX:
+      hex_encode_impl(in, len, o);
+      o += 2 * len;
+      break;
+
+    case STREAM_BASE64: {
+      if (c->carry_len > 0) {
+        while (c->carry_len < 3 && len > 0) {
+          c->carry[c->carry_len++] = *in++;
+          len--;
+        }
+        if (c->carry_len == 3 || final) {
+          base64_encode_impl(c->carry, c->carry_len, o);
+          o += base64_encoded_len(c->carry_len);
+          c->carry_len = 0;
+        }
+      }
+      // The carry is empty now unless all the input went into it.
+      size_t whole = final ? len : len - len % 3;
+      base64_encode_impl(in, whole, o);
+      o += base64_encoded_len(whole);
+      memcpy(c->carry + c->carry_len, in + whole, len - whole);
+      c->carry_len += len - whole;
+      break;
+    }
+
+    case STREAM_UTF8: {
+      memcpy(o, c->carry, c->carry_len);
+      if (len > 0) memcpy(o + c->carry_len, in, len);
+      size_t total = c->carry_len + len;
+      size_t complete = final ? total : utf8_complete_len((unsigned char *) o, total);
+      // A longer tail is malformed anyway; let the decoder replace it.
+      if (total - complete > 3) complete = total;
+      c->carry_len = total - complete;
+      memcpy(c->carry, o + complete, c->carry_len);
+      o += complete;
+      break;
+    }
+
+    default:
+      memcpy(o, in, len);
+      o += len;
+      break;
+  }
+
+  return o - out;
+}
+
+// Decodes the full or final base64 quartet in the carry.
+static ssize_t
+stream_base64_carry(struct stream_codec *c, unsigned char *out, int flags)
+{
+  if (c->ended) return -1;
+  ssize_t r = base64_decode_impl((const char *) c->carry, c->carry_len, out, flags);
+  if (c->carry[c->carry_len - 1] == '=') c->ended = true;
+  c->carry_len = 0;
+  return r;
+}
+
+ssize_t
+stream_decode(struct stream_codec *c, const char *in, size_t len,
+              unsigned char *out, int flags, bool final)
+{
+  unsigned char *o = out;
+
+  switch (c->type) {
+    case STREAM_HEX: {
+      if (c->carry_len > 0 && len > 0) {
+        char pair[2] = { (char) c->carry[0], in[0] };
+        if (hex_decode_impl(pair, 2, o) < 0) return -1;
+        o++;
+        in++;
+        len--;
+        c->carry_len = 0;
+      }
+      size_t whole = len & ~(size_t) 1;
+      if (hex_decode_impl(in, whole, o) < 0) return -1;
+      o += whole / 2;
+      if (len & 1) {
+        c->carry[0] = in[whole];
+        c->carry_len = 1;
+      }
+      if (final && c->carry_len > 0) return -1;
+      break;
+    }
+
+    case STREAM_BASE64: {
+      if (!tables_ready) init_tables();
+      bool strict = flags & BASE64_STRICT;
+      const unsigned char *p = (const unsigned char *) in;
+      size_t i = 0;
+
+      // Complete the quartet started by the last call.
+      if (c->carry_len > 0) {
+        for (; i < len && c->carry_len < 4; i++) {
+          if (!strict && base64_decode_table[p[i]] == B64_SPACE) continue;
+          c->carry[c->carry_len++] = p[i];
+        }
+        if (c->carry_len == 4) {
+          ssize_t r = stream_base64_carry(c, o, flags);
+          if (r < 0) return -1;
+          o += r;
+        }
+      }
+
+      // Decode whole quartets in place and carry the rest. Whitespace
+      // does not count towards a quartet, so find where the last whole
+      // one ends.
+      p += i;
+      len -= i;
+      size_t sig = len;
+      if (!strict) {
+        for (size_t k = 0; k < len; k++)
+          if (base64_decode_table[p[k]] == B64_SPACE) sig--;
+      }
+      size_t keep = final ? 0 : sig % 4;
+      size_t split = len;
+      for (size_t k = keep; k > 0; ) {
+        split--;
+        if (strict || base64_decode_table[p[split]] != B64_SPACE) k--;
+      }
+      if (sig > keep) {
+        if (c->ended) return -1;
+        ssize_t r = base64_decode_impl((const char *) p, split, o, flags);
+        if (r < 0) return -1;
+        o += r;
+        size_t last = split;
+        while (last > 0 && !strict && base64_decode_table[p[last - 1]] == B64_SPACE) last--;
+        if (last > 0 && p[last - 1] == '=') c->ended = true;
+      }
+      for (size_t k = split; k < len; k++) {
+        if (!strict && base64_decode_table[p[k]] == B64_SPACE) continue;
+        c->carry[c->carry_len++] = p[k];
+      }
+
+      if (final && c->carry_len > 0) {
+        ssize_t r = stream_base64_carry(c, o, flags);
+        if (r < 0) return -1;
+        o += r;
+      }
+      break;
+    }
+
+    default:
+      memcpy(o, in, len);
+      o += len;
+      break;
+  }
+
+  return o - out;
+}
@@ -0,0 +1,101 @@
+#ifndef NODE_CRYPTO_CODEC_H_
+#define NODE_CRYPTO_CODEC_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Hex and base64 codecs shared by all the crypto classes. The raw
+// functions write into caller owned memory; the others malloc the result
+// like the rest of crypto.cc does.
+//
+// codec_init() picks the fastest implementation the CPU supports
+// (AVX2, SSE2 or a table driven scalar loop). Until it has been called
+// the scalar code is used.
+
+void codec_init();
+
+// Writes 2*len lowercase hex characters to out.
+void hex_encode_raw(const unsigned char *in, size_t len, char *out);
+
+// Decodes len hex characters (either case) into len/2 bytes at out.
+// Returns the number of bytes written, or -1 if len is odd or any
+// character is not a hex digit.
+ssize_t hex_decode_raw(const char *in, size_t len, unsigned char *out);
+
+// Scalar reference versions, always available.
+void hex_encode_scalar(const unsigned char *in, size_t len, char *out);
+ssize_t hex_decode_scalar(const char *in, size_t len, unsigned char *out);
+
+// Base64 (RFC 4648, standard alphabet, padded, no line breaks).
+//
+// By default the decoder skips whitespace and accepts missing padding.
+// BASE64_STRICT rejects both, and also non-zero bits left over in the
+// last character, so only canonical encodings decode.
+#define BASE64_STRICT 1
+
+#define base64_encoded_len(len) (4 * (((size_t) (len) + 2) / 3))
+#define base64_decoded_max(len) (3 * ((size_t) (len) / 4) + 3)
+
+// Writes base64_encoded_len(len) characters to out.
+void base64_encode_raw(const unsigned char *in, size_t len, char *out);
+
+// Decodes into out, which needs base64_decoded_max(len) bytes.
+// Returns the number of bytes written, or -1 on invalid input.
+ssize_t base64_decode_raw(const char *in, size_t len, unsigned char *out, int flags);
+
+void base64_encode_scalar(const unsigned char *in, size_t len, char *out);
+ssize_t base64_decode_scalar(const char *in, size_t len, unsigned char *out, int flags);
+
+void hex_encode(unsigned char *md_value, int md_len, char** md_hexdigest, int* md_hex_len);
+
+// Returns 0, or -1 with *buf64 set to NULL on invalid input.
+int hex_decode(unsigned char *input, int length, char** buf64, int* buf64_len);
+
+void base64(unsigned char *input, int length, char** buf64, int* buf64_len);
+
+// Returns 0, or -1 with *buffer set to NULL on invalid input.
+int unbase64(unsigned char *input, int length, char** buffer, int* buffer_len, int flags);
+
+// Length of the longest prefix of buffer that does not end inside a
+// UTF-8 sequence.
+size_t utf8_complete_len(const unsigned char *buffer, size_t len);
+
+// Incremental codecs for data that arrives in chunks. Whatever does not
+// make a whole unit yet (up to 2 bytes for base64 output, 3 characters of
+// base64 input, 1 hex digit, 3 bytes of a UTF-8 sequence) is carried
+// inline to the next call, so no chunk needs an extra allocation.
+//
+// Encoding turns bytes into text: STREAM_HEX and STREAM_BASE64 encode,
+// STREAM_UTF8 holds back a trailing partial sequence. Decoding turns
+// STREAM_HEX or STREAM_BASE64 text back into bytes. A codec is used in
+// one direction only.
+#define STREAM_BINARY 0
+#define STREAM_HEX 1
+#define STREAM_BASE64 2
+#define STREAM_UTF8 3
+
+struct stream_codec {
+  int type;
+  int carry_len;
+  bool ended;                 // base64 padding seen, no more input allowed
+  unsigned char carry[4];
+};
+
+void stream_codec_init(struct stream_codec *c, int type);
+
+// Output bounds for one call with len bytes of input.
+#define stream_encoded_max(len) (2 * (size_t) (len) + 8)
+#define stream_decoded_max(len) ((size_t) (len) + 4)
+
+// Returns the number of characters written to out. final flushes the
+// carry, padding base64 output.
+size_t stream_encode(struct stream_codec *c, const unsigned char *in, size_t len,
+                     char *out, bool final);
+
+// Returns the number of bytes written to out, or -1 on invalid input.
+// final rejects a carry that can not be decoded on its own. flags are
+// the base64_decode_raw flags.
+ssize_t stream_decode(struct stream_codec *c, const char *in, size_t len,
+                      unsigned char *out, int flags, bool final);
+
+#endif  // NODE_CRYPTO_CODEC_H_
@@ -1,126 +1,396 @@
 #include <node.h>
 #include <node_events.h>
+#include <node_buffer.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 #include <openssl/hmac.h>
 #include <openssl/err.h>
+#include <openssl/crypto.h>
+
+#include "codec.h"
+#include "kdf.h"
 
 #define EVP_F_EVP_DECRYPTFINAL 101
 
 using namespace v8;
 using namespace node;
 
-void hex_encode(unsigned char *md_value, int md_len, char** md_hexdigest, int* md_hex_len) {
-  *md_hex_len = (2*(md_len));
-  *md_hexdigest = (char *) malloc(*md_hex_len + 1);
-  for(int i = 0; i < md_len; i++) {
-    sprintf((char *)(*md_hexdigest + (i*2)), "%02x",  md_value[i]);
+// Strings up to this size are decoded into one reused scratch buffer,
+// larger ones get a heap buffer of their own for the call.
+#define SCRATCH_MAX (64 * 1024)
+
+static char *scratch_buf;
+static size_t scratch_size;
+static bool scratch_busy;
+
+// The bytes of a string or Buffer argument, valid for the lifetime of
+// this object. Buffers are used in place with no copy. len is negative
+// if the argument can not be decoded.
+class ArgBytes {
+ public:
+  ArgBytes()
+  {
+    data = NULL;
+    len = -1;
+    owned_ = false;
+    scratch_ = false;
+  }
+
+  ArgBytes(Handle<Value> val, enum encoding enc)
+  {
+    data = NULL;
+    len = -1;
+    owned_ = false;
+    scratch_ = false;
+    Decode(val, enc);
+  }
+
+  void Decode(Handle<Value> val, enum encoding enc)
+  {
+    assert(data == NULL);
+
+    if (Buffer::HasInstance(val)) {
+      Local<Object> buffer_obj = val->ToObject();
+      data = Buffer::Data(buffer_obj);
+      len = Buffer::Length(buffer_obj);
+      return;
+    }
+
+    len = DecodeBytes(val, enc);
+    if (len < 0)
+      return;
+
+    if (!scratch_busy && len <= SCRATCH_MAX) {
+      if (scratch_size < (size_t) len + 1) {
+        free(scratch_buf);
+        scratch_size = len + 1 < 1024 ? 1024 : len + 1;
+        scratch_buf = (char *) malloc(scratch_size);
+      }
+      data = scratch_buf;
+      scratch_busy = scratch_ = true;
+    } else {
+      data = (char *) malloc(len + 1);
+      owned_ = true;
+    }
+
+    ssize_t written = DecodeWrite(data, len, val, enc);
+    assert(written == len);
+  }
+
+  ~ArgBytes()
+  {
+    if (owned_) free(data);
+    if (scratch_) scratch_busy = false;
   }
+
+  char *data;
+  ssize_t len;
+
+ private:
+  bool owned_;
+  bool scratch_;
+};
+
+static inline bool
+IsBytes(Handle<Value> val)
+{
+  return val->IsString() || Buffer::HasInstance(val);
 }
 
-#define hex2i(c) ((c) <= '9' ? ((c) - '0') : (c) <= 'Z' ? ((c) - 'A' + 10) : ((c) - 'a' + 10))
-void hex_decode(unsigned char *input, int length, char** buf64, int* buf64_len) {
-  *buf64_len = (length/2);
-  *buf64 = (char*) malloc(length/2 + 1);
-  char *b = *buf64;
-  for(int i = 0; i < length-1; i+=2) {
-    b[i/2]  = (hex2i(input[i])<<4) | (hex2i(input[i+1]));
+// Algorithm registry. Every digest and cipher OpenSSL knows gets a small
+// integer ID when the module loads; crypto.algorithms maps each name and
+// alias to its ID. Anything that takes an algorithm name also takes an
+// ID, which skips the string conversion and OpenSSL's name lookup.
+struct algorithm {
+  const EVP_MD *md;
+  const EVP_CIPHER *cipher;
+};
+
+#define MAX_ALGORITHMS 1024
+static struct algorithm algorithms[MAX_ALGORITHMS];
+static int algorithm_count = 1;  // 0 is never a valid ID
+
+// update() also takes an array of chunks, each a string or Buffer, and
+// feeds them through in order in one call.
+static bool
+IsChunkArray(Handle<Value> val)
+{
+  if (!val->IsArray()) return false;
+  Handle<Array> chunks = Handle<Array>::Cast(val);
+  for (int i = 0; i < (int) chunks->Length(); i++) {
+    if (!IsBytes(chunks->Get(Integer::New(i)))) return false;
   }
+  return true;
 }
 
-void base64(unsigned char *input, int length, char** buf64, int* buf64_len)
+static inline bool
+IsAlgorithm(Handle<Value> val)
 {
-  BIO *bmem, *b64;
-  BUF_MEM *bptr;
+  return val->IsString() || val->IsInt32();
+}
 
-  b64 = BIO_new(BIO_f_base64());
-  bmem = BIO_new(BIO_s_mem());
-  b64 = BIO_push(b64, bmem);
-  BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-  BIO_write(b64, input, length);
-  BIO_flush(b64);
-  BIO_get_mem_ptr(b64, &bptr);
+static const EVP_MD *
+ResolveDigest(Handle<Value> val)
+{
+  if (val->IsInt32()) {
+    int32_t id = val->Int32Value();
+    return id > 0 && id < algorithm_count ? algorithms[id].md : NULL;
+  }
+  String::Utf8Value name(val->ToString());
+  return EVP_get_digestbyname(*name);
+}
 
-  *buf64_len = bptr->length;
-  *buf64 = (char *)malloc(*buf64_len+1);
-  memcpy(*buf64, bptr->data, bptr->length);
-  char* b = *buf64;
-  b[bptr->length] = 0;
+static const EVP_CIPHER *
+ResolveCipher(Handle<Value> val)
+{
+  if (val->IsInt32()) {
+    int32_t id = val->Int32Value();
+    return id > 0 && id < algorithm_count ? algorithms[id].cipher : NULL;
+  }
+  String::Utf8Value name(val->ToString());
+  return EVP_get_cipherbyname(*name);
+}
 
-  BIO_free_all(b64);
+static void
+UnknownAlgorithm(const char *kind, Handle<Value> val)
+{
+  String::Utf8Value name(val->ToString());
+  fprintf(stderr, "node-crypto : Unknown %s %s\n", kind, *name);
+}
 
+// Aliases share the ID of the algorithm they name.
+static int
+RegisterAlgorithm(const EVP_MD *md, const EVP_CIPHER *cipher)
+{
+  for (int i = 1; i < algorithm_count; i++) {
+    if (algorithms[i].md == md && algorithms[i].cipher == cipher)
+      return i;
+  }
+  if (algorithm_count == MAX_ALGORITHMS)
+    return 0;
+  algorithms[algorithm_count].md = md;
+  algorithms[algorithm_count].cipher = cipher;
+  return algorithm_count++;
 }
 
-void *unbase64(unsigned char *input, int length, char** buffer, int* buffer_len)
+static void
+AddDigestName(const EVP_MD *md, const char *from, const char *to, void *arg)
 {
-  BIO *b64, *bmem;
-  *buffer = (char *)malloc(length);
-  memset(*buffer, 0, length);
+  if (!md) md = EVP_get_digestbyname(from);
+  int id = md ? RegisterAlgorithm(md, NULL) : 0;
+  if (id) (*(Local<Object> *) arg)->Set(String::New(from), Integer::New(id));
+}
 
-  b64 = BIO_new(BIO_f_base64());
-  BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-  bmem = BIO_new_mem_buf(input, length);
-  bmem = BIO_push(b64, bmem);
+static void
+AddCipherName(const EVP_CIPHER *cipher, const char *from, const char *to, void *arg)
+{
+  if (!cipher) cipher = EVP_get_cipherbyname(from);
+  int id = cipher ? RegisterAlgorithm(NULL, cipher) : 0;
+  if (id) (*(Local<Object> *) arg)->Set(String::New(from), Integer::New(id));
+}
 
-  *buffer_len = BIO_read(bmem, *buffer, length);
-  BIO_free_all(bmem);
+static void
+InitAlgorithms(Handle<Object> target)
+{
+  HandleScope scope;
 
+  Local<Object> names = Object::New();
+  EVP_MD_do_all_sorted(AddDigestName, &names);
+  EVP_CIPHER_do_all_sorted(AddCipherName, &names);
+  target->Set(String::NewSymbol("algorithms"), names);
 }
 
+// Encodes a digest held on the stack without going through malloc.
+// Returns an empty handle for an unknown encoding.
+static Local<Value>
+EncodeDigest(unsigned char* md_value, unsigned int md_len, Handle<Value> encoding_v)
+{
+  HandleScope scope;
 
-// LengthWithoutIncompleteUtf8 from V8 d8-posix.cc
-// see http://v8.googlecode.com/svn/trunk/src/d8-posix.cc
-static int LengthWithoutIncompleteUtf8(char* buffer, int len) {
-  int answer = len;
-  // 1-byte encoding.
-  static const int kUtf8SingleByteMask = 0x80;
-  static const int kUtf8SingleByteValue = 0x00;
-  // 2-byte encoding.
-  static const int kUtf8TwoByteMask = 0xe0;
-  static const int kUtf8TwoByteValue = 0xc0;
-  // 3-byte encoding.
-  static const int kUtf8ThreeByteMask = 0xf0;
-  static const int kUtf8ThreeByteValue = 0xe0;
-  // 4-byte encoding.
-  static const int kUtf8FourByteMask = 0xf8;
-  static const int kUtf8FourByteValue = 0xf0;
-  // Subsequent bytes of a multi-byte encoding.
-  static const int kMultiByteMask = 0xc0;
-  static const int kMultiByteValue = 0x80;
-  int multi_byte_bytes_seen = 0;
-  while (answer > 0) {
-    int c = buffer[answer - 1];
-    // Ends in valid single-byte sequence?
-    if ((c & kUtf8SingleByteMask) == kUtf8SingleByteValue) return answer;
-    // Ends in one or more subsequent bytes of a multi-byte value?
-    if ((c & kMultiByteMask) == kMultiByteValue) {
-      multi_byte_bytes_seen++;
-      answer--;
-    } else {
-      if ((c & kUtf8TwoByteMask) == kUtf8TwoByteValue) {
-        if (multi_byte_bytes_seen >= 1) {
-          return answer + 2;
-        }
-        return answer - 1;
-      } else if ((c & kUtf8ThreeByteMask) == kUtf8ThreeByteValue) {
-        if (multi_byte_bytes_seen >= 2) {
-          return answer + 3;
-        }
-        return answer - 1;
-      } else if ((c & kUtf8FourByteMask) == kUtf8FourByteValue) {
-        if (multi_byte_bytes_seen >= 3) {
-          return answer + 4;
-        }
-        return answer - 1;
-      } else {
-        return answer;  // Malformed UTF-8.
-      }
-    }
+  if (encoding_v.IsEmpty() || !encoding_v->IsString()) {
+    return scope.Close(Encode(md_value, md_len, BINARY));
   }
-  return 0;
+
+  char out[base64_encoded_len(EVP_MAX_MD_SIZE) + 2*EVP_MAX_MD_SIZE];
+  String::Utf8Value encoding(encoding_v->ToString());
+  if (strcasecmp(*encoding, "hex") == 0) {
+    hex_encode_raw(md_value, md_len, out);
+    return scope.Close(Encode(out, 2*md_len, BINARY));
+  } else if (strcasecmp(*encoding, "base64") == 0) {
+    base64_encode_raw(md_value, md_len, out);
+    return scope.Close(Encode(out, base64_encoded_len(md_len), BINARY));
+  } else if (strcasecmp(*encoding, "binary") == 0) {
+    return scope.Close(Encode(md_value, md_len, BINARY));
+  }
+  return Local<Value>();
+}
+
+// True if EncodeDigest would accept encoding_v.
+static bool
+IsDigestEncoding(Handle<Value> encoding_v)
+{
+  if (encoding_v.IsEmpty() || !encoding_v->IsString())
+    return true;
+  String::Utf8Value encoding(encoding_v->ToString());
+  return strcasecmp(*encoding, "hex") == 0 || strcasecmp(*encoding, "base64") == 0 ||
+         strcasecmp(*encoding, "binary") == 0;
+}
+
+// Flags for every base64 decode; crypto.setBase64Strict() sets
+// BASE64_STRICT.
+static int base64_flags = 0;
+
+
+// Scratch memory a Cipher or Decipher keeps between update() calls, so
+// streaming does not allocate per chunk. It grows to the largest chunk
+// seen.
+struct scratch {
+  char *data;
+  size_t size;
+};
+
+static char *
+ScratchReserve(struct scratch *s, size_t n)
+{
+  if (n > s->size) {
+    free(s->data);
+    s->size = n < 1024 ? 1024 : n;
+    s->data = (char *) malloc(s->size);
+  }
+  return s->data;
+}
+
+// Like ScratchReserve, but keeps what the buffer already holds.
+static char *
+ScratchGrow(struct scratch *s, size_t n)
+{
+  if (n > s->size) {
+    s->size = n < 2 * s->size ? 2 * s->size : n;
+    s->data = (char *) realloc(s->data, s->size);
+  }
+  return s->data;
+}
+
+// update()/final() state of a Cipher or Decipher: the input codec
+// decodes hex or base64 data arguments and the output codec encodes the
+// result, each carrying partial units from one call to the next.
+struct cipher_stream {
+  struct stream_codec in;
+  struct stream_codec out;
+  struct scratch in_buf;
+  struct scratch out_buf;
+  struct scratch text_buf;
+};
+
+static void
+StreamInit(struct cipher_stream *s)
+{
+  memset(s, 0, sizeof(*s));
+  stream_codec_init(&s->in, STREAM_BINARY);
+  stream_codec_init(&s->out, STREAM_BINARY);
+}
+
+// Drops any carry, for a new message.
+static void
+StreamReset(struct cipher_stream *s)
+{
+  stream_codec_init(&s->in, s->in.type);
+  stream_codec_init(&s->out, s->out.type);
+}
+
+static void
+StreamFree(struct cipher_stream *s)
+{
+  free(s->in_buf.data);
+  free(s->out_buf.data);
+  free(s->text_buf.data);
+}
+
+// The STREAM_* type for an encoding argument. Encodings that need no
+// carry are STREAM_BINARY, with the node encoding to use in *enc.
+static int
+StreamType(Handle<Value> encoding_v, enum encoding *enc)
+{
+  *enc = BINARY;
+  if (!encoding_v->IsString()) return STREAM_BINARY;
+  String::Utf8Value encoding(encoding_v->ToString());
+  if (strcasecmp(*encoding, "hex") == 0) return STREAM_HEX;
+  if (strcasecmp(*encoding, "base64") == 0) return STREAM_BASE64;
+  *enc = ParseEncoding(encoding_v);
+  return *enc == UTF8 ? STREAM_UTF8 : STREAM_BINARY;
+}
+
+// Decodes the data argument of update() into *bytes. Returns the
+// length, -1 if data is not a string or Buffer, or -2 if it is not valid
+// hex or base64.
+static ssize_t
+StreamInputAs(struct cipher_stream *s, Handle<Value> data, int type, enum encoding enc,
+              ArgBytes *raw, char **bytes)
+{
+  if (type == STREAM_UTF8) type = STREAM_BINARY;  // strings never split a character
+
+  raw->Decode(data, enc);
+  if (raw->len < 0) return -1;
+  if (type == STREAM_BINARY) {
+    *bytes = raw->data;
+    return raw->len;
+  }
+
+  if (s->in.type != type) stream_codec_init(&s->in, type);
+  *bytes = ScratchReserve(&s->in_buf, stream_decoded_max(raw->len));
+  ssize_t n = stream_decode(&s->in, raw->data, raw->len, (unsigned char *) *bytes,
+                            base64_flags, false);
+  return n < 0 ? -2 : n;
+}
+
+static ssize_t
+StreamInput(struct cipher_stream *s, Handle<Value> data, Handle<Value> encoding_v,
+            ArgBytes *raw, char **bytes)
+{
+  enum encoding enc;
+  int type = StreamType(encoding_v, &enc);
+  return StreamInputAs(s, data, type, enc, raw, bytes);
+}
+
+// At final(), decodes whatever the input codec still carries. Returns
+// the length, or -2 if the carry is not valid on its own.
+static ssize_t
+StreamFlushInput(struct cipher_stream *s, char **bytes)
+{
+  *bytes = ScratchReserve(&s->in_buf, stream_decoded_max(0));
+  if (s->in.type == STREAM_BINARY) return 0;
+  ssize_t n = stream_decode(&s->in, NULL, 0, (unsigned char *) *bytes, base64_flags, true);
+  return n < 0 ? -2 : n;
+}
+
+static const char *
+StreamInputError(struct cipher_stream *s)
+{
+  return s->in.type == STREAM_HEX ? "Bad hex input" : "Bad base64 input";
+}
+
+// Encodes update()/final() output for the encoding argument.
+static Local<Value>
+StreamOutput(struct cipher_stream *s, Handle<Value> encoding_v,
+             unsigned char *out, int out_len, bool final)
+{
+  enum encoding enc;
+  int type = StreamType(encoding_v, &enc);
+  if (s->out.type != type) stream_codec_init(&s->out, type);
+  if (type == STREAM_BINARY) return Encode(out, out_len, enc);
+
+  char *text = ScratchReserve(&s->text_buf, stream_encoded_max(out_len));
+  size_t n = stream_encode(&s->out, out, out_len, text, final);
+  return Encode(text, n, type == STREAM_UTF8 ? UTF8 : BINARY);
 }
 
 // local decrypt final without strict padding check
@@ -177,876 +447,1164 @@ int local_EVP_DecryptFinal_ex(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl
 
 
 
-class Cipher : public ObjectWrap {
+// Size-bounded LRU map from byte strings to reference counted values.
+// Lookups and inserts take a mutex since they happen both on the event
+// loop and on the eio thread pool. Keys are compared in full, the hash
+// only picks the bucket.
+class LruCache {
  public:
-  static void
-  Initialize (v8::Handle<v8::Object> target)
-  {
-    HandleScope scope;
+  // ref takes a new reference to a cached value for a caller,
+  // unref drops one.
+  typedef void* (*RefFn)(void* value);
+  typedef void (*UnrefFn)(void* value);
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+  LruCache(unsigned int capacity, RefFn ref, UnrefFn unref)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    ref_ = ref;
+    unref_ = unref;
+    capacity_ = capacity;
+    size_ = 0;
+    hits_ = misses_ = evictions_ = 0;
+    head_.lru_prev = head_.lru_next = &head_;
+    nbuckets_ = 0;
+    buckets_ = NULL;
+    Rehash(capacity);
+  }
 
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+  ~LruCache()
+  {
+    Flush();
+    free(buckets_);
+    pthread_mutex_destroy(&mutex);
+  }
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", CipherInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "initiv", CipherInitIv);
-    NODE_SET_PROTOTYPE_METHOD(t, "update", CipherUpdate);
-    NODE_SET_PROTOTYPE_METHOD(t, "final", CipherFinal);
+  // Returns a new reference to the cached value or NULL on a miss.
+  void* Get(int tag, const char* key, int key_len)
+  {
+    uint32_t hash = Hash(tag, key, key_len);
+    void* value = NULL;
+
+    pthread_mutex_lock(&mutex);
+    struct entry* e = Find(hash, tag, key, key_len);
+    if (e) {
+      // Move to the most recently used end.
+      Unlink(e);
+      LinkFront(e);
+      value = ref_(e->value);
+      hits_++;
+    } else {
+      misses_++;
+    }
+    pthread_mutex_unlock(&mutex);
 
-    target->Set(String::NewSymbol("Cipher"), t->GetFunction());
+    return value;
   }
 
-  bool CipherInit(char* cipherType, char* key_buf, int key_buf_len)
+  // Stores a new reference to value under key, evicting the least
+  // recently used entries beyond capacity. The caller keeps its own
+  // reference.
+  void Put(int tag, const char* key, int key_len, void* value)
   {
-    cipher = EVP_get_cipherbyname(cipherType);
-    if(!cipher) {
-      fprintf(stderr, "node-crypto : Unknown cipher %s\n", cipherType);
-      return false;
-    }
+    uint32_t hash = Hash(tag, key, key_len);
 
-    unsigned char key[EVP_MAX_KEY_LENGTH],iv[EVP_MAX_IV_LENGTH];
-    int key_len = EVP_BytesToKey(cipher, EVP_md5(), NULL, (unsigned char*) key_buf, key_buf_len, 1, key, iv);
+    pthread_mutex_lock(&mutex);
+    if (capacity_ == 0 || Find(hash, tag, key, key_len) != NULL) {
+      // Disabled, or another thread raced us to it.
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
 
-    EVP_CIPHER_CTX_init(&ctx);
-    EVP_CipherInit(&ctx,cipher,(unsigned char *)key,(unsigned char *)iv, true);
-    if (!EVP_CIPHER_CTX_set_key_length(&ctx,key_len)) {
-    	fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
-    	EVP_CIPHER_CTX_cleanup(&ctx);
-    	return false;
+    struct entry* e = (struct entry*) malloc(sizeof(struct entry) + key_len);
+    e->hash = hash;
+    e->tag = tag;
+    e->key_len = key_len;
+    memcpy(e->key, key, key_len);
+    e->value = ref_(value);
+
+    struct entry** bucket = &buckets_[hash & (nbuckets_ - 1)];
+    e->hash_next = *bucket;
+    *bucket = e;
+    LinkFront(e);
+    size_++;
+
+    while (size_ > capacity_) {
+      Remove(head_.lru_prev);
+      evictions_++;
     }
-    initialised = true;
-    return true;
+    pthread_mutex_unlock(&mutex);
   }
 
-
-  bool CipherInitIv(char* cipherType, char* key, int key_len, char *iv, int iv_len)
+  void Flush()
   {
-    cipher = EVP_get_cipherbyname(cipherType);
-    if(!cipher) {
-      fprintf(stderr, "node-crypto : Unknown cipher %s\n", cipherType);
-      return false;
-    }
-    if (EVP_CIPHER_iv_length(cipher)!=iv_len) {
-    	fprintf(stderr, "node-crypto : Invalid IV length %d\n", iv_len);
-      return false;
-    }
-    EVP_CIPHER_CTX_init(&ctx);
-    EVP_CipherInit(&ctx,cipher,(unsigned char *)key,(unsigned char *)iv, true);
-    if (!EVP_CIPHER_CTX_set_key_length(&ctx,key_len)) {
-    	fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
-    	EVP_CIPHER_CTX_cleanup(&ctx);
-    	return false;
+    pthread_mutex_lock(&mutex);
+    while (size_ > 0) {
+      Remove(head_.lru_prev);
     }
-    initialised = true;
-    return true;
+    pthread_mutex_unlock(&mutex);
   }
 
-
-  int CipherUpdate(char* data, int len, unsigned char** out, int* out_len) {
-    if (!initialised)
-      return 0;
-    *out_len=len+EVP_CIPHER_CTX_block_size(&ctx);
-    *out=(unsigned char*)malloc(*out_len);
-    
-    EVP_CipherUpdate(&ctx, *out, out_len, (unsigned char*)data, len);
-    return 1;
+  void SetCapacity(unsigned int capacity)
+  {
+    pthread_mutex_lock(&mutex);
+    capacity_ = capacity;
+    while (size_ > capacity_) {
+      Remove(head_.lru_prev);
+      evictions_++;
+    }
+    Rehash(capacity);
+    pthread_mutex_unlock(&mutex);
   }
 
-  int CipherFinal(unsigned char** out, int *out_len) {
-    if (!initialised)
-      return 0;
-    *out = (unsigned char*) malloc(EVP_CIPHER_CTX_block_size(&ctx));
-    EVP_CipherFinal(&ctx,*out,out_len);
-    EVP_CIPHER_CTX_cleanup(&ctx);
-    initialised = false;
-    return 1;
+  void Stats(unsigned int* capacity, unsigned int* size,
+             uint64_t* hits, uint64_t* misses, uint64_t* evictions)
+  {
+    pthread_mutex_lock(&mutex);
+    *capacity = capacity_;
+    *size = size_;
+    *hits = hits_;
+    *misses = misses_;
+    *evictions = evictions_;
+    pthread_mutex_unlock(&mutex);
   }
 
+ private:
+  struct entry {
+    struct entry* lru_prev;
+    struct entry* lru_next;
+    struct entry* hash_next;
+    uint32_t hash;
+    int tag;
+    void* value;
+    int key_len;
+    char key[1];
+  };
+
+  // FNV-1a
+  static uint32_t Hash(int tag, const char* key, int key_len)
+  {
+    uint32_t h = 2166136261U ^ (uint32_t) tag;
+    for (int i = 0; i < key_len; i++) {
+      h ^= (unsigned char) key[i];
+      h *= 16777619U;
+    }
+    return h;
+  }
 
- protected:
-
-  static Handle<Value>
-  New (const Arguments& args)
+  struct entry* Find(uint32_t hash, int tag, const char* key, int key_len)
   {
-    HandleScope scope;
+    struct entry* e = buckets_[hash & (nbuckets_ - 1)];
+    for (; e != NULL; e = e->hash_next) {
+      if (e->hash == hash && e->tag == tag && e->key_len == key_len &&
+          memcmp(e->key, key, key_len) == 0) {
+        return e;
+      }
+    }
+    return NULL;
+  }
 
-    Cipher *cipher = new Cipher();
-    cipher->Wrap(args.This());
-    return args.This();
+  void LinkFront(struct entry* e)
+  {
+    e->lru_next = head_.lru_next;
+    e->lru_prev = &head_;
+    head_.lru_next->lru_prev = e;
+    head_.lru_next = e;
   }
 
-  static Handle<Value>
-  CipherInit(const Arguments& args) {
-    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
-		
-    HandleScope scope;
+  void Unlink(struct entry* e)
+  {
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+  }
 
-    cipher->incomplete_base64=NULL;
+  void Remove(struct entry* e)
+  {
+    struct entry** p = &buckets_[e->hash & (nbuckets_ - 1)];
+    while (*p != e) p = &(*p)->hash_next;
+    *p = e->hash_next;
+    Unlink(e);
+    size_--;
+    unref_(e->value);
+    OPENSSL_cleanse(e->key, e->key_len);
+    free(e);
+  }
 
-    if (args.Length() <= 1 || !args[0]->IsString() || !args[1]->IsString()) {
-      return ThrowException(String::New("Must give cipher-type, key"));
+  void Rehash(unsigned int capacity)
+  {
+    unsigned int n = 16;
+    while (n < capacity) n <<= 1;
+    if (n == nbuckets_) return;
+
+    struct entry** buckets = (struct entry**) calloc(n, sizeof(struct entry*));
+    for (struct entry* e = head_.lru_next; e != &head_; e = e->lru_next) {
+      struct entry** bucket = &buckets[e->hash & (n - 1)];
+      e->hash_next = *bucket;
+      *bucket = e;
     }
-    
+    free(buckets_);
+    buckets_ = buckets;
+    nbuckets_ = n;
+  }
 
-    ssize_t key_buf_len = DecodeBytes(args[1], BINARY);
+  pthread_mutex_t mutex;
+  RefFn ref_;
+  UnrefFn unref_;
+  unsigned int capacity_;
+  unsigned int size_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+  struct entry head_;
+  struct entry** buckets_;
+  unsigned int nbuckets_;
+};
 
-    if (key_buf_len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
-    }
-    
-    char* key_buf = new char[key_buf_len];
-    ssize_t key_written = DecodeWrite(key_buf, key_buf_len, args[1], BINARY);
-    assert(key_written == key_buf_len);
-    
-    String::Utf8Value cipherType(args[0]->ToString());
 
-    bool r = cipher->CipherInit(*cipherType, key_buf, key_buf_len);
+// Parsed keys keyed by the PEM text they came from, so callers that keep
+// passing the same PEM string to sign/verify skip PEM_read_bio_*.
+// Certificates are cached as their public key, which is all Verify needs.
+#define KEY_CACHE_PRIVATE_KEY 0
+#define KEY_CACHE_CERTIFICATE 1
+#define KEY_CACHE_DEFAULT_CAPACITY 64
 
-    return args.This();
-  }
+static LruCache *key_cache;
 
-  static Handle<Value>
-  CipherInitIv(const Arguments& args) {
-    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
-		
-    HandleScope scope;
+static void*
+pkey_ref(void* value)
+{
+  EVP_PKEY* pkey = (EVP_PKEY*) value;
+  CRYPTO_add(&pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+  return pkey;
+}
 
-    cipher->incomplete_base64=NULL;
+static void
+pkey_unref(void* value)
+{
+  EVP_PKEY_free((EVP_PKEY*) value);
+}
 
-    if (args.Length() <= 2 || !args[0]->IsString() || !args[1]->IsString() || !args[2]->IsString()) {
-      return ThrowException(String::New("Must give cipher-type, key, and iv as argument"));
-    }
-    ssize_t key_len = DecodeBytes(args[1], BINARY);
+// Returns a new reference, or NULL if the PEM does not parse.
+static EVP_PKEY*
+LoadPrivateKey(char* keyPem, int keyPemLen)
+{
+  EVP_PKEY* pkey = (EVP_PKEY*) key_cache->Get(KEY_CACHE_PRIVATE_KEY, keyPem, keyPemLen);
+  if (pkey != NULL)
+    return pkey;
 
-    if (key_len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
-    }
-    
-    ssize_t iv_len = DecodeBytes(args[2], BINARY);
+  BIO *bp = BIO_new(BIO_s_mem());
+  if (!BIO_write(bp, keyPem, keyPemLen)) {
+    BIO_free(bp);
+    return NULL;
+  }
 
-    if (iv_len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
-    }
+  pkey = PEM_read_bio_PrivateKey(bp, NULL, NULL, NULL);
+  BIO_free(bp);
 
-    char* key_buf = new char[key_len];
-    ssize_t key_written = DecodeWrite(key_buf, key_len, args[1], BINARY);
-    assert(key_written == key_len);
-    
-    char* iv_buf = new char[iv_len];
-    ssize_t iv_written = DecodeWrite(iv_buf, iv_len, args[2], BINARY);
-    assert(iv_written == iv_len);
+  if (pkey != NULL)
+    key_cache->Put(KEY_CACHE_PRIVATE_KEY, keyPem, keyPemLen, pkey);
+  return pkey;
+}
 
-    String::Utf8Value cipherType(args[0]->ToString());
-    	
-    bool r = cipher->CipherInitIv(*cipherType, key_buf,key_len,iv_buf,iv_len);
+// Returns a new reference to the certificate's public key, or NULL if
+// the PEM does not parse.
+static EVP_PKEY*
+LoadCertificateKey(char* certPem, int certPemLen)
+{
+  EVP_PKEY* pkey = (EVP_PKEY*) key_cache->Get(KEY_CACHE_CERTIFICATE, certPem, certPemLen);
+  if (pkey != NULL)
+    return pkey;
 
-    return args.This();
+  BIO *bp = BIO_new(BIO_s_mem());
+  if (!BIO_write(bp, certPem, certPemLen)) {
+    BIO_free(bp);
+    return NULL;
   }
 
+  X509 *x509 = PEM_read_bio_X509(bp, NULL, NULL, NULL);
+  BIO_free(bp);
+  if (x509 == NULL)
+    return NULL;
 
-  static Handle<Value>
-  CipherUpdate(const Arguments& args) {
-    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
+  pkey = X509_get_pubkey(x509);
+  X509_free(x509);
 
-    HandleScope scope;
+  if (pkey != NULL)
+    key_cache->Put(KEY_CACHE_CERTIFICATE, certPem, certPemLen, pkey);
+  return pkey;
+}
 
-    enum encoding enc = ParseEncoding(args[1]);
-    ssize_t len = DecodeBytes(args[0], enc);
 
-    if (len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
-    }
+// Free-list of OpenSSL contexts of one type. Hash, Hmac, Sign and Verify
+// take a context at init() and give it back once digest(), sign() or
+// verify() is done, so objects waiting for the garbage collector hold no
+// context and the next init() skips the allocation. Cipher and Decipher
+// keep theirs until the next init() for reset(iv). Contexts come back
+// from the thread pool as well, hence the mutex.
+#define CONTEXT_POOL_DEFAULT_CAPACITY 256
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], enc);
-    assert(written == len);
+class ContextPool {
+ public:
+  // init sets up a new context, scrub wipes one coming back (keeping
+  // what can be reused) and destroy frees what it holds.
+  ContextPool(size_t ctx_size, void (*init)(void*), void (*scrub)(void*),
+              void (*destroy)(void*), int capacity)
+  {
+    this->ctx_size = ctx_size;
+    this->init = init;
+    this->scrub = scrub;
+    this->destroy = destroy;
+    this->capacity = capacity;
+    count = 0;
+    items = NULL;
+    slots = 0;
+    pthread_mutex_init(&mutex, NULL);
+  }
 
-    unsigned char *out=0;
-    int out_len=0;
-    int r = cipher->CipherUpdate(buf, len,&out,&out_len);
-    
-    Local<Value> outString;
-    if (out_len==0) outString=String::New("");
-    else {
-    	if (args.Length() <= 2 || !args[2]->IsString()) {
-	      // Binary
-	      outString = Encode(out, out_len, BINARY);
-	    } else {
-	      char* out_hexdigest;
-	      int out_hex_len;
-	      String::Utf8Value encoding(args[2]->ToString());
-	      if (strcasecmp(*encoding, "hex") == 0) {
-	        // Hex encoding
-	        hex_encode(out, out_len, &out_hexdigest, &out_hex_len);
-	        outString = Encode(out_hexdigest, out_hex_len, BINARY);
-	        free(out_hexdigest);
-	      } else if (strcasecmp(*encoding, "base64") == 0) {
-		// Base64 encoding
-		// Check to see if we need to add in previous base64 overhang
-		if (cipher->incomplete_base64!=NULL){
-		  unsigned char* complete_base64 = (unsigned char *)malloc(out_len+cipher->incomplete_base64_len+1);
-		  memcpy(complete_base64, cipher->incomplete_base64, cipher->incomplete_base64_len);
-		  memcpy(&complete_base64[cipher->incomplete_base64_len], out, out_len);
-		  free(out);
-		  free(cipher->incomplete_base64);
-		  cipher->incomplete_base64=NULL;
-		  out=complete_base64;
-		  out_len += cipher->incomplete_base64_len;
-		}
-
-		// Check to see if we need to trim base64 stream
-		if (out_len%3!=0){
-		  cipher->incomplete_base64_len = out_len%3;
-		  cipher->incomplete_base64 = (char *)malloc(cipher->incomplete_base64_len+1);
-		  memcpy(cipher->incomplete_base64, &out[out_len-cipher->incomplete_base64_len], cipher->incomplete_base64_len);
-		  out_len -= cipher->incomplete_base64_len;
-		  out[out_len]=0;
-		}
-
-	        base64(out, out_len, &out_hexdigest, &out_hex_len);
-	        outString = Encode(out_hexdigest, out_hex_len, BINARY);
-	        free(out_hexdigest);
-	      } else if (strcasecmp(*encoding, "binary") == 0) {
-	        outString = Encode(out, out_len, BINARY);
-	      } else {
-		fprintf(stderr, "node-crypto : Cipher .update encoding "
-			"can be binary, hex or base64\n");
-	      }
-	    }
+  void* Get()
+  {
+    void* ctx = NULL;
+    pthread_mutex_lock(&mutex);
+    if (count > 0) ctx = items[--count];
+    pthread_mutex_unlock(&mutex);
+
+    if (ctx == NULL) {
+      ctx = malloc(ctx_size);
+      init(ctx);
     }
-    if (out) free(out);
-    return scope.Close(outString);
+    return ctx;
   }
 
-  static Handle<Value>
-  CipherFinal(const Arguments& args) {
-    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
-
-    HandleScope scope;
-
-    unsigned char* out_value;
-    int out_len;
-    char* out_hexdigest;
-    int out_hex_len;
-    Local<Value> outString ;
-
-    int r = cipher->CipherFinal(&out_value, &out_len);
-
-    if (out_len == 0 || r == 0) {
-      return scope.Close(String::New(""));
+  void Put(void* ctx)
+  {
+    scrub(ctx);
+    pthread_mutex_lock(&mutex);
+    if (count < capacity && (count < slots || Grow())) {
+      items[count++] = ctx;
+      ctx = NULL;
     }
+    pthread_mutex_unlock(&mutex);
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      // Binary
-      outString = Encode(out_value, out_len, BINARY);
-    } else {
-      String::Utf8Value encoding(args[0]->ToString());
-      if (strcasecmp(*encoding, "hex") == 0) {
-        // Hex encoding
-        hex_encode(out_value, out_len, &out_hexdigest, &out_hex_len);
-        outString = Encode(out_hexdigest, out_hex_len, BINARY);
-        free(out_hexdigest);
-      } else if (strcasecmp(*encoding, "base64") == 0) {
-        base64(out_value, out_len, &out_hexdigest, &out_hex_len);
-        outString = Encode(out_hexdigest, out_hex_len, BINARY);
-        free(out_hexdigest);
-      } else if (strcasecmp(*encoding, "binary") == 0) {
-        outString = Encode(out_value, out_len, BINARY);
-      } else {
-	fprintf(stderr, "node-crypto : Cipher .final encoding "
-		"can be binary, hex or base64\n");
-      }
+    if (ctx != NULL) {
+      destroy(ctx);
+      free(ctx);
     }
-    free(out_value);
-    return scope.Close(outString);
-
   }
 
-  Cipher () : ObjectWrap () 
+  // Frees whatever does not fit the new capacity. The slot array only
+  // grows as contexts come back, so a large capacity costs nothing up
+  // front.
+  void SetCapacity(int n)
   {
-    initialised = false;
+    pthread_mutex_lock(&mutex);
+    while (count > n) {
+      void* ctx = items[--count];
+      destroy(ctx);
+      free(ctx);
+    }
+    if (n == 0) {
+      free(items);
+      items = NULL;
+      slots = 0;
+    } else if (n < slots) {
+      void** p = (void**) realloc(items, n * sizeof(void*));
+      if (p != NULL) {
+        items = p;
+        slots = n;
+      }
+    }
+    capacity = n;
+    pthread_mutex_unlock(&mutex);
   }
 
-  ~Cipher ()
+  int Count()
   {
+    pthread_mutex_lock(&mutex);
+    int n = count;
+    pthread_mutex_unlock(&mutex);
+    return n;
   }
 
  private:
+  // Called with the mutex held. Doubles the slot array up to capacity;
+  // on failure the old array is kept and the caller frees the context.
+  bool Grow()
+  {
+    int n = slots < 8 ? 8 : slots;
+    n = n > capacity / 2 ? capacity : n * 2;
+    void** p = (void**) realloc(items, n * sizeof(void*));
+    if (p == NULL)
+      return false;
+    items = p;
+    slots = n;
+    return true;
+  }
 
-  EVP_CIPHER_CTX ctx;
-  const EVP_CIPHER *cipher;
-  bool initialised;
-  char* incomplete_base64;
-  int incomplete_base64_len;
-
+  size_t ctx_size;
+  void (*init)(void*);
+  void (*scrub)(void*);
+  void (*destroy)(void*);
+  void** items;
+  int count;
+  int slots;                  // allocated length of items
+  int capacity;
+  pthread_mutex_t mutex;
 };
 
+static ContextPool *md_ctx_pool;
+static ContextPool *cipher_ctx_pool;
+static ContextPool *hmac_ctx_pool;
 
+static void
+md_ctx_init(void* ctx)
+{
+  EVP_MD_CTX_init((EVP_MD_CTX*) ctx);
+}
 
-class Decipher : public ObjectWrap {
- public:
-  static void
-  Initialize (v8::Handle<v8::Object> target)
-  {
-    HandleScope scope;
+// md_data is kept, wiped, so the next init with the same digest does not
+// allocate. EVP_DigestFinal_ex has wiped it already unless the context
+// comes back unfinished.
+static void
+md_ctx_scrub(void* p)
+{
+  EVP_MD_CTX* ctx = (EVP_MD_CTX*) p;
+  if (ctx->digest != NULL && ctx->md_data != NULL)
+    OPENSSL_cleanse(ctx->md_data, ctx->digest->ctx_size);
+}
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+static void
+md_ctx_destroy(void* ctx)
+{
+  EVP_MD_CTX_cleanup((EVP_MD_CTX*) ctx);
+}
 
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+static void
+cipher_ctx_init(void* ctx)
+{
+  EVP_CIPHER_CTX_init((EVP_CIPHER_CTX*) ctx);
+}
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", DecipherInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "initiv", DecipherInitIv);
-    NODE_SET_PROTOTYPE_METHOD(t, "update", DecipherUpdate);
-    NODE_SET_PROTOTYPE_METHOD(t, "final", DecipherFinal);
-    NODE_SET_PROTOTYPE_METHOD(t, "finaltol", DecipherFinalTolerate);
+// EVP_CipherInit starts from a blank context anyway, so the key schedule
+// just goes.
+static void
+cipher_ctx_scrub(void* ctx)
+{
+  EVP_CIPHER_CTX_cleanup((EVP_CIPHER_CTX*) ctx);
+}
 
-    target->Set(String::NewSymbol("Decipher"), t->GetFunction());
-  }
+static void
+hmac_ctx_init(void* ctx)
+{
+  HMAC_CTX_init((HMAC_CTX*) ctx);
+}
 
-  bool DecipherInit(char* cipherType, char* key_buf, int key_buf_len)
-  {
-    cipher = EVP_get_cipherbyname(cipherType);
-    if(!cipher) {
-      fprintf(stderr, "node-crypto : Unknown cipher %s\n", cipherType);
-      return false;
-    }
+// Like md_ctx_scrub for the three digest contexts, which also hold the
+// key, and the key itself.
+static void
+hmac_ctx_scrub(void* p)
+{
+  HMAC_CTX* ctx = (HMAC_CTX*) p;
+  md_ctx_scrub(&ctx->i_ctx);
+  md_ctx_scrub(&ctx->o_ctx);
+  md_ctx_scrub(&ctx->md_ctx);
+  OPENSSL_cleanse(ctx->key, sizeof(ctx->key));
+  ctx->key_length = 0;
+}
 
-    unsigned char key[EVP_MAX_KEY_LENGTH],iv[EVP_MAX_IV_LENGTH];
-    int key_len = EVP_BytesToKey(cipher, EVP_md5(), NULL, (unsigned char*) key_buf, key_buf_len, 1, key, iv);
+static void
+hmac_ctx_destroy(void* ctx)
+{
+  HMAC_CTX_cleanup((HMAC_CTX*) ctx);
+}
 
-    EVP_CIPHER_CTX_init(&ctx);
-    EVP_CipherInit(&ctx,cipher,(unsigned char *)key,(unsigned char *)iv, false);
-    if (!EVP_CIPHER_CTX_set_key_length(&ctx,key_len)) {
-    	fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
-    	EVP_CIPHER_CTX_cleanup(&ctx);
-    	return false;
-    }
-    initialised = true;
-    return true;
-  }
+// Cipher contexts set up by Cipher.init/Decipher.init, keyed by cipher,
+// direction and passphrase. A hit copies the template context, which
+// skips both EVP_BytesToKey and the key schedule.
+#define CIPHER_KEY_CACHE_DEFAULT_CAPACITY 64
 
+struct cipher_key_entry {
+  int refs;
+  EVP_CIPHER_CTX ctx;
+};
 
-  bool DecipherInitIv(char* cipherType, char* key, int key_len, char *iv, int iv_len)
-  {
-    cipher = EVP_get_cipherbyname(cipherType);
-    if(!cipher) {
-      fprintf(stderr, "node-crypto : Unknown cipher %s\n", cipherType);
-      return false;
-    }
-    if (EVP_CIPHER_iv_length(cipher)!=iv_len) {
-    	fprintf(stderr, "node-crypto : Invalid IV length %d\n", iv_len);
-      return false;
-    }
-    EVP_CIPHER_CTX_init(&ctx);
-    EVP_CipherInit(&ctx,cipher,(unsigned char *)key,(unsigned char *)iv, false);
-    if (!EVP_CIPHER_CTX_set_key_length(&ctx,key_len)) {
-    	fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
-    	EVP_CIPHER_CTX_cleanup(&ctx);
-    	return false;
-    }
-    initialised = true;
-    return true;
+static LruCache *cipher_key_cache;
+
+static void*
+cipher_key_ref(void* value)
+{
+  struct cipher_key_entry* e = (struct cipher_key_entry*) value;
+  __sync_fetch_and_add(&e->refs, 1);
+  return e;
+}
+
+static void
+cipher_key_unref(void* value)
+{
+  struct cipher_key_entry* e = (struct cipher_key_entry*) value;
+  if (__sync_sub_and_fetch(&e->refs, 1) == 0) {
+    EVP_CIPHER_CTX_cleanup(&e->ctx);
+    free(e);
   }
+}
 
-  int DecipherUpdate(char* data, int len, unsigned char** out, int* out_len) {
-    if (!initialised)
-      return 0;
-    *out_len=len+EVP_CIPHER_CTX_block_size(&ctx);
-    *out=(unsigned char*)malloc(*out_len);
-    
-    EVP_CipherUpdate(&ctx, *out, out_len, (unsigned char*)data, len);
-    return 1;
+// Sets up ctx, which must be freshly initialised, for the key and IV
+// EVP_BytesToKey derives from the passphrase. Returns false, with ctx
+// cleaned up, if the cipher rejects the key.
+static bool
+PassphraseCipherInit(EVP_CIPHER_CTX* ctx, const EVP_CIPHER* cipher,
+                     char* key_buf, int key_buf_len, int enc)
+{
+  int id_len = sizeof(int) + key_buf_len;
+  char* id = (char*) malloc(id_len);
+  int nid = EVP_CIPHER_nid(cipher);
+  memcpy(id, &nid, sizeof(int));
+  memcpy(id + sizeof(int), key_buf, key_buf_len);
+
+  struct cipher_key_entry* e =
+    (struct cipher_key_entry*) cipher_key_cache->Get(enc, id, id_len);
+  if (e != NULL) {
+    int r = EVP_CIPHER_CTX_copy(ctx, &e->ctx);
+    cipher_key_unref(e);
+    OPENSSL_cleanse(id, id_len);
+    free(id);
+    return r;
   }
 
-  int DecipherFinal(unsigned char** out, int *out_len, bool tolerate_padding) {
-    if (!initialised)
-      return 0;
-    *out = (unsigned char*) malloc(EVP_CIPHER_CTX_block_size(&ctx));
-    if (tolerate_padding) {
-      local_EVP_DecryptFinal_ex(&ctx,*out,out_len);
-    } else {
-      EVP_CipherFinal(&ctx,*out,out_len);
-    }
-    EVP_CIPHER_CTX_cleanup(&ctx);
-    initialised = false;
-    return 1;
+  unsigned char key[EVP_MAX_KEY_LENGTH],iv[EVP_MAX_IV_LENGTH];
+  int key_len = EVP_BytesToKey(cipher, EVP_md5(), NULL, (unsigned char*) key_buf, key_buf_len, 1, key, iv);
+
+  EVP_CipherInit(ctx,cipher,(unsigned char *)key,(unsigned char *)iv, enc);
+  OPENSSL_cleanse(key, sizeof(key));
+  if (!EVP_CIPHER_CTX_set_key_length(ctx,key_len)) {
+    fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
+    EVP_CIPHER_CTX_cleanup(ctx);
+    OPENSSL_cleanse(id, id_len);
+    free(id);
+    return false;
   }
 
+  e = (struct cipher_key_entry*) malloc(sizeof(struct cipher_key_entry));
+  e->refs = 1;
+  EVP_CIPHER_CTX_init(&e->ctx);
+  if (EVP_CIPHER_CTX_copy(&e->ctx, ctx)) {
+    cipher_key_cache->Put(enc, id, id_len, e);
+  }
+  cipher_key_unref(e);
+  OPENSSL_cleanse(id, id_len);
+  free(id);
+  return true;
+}
 
- protected:
 
-  static Handle<Value>
-  New (const Arguments& args)
-  {
-    HandleScope scope;
 
-    Decipher *cipher = new Decipher();
-    cipher->Wrap(args.This());
-    return args.This();
-  }
+// AEAD ciphers: only GCM is supported.
+#define AUTH_TAG_MAX 16
 
-  static Handle<Value>
-  DecipherInit(const Arguments& args) {
-    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
-		
-    HandleScope scope;
+static inline bool
+IsAead(const EVP_CIPHER *cipher)
+{
+  return EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE;
+}
+
+// AEAD ciphers take IVs of any length, which has to be set before the
+// key and IV are.
+static bool
+AeadCipherInit(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher, char *key, int key_len,
+               char *iv, int iv_len, int enc)
+{
+  EVP_CIPHER_CTX_init(ctx);
+  if (!EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, enc) ||
+      !EVP_CIPHER_CTX_set_key_length(ctx, key_len) ||
+      (iv_len != EVP_CIPHER_iv_length(cipher) &&
+       !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL)) ||
+      !EVP_CipherInit_ex(ctx, NULL, NULL, (unsigned char *) key, (unsigned char *) iv, enc)) {
+    ERR_clear_error();
+    EVP_CIPHER_CTX_cleanup(ctx);
+    return false;
+  }
+  return true;
+}
 
-    cipher->incomplete_utf8=NULL;
-    cipher->incomplete_hex_flag=false;
 
-    if (args.Length() <= 1 || !args[0]->IsString() || !args[1]->IsString()) {
-      return ThrowException(String::New("Must give cipher-type, key as argument"));
+// Base of the classes that can be used as streams. write() and end()
+// queue chunks that the thread pool feeds through the subclass's
+// StreamUpdate and StreamFinal. An object has at most one batch in
+// flight, so chunks are processed in order; whatever is written
+// meanwhile goes out as the next batch. Output is emitted as 'data'
+// Buffers, followed by 'end' once end() has been processed.
+//
+// update(), digest() and final() given a callback go through the same
+// queue, so they run in the order they were called and a digest waits
+// for the updates before it.
+//
+// write() returns false once the bytes waiting reach the high-water
+// mark; 'drain' is emitted when they fall below it again.
+#define STREAM_HIGH_WATER_MARK (64 * 1024)
+
+static Persistent<String> data_symbol;
+static Persistent<String> end_symbol;
+static Persistent<String> drain_symbol;
+static Persistent<String> error_symbol;
+
+// Callback requests below this many bytes run on the calling thread when
+// nothing else is pending, with the callback delivered on the next loop
+// iteration. See setAsyncThreshold().
+#define STREAM_INLINE_THRESHOLD (64 * 1024)
+
+static int stream_inline_threshold = STREAM_INLINE_THRESHOLD;
+
+class CryptoStream : public EventEmitter {
+ public:
+  // Called from each subclass's Initialize.
+  static void
+  InitializeStream(Local<FunctionTemplate> t)
+  {
+    if (data_symbol.IsEmpty()) {
+      data_symbol = NODE_PSYMBOL("data");
+      end_symbol = NODE_PSYMBOL("end");
+      drain_symbol = NODE_PSYMBOL("drain");
+      error_symbol = NODE_PSYMBOL("error");
     }
 
-    ssize_t key_len = DecodeBytes(args[1], BINARY);
+    t->Inherit(EventEmitter::constructor_template);
 
-    if (key_len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
-    }
-    
-    char* key_buf = new char[key_len];
-    ssize_t key_written = DecodeWrite(key_buf, key_len, args[1], BINARY);
-    assert(key_written == key_len);
-    
-    String::Utf8Value cipherType(args[0]->ToString());
-    	
-    bool r = cipher->DecipherInit(*cipherType, key_buf,key_len);
+    NODE_SET_PROTOTYPE_METHOD(t, "write", Write);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", End);
+    NODE_SET_PROTOTYPE_METHOD(t, "setHighWaterMark", SetHighWaterMark);
+  }
 
-    return args.This();
+ protected:
+  CryptoStream () : EventEmitter ()
+  {
+    head_ = tail_ = NULL;
+    in_flight_ = false;
+    referenced_ = false;
+    ending_ = false;
+    need_drain_ = false;
+    delivering_ = false;
+    final_pending_ = false;
+    queued_ = 0;
+    high_water_mark_ = STREAM_HIGH_WATER_MARK;
+    inline_batch_ = NULL;
+    ev_timer_init(&deliver_timer_, DeliverInline, 0., 0.);
+    deliver_timer_.data = this;
   }
 
-  static Handle<Value>
-  DecipherInitIv(const Arguments& args) {
-    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
-		
-    HandleScope scope;
+  // Run on the thread pool. StreamUpdate's out has room for len plus
+  // EVP_MAX_BLOCK_LENGTH bytes, StreamFinal's for EVP_MAX_MD_SIZE.
+  virtual bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) = 0;
+  virtual bool StreamFinal(unsigned char *out, int *out_len) = 0;
 
-    cipher->incomplete_utf8=NULL;
-    cipher->incomplete_hex_flag=false;
+  // Whether init() has been called.
+  virtual bool StreamReady() = 0;
 
-    if (args.Length() <= 2 || !args[0]->IsString() || !args[1]->IsString() || !args[2]->IsString()) {
-      return ThrowException(String::New("Must give cipher-type, key, and iv as argument"));
-    }
+  // The input codec that decodes hex and base64 data, for the objects
+  // whose update() takes them.
+  virtual struct cipher_stream *StreamInputState() { return NULL; }
 
-    ssize_t key_len = DecodeBytes(args[1], BINARY);
+  // True while written data is still being processed, or sign() or
+  // verify() has the context on the thread pool. The synchronous
+  // methods must leave the context alone until then.
+  bool StreamBusy() { return head_ != NULL || in_flight_ || final_pending_; }
 
-    if (key_len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
-    }
-    
-    ssize_t iv_len = DecodeBytes(args[2], BINARY);
+  static Handle<Value>
+  ThrowStreamBusy()
+  {
+    return ThrowException(Exception::Error(String::New("Stream write in progress")));
+  }
 
-    if (iv_len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
+  Handle<Value>
+  ThrowPushError(int r)
+  {
+    if (r == -2) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(StreamInputState()))));
     }
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
 
-    char* key_buf = new char[key_len];
-    ssize_t key_written = DecodeWrite(key_buf, key_len, args[1], BINARY);
-    assert(key_written == key_len);
-    
-    char* iv_buf = new char[iv_len];
-    ssize_t iv_written = DecodeWrite(iv_buf, iv_len, args[2], BINARY);
-    assert(iv_written == iv_len);
+  // update(data, [encoding], callback): queues data behind whatever is
+  // already pending and calls callback(err, [out]) once it has been
+  // processed. out is a Buffer, passed if want_output is set.
+  static Handle<Value>
+  QueueUpdate(const Arguments& args, bool want_output)
+  {
+    CryptoStream *stream = ObjectWrap::Unwrap<CryptoStream>(args.This());
+
+    HandleScope scope;
+
+    if (stream->final_pending_) return ThrowStreamBusy();
+    if (stream->ending_) {
+      return ThrowException(Exception::Error(String::New("update() after end")));
+    }
+    if (!stream->StreamReady()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
 
-    String::Utf8Value cipherType(args[0]->ToString());
-    	
-    bool r = cipher->DecipherInitIv(*cipherType, key_buf,key_len,iv_buf,iv_len);
+    Local<Function> cb = Local<Function>::Cast(args[args.Length()-1]);
+    Local<Value> encoding = args.Length() > 2 ? args[1] : Local<Value>::New(Undefined());
+    if (!IsBytes(args[0])) {
+      return ThrowException(Exception::TypeError(String::New("Bad argument")));
+    }
+    int r = stream->Push(args[0], encoding, false, cb, want_output, -1);
+    if (r < 0) return stream->ThrowPushError(r);
 
     return args.This();
   }
 
+  // digest([encoding], callback) and final([encoding], callback): run
+  // after everything queued before them and pass the result to
+  // callback(err, out), as a binary, hex or base64 string or, without an
+  // encoding, a Buffer.
   static Handle<Value>
-  DecipherUpdate(const Arguments& args) {
-    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+  QueueFinal(const Arguments& args)
+  {
+    CryptoStream *stream = ObjectWrap::Unwrap<CryptoStream>(args.This());
 
     HandleScope scope;
 
-    ssize_t len = DecodeBytes(args[0], BINARY);
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], BINARY);
-    char* ciphertext;
-    int ciphertext_len;
-
+    if (stream->final_pending_) return ThrowStreamBusy();
+    if (stream->ending_) {
+      return ThrowException(Exception::Error(String::New("Already finished")));
+    }
+    if (!stream->StreamReady()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
 
-    if (args.Length() <= 1 || !args[1]->IsString()) {
-      // Binary - do nothing
-    } else {
-      String::Utf8Value encoding(args[1]->ToString());
+    int out_enc = -1;
+    if (args.Length() > 1 && args[0]->IsString()) {
+      String::Utf8Value encoding(args[0]->ToString());
       if (strcasecmp(*encoding, "hex") == 0) {
-	// Hex encoding
-	// Do we have a previous hex carry over?
-	if (cipher->incomplete_hex_flag) {
-	  char* complete_hex = (char*)malloc(len+2);
-	  memcpy(complete_hex, &cipher->incomplete_hex, 1);
-	  memcpy(complete_hex+1, buf, len);
-	  free(buf);
-	  buf = complete_hex;
-	  len += 1;
-	}
-	// Do we have an incomplete hex stream?
-	if ((len>0) && (len % 2 !=0)) {
-	  len--;
-	  cipher->incomplete_hex=buf[len];
-	  cipher->incomplete_hex_flag=true;
-	  buf[len]=0;
-	}
-        hex_decode((unsigned char*)buf, len, (char **)&ciphertext, &ciphertext_len);
-
-        free(buf);
-	buf = ciphertext;
-	len = ciphertext_len;
+        out_enc = STREAM_HEX;
       } else if (strcasecmp(*encoding, "base64") == 0) {
-        unbase64((unsigned char*)buf, len, (char **)&ciphertext, &ciphertext_len);
-        free(buf);
-	buf = ciphertext;
-	len = ciphertext_len;
+        out_enc = STREAM_BASE64;
       } else if (strcasecmp(*encoding, "binary") == 0) {
-        // Binary - do nothing
+        out_enc = STREAM_BINARY;
       } else {
-	fprintf(stderr, "node-crypto : Decipher .update encoding "
-		"can be binary, hex or base64\n");
+        return ThrowException(Exception::TypeError(String::New("Encoding can be binary, hex or base64")));
       }
-  
     }
 
-    unsigned char *out=0;
-    int out_len=0;
-    int r = cipher->DecipherUpdate(buf, len,&out,&out_len);
+    Local<Function> cb = Local<Function>::Cast(args[args.Length()-1]);
+    int r = stream->Push(Undefined(), Undefined(), true, cb, true, out_enc);
+    if (r < 0) return stream->ThrowPushError(r);
 
-    Local<Value> outString;
-    if (out_len==0) {
-      outString=String::New("");
-    } else if (args.Length() <= 2 || !args[2]->IsString()) {
-      outString = Encode(out, out_len, BINARY);
-    } else {
-      enum encoding enc = ParseEncoding(args[2]);
-      if (enc == UTF8) {
-	// See if we have any overhang from last utf8 partial ending
-	if (cipher->incomplete_utf8!=NULL) {
-	  char* complete_out = (char *)malloc(cipher->incomplete_utf8_len + out_len);
-	  memcpy(complete_out, cipher->incomplete_utf8, cipher->incomplete_utf8_len);
-	  memcpy((char *)complete_out+cipher->incomplete_utf8_len, out, out_len);
-	  free(out);
-	  free(cipher->incomplete_utf8);
-	  cipher->incomplete_utf8=NULL;
-	  out = (unsigned char*)complete_out;
-	  out_len += cipher->incomplete_utf8_len;
-	}
-	// Check to see if we have a complete utf8 stream
-	int utf8_len = LengthWithoutIncompleteUtf8((char *)out, out_len);
-	if (utf8_len<out_len) { // We have an incomplete ut8 ending
-	  cipher->incomplete_utf8_len = out_len-utf8_len;
-          cipher->incomplete_utf8 = (unsigned char *)malloc(cipher->incomplete_utf8_len+1);
-          memcpy(cipher->incomplete_utf8, &out[utf8_len], cipher->incomplete_utf8_len);
-	} 
-        outString = Encode(out, utf8_len, enc);
+    return Undefined();
+  }
+
+ private:
+  struct stream_chunk {
+    struct stream_chunk *next;
+    char *data;
+    int len;
+    char *copy;                   // strings are copied,
+    Persistent<Object> buffer;    // Buffers are held on to
+    bool end;
+    Persistent<Function> cb;      // update() or final with a callback
+    bool want_output;
+    int out_enc;                  // STREAM_* for the callback, -1 for a Buffer
+    int out_start;                // this chunk's output in the batch
+    int out_len;
+    bool failed;
+  };
+
+  struct stream_batch {
+    CryptoStream *stream;
+    struct stream_chunk *chunks;
+    int in_len;
+    unsigned char *out;
+    int out_len;
+    bool failed;
+  };
+
+  // Queues data, decoding it here so that hex and base64 carry stays in
+  // order. Returns 0, or -1 for a bad argument and -2 for bad hex or
+  // base64, as StreamInputAs does.
+  int Push(Handle<Value> data, Handle<Value> encoding, bool end,
+           Handle<Function> cb, bool want_output, int out_enc)
+  {
+    struct cipher_stream *s = StreamInputState();
+    enum encoding enc;
+    int type = StreamType(encoding, &enc);
+    bool coded = type == STREAM_HEX || type == STREAM_BASE64;
+
+    // Only a Cipher or Decipher has the carry hex and base64 need.
+    if (coded && !s && data->IsString()) return -1;
+    coded = coded && s;
+
+    struct stream_chunk *c = (struct stream_chunk *)calloc(1, sizeof(struct stream_chunk));
+
+    if (Buffer::HasInstance(data) && !coded) {
+      Local<Object> buffer_obj = data->ToObject();
+      c->buffer = Persistent<Object>::New(buffer_obj);
+      c->data = Buffer::Data(buffer_obj);
+      c->len = Buffer::Length(buffer_obj);
+    } else if (Buffer::HasInstance(data) || data->IsString()) {
+      ArgBytes raw;
+      char *bytes;
+      ssize_t len;
+      if (coded) {
+        len = StreamInputAs(s, data, type, enc, &raw, &bytes);
       } else {
-        outString = Encode(out, out_len, enc);
+        raw.Decode(data, enc);
+        bytes = raw.data;
+        len = raw.len;
+      }
+      if (len < 0) {
+        free(c);
+        return len;
       }
+      c->data = c->copy = (char *)malloc(len + 1);
+      c->len = len;
+      memcpy(c->copy, bytes, len);
     }
 
-    if (out) free(out);
-    free(buf);
-    return scope.Close(outString);
+    // The last chunk takes whatever the input codec still carries.
+    if (end && s) {
+      char *tail;
+      ssize_t tail_len = StreamFlushInput(s, &tail);
+      if (tail_len < 0) {
+        if (!c->buffer.IsEmpty()) c->buffer.Dispose();
+        free(c->copy);
+        free(c);
+        return -2;
+      }
+      if (tail_len > 0) {
+        char *copy = (char *)malloc(c->len + tail_len + 1);
+        if (c->len > 0) memcpy(copy, c->data, c->len);
+        memcpy(copy + c->len, tail, tail_len);
+        if (!c->buffer.IsEmpty()) {
+          c->buffer.Dispose();
+          c->buffer.Clear();
+        }
+        free(c->copy);
+        c->data = c->copy = copy;
+        c->len += tail_len;
+      }
+    }
+    c->end = end;
+    if (!cb.IsEmpty()) c->cb = Persistent<Function>::New(cb);
+    c->want_output = want_output;
+    c->out_enc = out_enc;
+
+    // Queued work keeps the object alive.
+    if (!referenced_) {
+      Ref();
+      referenced_ = true;
+    }
 
-  }
+    if (tail_) tail_->next = c;
+    else head_ = c;
+    tail_ = c;
+    queued_ += c->len;
+    if (end) ending_ = true;
 
-  static Handle<Value>
-  DecipherFinal(const Arguments& args) {
-    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+    Dispatch();
+    return 0;
+  }
 
-    HandleScope scope;
+  int Push(Handle<Value> data, Handle<Value> encoding, bool end)
+  {
+    return Push(data, encoding, end, Handle<Function>(), false, -1);
+  }
 
-    unsigned char* out_value;
-    int out_len;
-    char* out_hexdigest;
-    int out_hex_len;
-    Local<Value> outString ;
+  // Hands the pending chunks to the thread pool as one batch. Small
+  // batches made only of callback requests are run right here instead,
+  // as a thread pool round trip would cost more than the work. Either
+  // way the results are delivered from the event loop, never from
+  // inside the call that queued them.
+  void Dispatch()
+  {
+    while (!in_flight_ && !delivering_ && head_ != NULL) {
+      struct stream_batch *b = (struct stream_batch *)calloc(1, sizeof(struct stream_batch));
+      b->stream = this;
+      b->chunks = head_;
+      head_ = tail_ = NULL;
+
+      size_t out_size = 0;
+      bool run_inline = true;
+      for (struct stream_chunk *c = b->chunks; c; c = c->next) {
+        b->in_len += c->len;
+        out_size += c->len + EVP_MAX_BLOCK_LENGTH;
+        if (c->end) out_size += EVP_MAX_MD_SIZE;
+        if (c->cb.IsEmpty()) run_inline = false;
+      }
+      b->out = (unsigned char *)malloc(out_size);
 
-    int r = cipher->DecipherFinal(&out_value, &out_len, false);
+      in_flight_ = true;
+      if (run_inline && b->in_len < stream_inline_threshold) {
+        RunBatch(b);
+        inline_batch_ = b;
+        ev_timer_start(EV_DEFAULT_UC, &deliver_timer_);
+      } else {
+        eio_custom(EIO_StreamBatch, EIO_PRI_DEFAULT, EIO_AfterStreamBatch, b);
+        ev_ref(EV_DEFAULT_UC);
+      }
+    }
 
-    if (out_len == 0 || r == 0) {
-      return scope.Close(String::New(""));
+    if (!StreamBusy() && referenced_) {
+      referenced_ = false;
+      Unref();
     }
+  }
 
+  // No V8 in here, it may run on the thread pool. Once a chunk fails
+  // the ones after it are skipped.
+  static void
+  RunBatch(struct stream_batch *b)
+  {
+    CryptoStream *stream = b->stream;
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      outString = Encode(out_value, out_len, BINARY);
-    } else {
-      enum encoding enc = ParseEncoding(args[0]);
-      if (enc == UTF8) {
-	// See if we have any overhang from last utf8 partial ending
-	if (cipher->incomplete_utf8!=NULL) {
-	  char* complete_out = (char *)malloc(cipher->incomplete_utf8_len + out_len);
-	  memcpy(complete_out, cipher->incomplete_utf8, cipher->incomplete_utf8_len);
-	  memcpy((char *)complete_out+cipher->incomplete_utf8_len, out_value, out_len);
-	  free(cipher->incomplete_utf8);
-	  cipher->incomplete_utf8=NULL;
-	  outString = Encode(complete_out, cipher->incomplete_utf8_len+out_len, enc);
-	  free(complete_out);
-	} else {
-	  outString = Encode(out_value, out_len, enc);
-	}
-      } else {
-	outString = Encode(out_value, out_len, enc);
+    for (struct stream_chunk *c = b->chunks; c; c = c->next) {
+      c->out_start = b->out_len;
+      if (b->failed) {
+        c->failed = true;
+        continue;
+      }
+      int n = 0;
+      if (c->len > 0 && !stream->StreamUpdate(c->data, c->len, b->out + b->out_len, &n))
+        c->failed = true;
+      b->out_len += n;
+      if (c->end && !c->failed) {
+        n = 0;
+        if (!stream->StreamFinal(b->out + b->out_len, &n))
+          c->failed = true;
+        b->out_len += n;
       }
+      c->out_len = b->out_len - c->out_start;
+      b->failed = c->failed;
     }
-    free(out_value);
-    return scope.Close(outString);
-
+    if (b->failed) ERR_clear_error();
   }
 
-  static Handle<Value>
-  DecipherFinalTolerate(const Arguments& args) {
-    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+  static int
+  EIO_StreamBatch(eio_req *req)
+  {
+    RunBatch((struct stream_batch *)(req->data));
+    return 0;
+  }
 
+  static int
+  EIO_AfterStreamBatch(eio_req *req)
+  {
     HandleScope scope;
 
-    unsigned char* out_value;
-    int out_len;
-    char* out_hexdigest;
-    int out_hex_len;
-    Local<Value> outString ;
+    ev_unref(EV_DEFAULT_UC);
+    struct stream_batch *b = (struct stream_batch *)(req->data);
+    CryptoStream *stream = b->stream;
 
-    int r = cipher->DecipherFinal(&out_value, &out_len, true);
+    stream->FinishBatch(b);
+    stream->Dispatch();
 
-    if (out_len == 0 || r == 0) {
-      return scope.Close(String::New(""));
-    }
+    return 0;
+  }
 
+  static void
+  DeliverInline(EV_P_ ev_timer *watcher, int revents)
+  {
+    CryptoStream *stream = static_cast<CryptoStream*>(watcher->data);
+    struct stream_batch *b = stream->inline_batch_;
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      outString = Encode(out_value, out_len, BINARY);
-    } else {
-      enum encoding enc = ParseEncoding(args[0]);
-      if (enc == UTF8) {
-	// See if we have any overhang from last utf8 partial ending
-	if (cipher->incomplete_utf8!=NULL) {
-	  char* complete_out = (char *)malloc(cipher->incomplete_utf8_len + out_len);
-	  memcpy(complete_out, cipher->incomplete_utf8, cipher->incomplete_utf8_len);
-	  memcpy((char *)complete_out+cipher->incomplete_utf8_len, out_value, out_len);
-	  free(cipher->incomplete_utf8);
-	  cipher->incomplete_utf8=NULL;
-	  outString = Encode(complete_out, cipher->incomplete_utf8_len+out_len, enc);
-	  free(complete_out);
-	} else {
-	  outString = Encode(out_value, out_len, enc);
-	}
-      } else {
-	outString = Encode(out_value, out_len, enc);
-      }
-    }
-    free(out_value);
-    return scope.Close(outString);
+    ev_timer_stop(EV_DEFAULT_UC, watcher);
+    stream->inline_batch_ = NULL;
 
+    stream->FinishBatch(b);
+    stream->Dispatch();
   }
 
-  Decipher () : ObjectWrap () 
+  void EmitData(unsigned char *out, int len)
   {
-    initialised = false;
+    if (len == 0) return;
+    Buffer *buf = Buffer::New(len);
+    memcpy(Buffer::Data(buf->handle_), out, len);
+    Local<Value> argv[1] = { Local<Object>::New(buf->handle_) };
+    Emit(data_symbol, 1, argv);
   }
 
-  ~Decipher ()
+  static Local<Value>
+  EncodeOutput(unsigned char *out, int len, int out_enc)
   {
+    if (out_enc == -1) {
+      Buffer *buf = Buffer::New(len);
+      memcpy(Buffer::Data(buf->handle_), out, len);
+      return Local<Object>::New(buf->handle_);
+    }
+    if (out_enc == STREAM_BINARY) {
+      return Encode(out, len, BINARY);
+    }
+    struct stream_codec codec;
+    stream_codec_init(&codec, out_enc);
+    char *text = (char *)malloc(stream_encoded_max(len));
+    size_t text_len = stream_encode(&codec, out, len, text, true);
+    Local<Value> s = Encode(text, text_len, BINARY);
+    free(text);
+    return s;
   }
 
- private:
+  // Delivers a finished batch in chunk order: 'data', 'error' and 'end'
+  // for written chunks, the callback for the others. Anything queued by
+  // the handlers waits until the whole batch has been delivered, but the
+  // object can be used synchronously from them once nothing is pending.
+  void FinishBatch(struct stream_batch *b)
+  {
+    HandleScope scope;
 
-  EVP_CIPHER_CTX ctx;
-  const EVP_CIPHER *cipher;
-  bool initialised;
-  unsigned char* incomplete_utf8;
-  int incomplete_utf8_len;
-  char incomplete_hex;
-  bool incomplete_hex_flag;
-};
+    queued_ -= b->in_len;
+    in_flight_ = false;
+    delivering_ = true;
 
+    int data_start = 0, data_len = 0;
+    bool data_failed = false;
+    for (struct stream_chunk *c = b->chunks; c; c = c->next) {
+      if (c->end) ending_ = false;
 
+      if (c->cb.IsEmpty()) {
+        if (data_len == 0) data_start = c->out_start;
+        data_len += c->out_len;
+        data_failed = data_failed || c->failed;
+        if (!c->end) continue;
+      }
 
+      EmitData(b->out + data_start, data_len);
+      data_len = 0;
+      if (data_failed) {
+        Local<Value> argv[1] = { Exception::Error(String::New("Stream operation failed")) };
+        Emit(error_symbol, 1, argv);
+        data_failed = false;
+      }
 
-class Hmac : public ObjectWrap {
- public:
-  static void
-  Initialize (v8::Handle<v8::Object> target)
-  {
-    HandleScope scope;
-
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+      if (c->cb.IsEmpty()) {
+        Emit(end_symbol, 0, NULL);
+        continue;
+      }
 
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+      Local<Value> argv[2];
+      int argc = 1;
+      if (c->failed) {
+        argv[0] = Exception::Error(String::New(c->end ? "Final failed" : "Update failed"));
+      } else {
+        argv[0] = Local<Value>::New(Null());
+        if (c->want_output) {
+          argv[1] = EncodeOutput(b->out + c->out_start, c->out_len, c->out_enc);
+          argc = 2;
+        }
+      }
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", HmacInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "update", HmacUpdate);
-    NODE_SET_PROTOTYPE_METHOD(t, "digest", HmacDigest);
+      TryCatch try_catch;
 
-    target->Set(String::NewSymbol("Hmac"), t->GetFunction());
-  }
+      c->cb->Call(Context::GetCurrent()->Global(), argc, argv);
 
-  bool HmacInit(char* hashType, char* key, int key_len)
-  {
-    md = EVP_get_digestbyname(hashType);
-    if(!md) {
-      fprintf(stderr, "node-crypto : Unknown message digest %s\n", hashType);
-      return false;
+      if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+      }
+    }
+    EmitData(b->out + data_start, data_len);
+    if (data_failed) {
+      Local<Value> argv[1] = { Exception::Error(String::New("Stream operation failed")) };
+      Emit(error_symbol, 1, argv);
     }
-    HMAC_CTX_init(&ctx);
-    HMAC_Init(&ctx, key, key_len, md);
-    initialised = true;
-    return true;
-    
-  }
-
-  int HmacUpdate(char* data, int len) {
-    if (!initialised)
-      return 0;
-    HMAC_Update(&ctx, (unsigned char*)data, len);
-    return 1;
-  }
 
-  int HmacDigest(unsigned char** md_value, unsigned int *md_len) {
-    if (!initialised)
-      return 0;
-    *md_value = (unsigned char*) malloc(EVP_MAX_MD_SIZE);
-    HMAC_Final(&ctx, *md_value, md_len);
-    HMAC_CTX_cleanup(&ctx);
-    initialised = false;
-    return 1;
+    if (need_drain_ && queued_ < high_water_mark_) {
+      need_drain_ = false;
+      Emit(drain_symbol, 0, NULL);
+    }
+    delivering_ = false;
+
+    while (b->chunks) {
+      struct stream_chunk *c = b->chunks;
+      b->chunks = c->next;
+      if (!c->buffer.IsEmpty()) c->buffer.Dispose();
+      if (!c->cb.IsEmpty()) c->cb.Dispose();
+      if (c->copy) free(c->copy);
+      free(c);
+    }
+    free(b->out);
+    free(b);
   }
 
-
- protected:
-
+  // write(data, [encoding])
   static Handle<Value>
-  New (const Arguments& args)
+  Write(const Arguments& args)
   {
-    HandleScope scope;
-
-    Hmac *hmac = new Hmac();
-    hmac->Wrap(args.This());
-    return args.This();
-  }
-
-  static Handle<Value>
-  HmacInit(const Arguments& args) {
-    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+    CryptoStream *stream = ObjectWrap::Unwrap<CryptoStream>(args.This());
 
     HandleScope scope;
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      return ThrowException(String::New("Must give hashtype string as argument"));
+    if (stream->final_pending_) return ThrowStreamBusy();
+    if (stream->ending_) {
+      return ThrowException(Exception::Error(String::New("write() after end()")));
     }
-
-    ssize_t len = DecodeBytes(args[1], BINARY);
-
-    if (len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
+    if (!stream->StreamReady()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
     }
+    if (!IsBytes(args[0])) {
+      return ThrowException(Exception::TypeError(String::New("Bad argument")));
+    }
+    int r = stream->Push(args[0], args[1], false);
+    if (r < 0) return stream->ThrowPushError(r);
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[1], BINARY);
-    assert(written == len);
-
-    String::Utf8Value hashType(args[0]->ToString());
-
-    bool r = hmac->HmacInit(*hashType, buf, len);
-
-    return args.This();
+    bool ok = stream->queued_ < stream->high_water_mark_;
+    if (!ok) stream->need_drain_ = true;
+    return scope.Close(Boolean::New(ok));
   }
 
+  // end([data], [encoding]): writes data if given, then finishes the
+  // digest or cipher. Its output comes with the last 'data' event.
   static Handle<Value>
-  HmacUpdate(const Arguments& args) {
-    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+  End(const Arguments& args)
+  {
+    CryptoStream *stream = ObjectWrap::Unwrap<CryptoStream>(args.This());
 
     HandleScope scope;
 
-    enum encoding enc = ParseEncoding(args[1]);
-    ssize_t len = DecodeBytes(args[0], enc);
-
-    if (len < 0) {
-      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
-      return ThrowException(exception);
+    if (stream->final_pending_) return ThrowStreamBusy();
+    if (stream->ending_) {
+      return ThrowException(Exception::Error(String::New("end() called twice")));
     }
+    if (!stream->StreamReady()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
+    if (args.Length() > 0 && !IsBytes(args[0])) {
+      return ThrowException(Exception::TypeError(String::New("Bad argument")));
+    }
+    int r = stream->Push(args[0], args[1], true);
+    if (r < 0) return stream->ThrowPushError(r);
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], enc);
-    assert(written == len);
-
-    int r = hmac->HmacUpdate(buf, len);
-
-    return args.This();
+    return Undefined();
   }
 
+  // setHighWaterMark(bytes)
   static Handle<Value>
-  HmacDigest(const Arguments& args) {
-    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+  SetHighWaterMark(const Arguments& args)
+  {
+    CryptoStream *stream = ObjectWrap::Unwrap<CryptoStream>(args.This());
 
     HandleScope scope;
 
-    unsigned char* md_value;
-    unsigned int md_len;
-    char* md_hexdigest;
-    int md_hex_len;
-    Local<Value> outString ;
-
-    int r = hmac->HmacDigest(&md_value, &md_len);
-
-    if (md_len == 0 || r == 0) {
-      return scope.Close(String::New(""));
-    }
-
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      // Binary
-      outString = Encode(md_value, md_len, BINARY);
-    } else {
-      String::Utf8Value encoding(args[0]->ToString());
-      if (strcasecmp(*encoding, "hex") == 0) {
-        // Hex encoding
-        hex_encode(md_value, md_len, &md_hexdigest, &md_hex_len);
-        outString = Encode(md_hexdigest, md_hex_len, BINARY);
-        free(md_hexdigest);
-      } else if (strcasecmp(*encoding, "base64") == 0) {
-        base64(md_value, md_len, &md_hexdigest, &md_hex_len);
-        outString = Encode(md_hexdigest, md_hex_len, BINARY);
-        free(md_hexdigest);
-      } else if (strcasecmp(*encoding, "binary") == 0) {
-        outString = Encode(md_value, md_len, BINARY);
-      } else {
-	fprintf(stderr, "node-crypto : Hmac .digest encoding "
-		"can be binary, hex or base64\n");
-      }
+    if (args.Length() == 0 || !args[0]->IsNumber() || args[0]->IntegerValue() < 1) {
+      return ThrowException(Exception::TypeError(String::New("Must give high-water mark as argument")));
     }
-    free(md_value);
-    return scope.Close(outString);
-
-  }
-
-  Hmac () : ObjectWrap () 
-  {
-    initialised = false;
-  }
+    stream->high_water_mark_ = args[0]->Int32Value();
 
-  ~Hmac ()
-  {
+    return args.This();
   }
 
- private:
-
-  HMAC_CTX ctx;
-  const EVP_MD *md;
-  bool initialised;
+  struct stream_chunk *head_;
+  struct stream_chunk *tail_;
+  bool in_flight_;
+  bool referenced_;
+  bool ending_;
+  bool need_drain_;
+  bool delivering_;
+  int queued_;
+  int high_water_mark_;
+  struct stream_batch *inline_batch_;  // run, waiting for deliver_timer_
+  ev_timer deliver_timer_;
 
+ protected:
+  bool final_pending_;        // set by Sign and Verify
 };
 
 
-class Hash : public ObjectWrap {
+class Cipher : public CryptoStream {
  public:
   static void
   Initialize (v8::Handle<v8::Object> target)
@@ -1056,46 +1614,152 @@ class Hash : public ObjectWrap {
     Local<FunctionTemplate> t = FunctionTemplate::New(New);
 
     t->InstanceTemplate()->SetInternalFieldCount(1);
+    CryptoStream::InitializeStream(t);
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", HashInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "update", HashUpdate);
-    NODE_SET_PROTOTYPE_METHOD(t, "digest", HashDigest);
+    NODE_SET_PROTOTYPE_METHOD(t, "init", CipherInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", CipherReset);
+    NODE_SET_PROTOTYPE_METHOD(t, "initiv", CipherInitIv);
+    NODE_SET_PROTOTYPE_METHOD(t, "update", CipherUpdate);
+    NODE_SET_PROTOTYPE_METHOD(t, "final", CipherFinal);
+    NODE_SET_PROTOTYPE_METHOD(t, "updateInto", CipherUpdateInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "finalInto", CipherFinalInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAAD", CipherSetAAD);
+    NODE_SET_PROTOTYPE_METHOD(t, "getAuthTag", CipherGetAuthTag);
 
-    target->Set(String::NewSymbol("Hash"), t->GetFunction());
+    target->Set(String::NewSymbol("Cipher"), t->GetFunction());
+  }
+
+  bool CipherInit(const EVP_CIPHER* cipherType, char* key_buf, int key_buf_len)
+  {
+    ReleaseKey();
+    ctx = (EVP_CIPHER_CTX*) cipher_ctx_pool->Get();
+    cipher = cipherType;
+    aead = IsAead(cipher);
+    auth_tag_len = 0;
+
+    if (!PassphraseCipherInit(ctx, cipher, key_buf, key_buf_len, 1))
+      return false;
+    initialised = true;
+    return true;
   }
 
-  bool HashInit (const char* hashType)
+
+  bool CipherInitIv(const EVP_CIPHER* cipherType, char* key, int key_len, char *iv, int iv_len)
   {
-    md = EVP_get_digestbyname(hashType);
-    if(!md) {
-      fprintf(stderr, "node-crypto : Unknown message digest %s\n", hashType);
+    ReleaseKey();
+    ctx = (EVP_CIPHER_CTX*) cipher_ctx_pool->Get();
+    cipher = cipherType;
+    aead = IsAead(cipher);
+    auth_tag_len = 0;
+    if (aead) {
+      if (!AeadCipherInit(ctx, cipher, key, key_len, iv, iv_len, 1)) {
+        fprintf(stderr, "node-crypto : Invalid key length %d or IV length %d\n", key_len, iv_len);
+        return false;
+      }
+      initialised = true;
+      return true;
+    }
+    if (EVP_CIPHER_iv_length(cipher)!=iv_len) {
+    	fprintf(stderr, "node-crypto : Invalid IV length %d\n", iv_len);
       return false;
     }
-    EVP_MD_CTX_init(&mdctx);
-    EVP_DigestInit_ex(&mdctx, md, NULL);
+    EVP_CipherInit(ctx,cipher,(unsigned char *)key,(unsigned char *)iv, true);
+    if (!EVP_CIPHER_CTX_set_key_length(ctx,key_len)) {
+    	fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
+    	EVP_CIPHER_CTX_cleanup(ctx);
+    	return false;
+    }
     initialised = true;
     return true;
+  }
+
+
+  int CipherUpdate(char* data, int len, unsigned char** out, int* out_len) {
+    if (!initialised)
+      return 0;
+    *out_len=len+EVP_CIPHER_CTX_block_size(ctx);
+    *out=(unsigned char*)malloc(*out_len);
     
+    EVP_CipherUpdate(ctx, *out, out_len, (unsigned char*)data, len);
+    return 1;
   }
 
-  int HashUpdate(char* data, int len) {
+  // out must have room for len + block size bytes.
+  int CipherUpdateInto(char* data, int len, unsigned char* out, int* out_len) {
     if (!initialised)
       return 0;
-    EVP_DigestUpdate(&mdctx, data, len);
+    EVP_CipherUpdate(ctx, out, out_len, (unsigned char*)data, len);
     return 1;
   }
 
-  int HashDigest(unsigned char** md_value, unsigned int *md_len) {
+  // Starts a new message under the same key: only the IV is loaded,
+  // the key schedule in ctx is kept.
+  bool CipherReset(char *iv, int iv_len) {
+    if (!initialised && !has_key)
+      return false;
+    if (aead) {
+      if (iv_len != EVP_CIPHER_CTX_iv_length(ctx) &&
+          !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
+        return false;
+    } else if (iv_len != EVP_CIPHER_CTX_iv_length(ctx)) {
+      return false;
+    }
+    if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, (unsigned char *) iv, -1))
+      return false;
+    initialised = true;
+    has_key = false;
+    return true;
+  }
+
+  void ReleaseKey() {
+    if (ctx != NULL) cipher_ctx_pool->Put(ctx);
+    ctx = NULL;
+    initialised = false;
+    has_key = false;
+  }
+
+  bool CipherSetAAD(char* data, int len) {
+    if (!initialised || !aead)
+      return false;
+    int out_len;
+    return EVP_CipherUpdate(ctx, NULL, &out_len, (unsigned char*)data, len);
+  }
+
+  int CipherFinal(unsigned char** out, int *out_len) {
     if (!initialised)
       return 0;
-    *md_value = (unsigned char*) malloc(EVP_MAX_MD_SIZE);
-    EVP_DigestFinal_ex(&mdctx, *md_value, md_len);
-    EVP_MD_CTX_cleanup(&mdctx);
+    *out = (unsigned char*) malloc(EVP_CIPHER_CTX_block_size(ctx));
+    return CipherFinalInto(*out, out_len);
+  }
+
+  // out must have room for one block.
+  int CipherFinalInto(unsigned char* out, int *out_len) {
+    if (!initialised)
+      return 0;
+    EVP_CipherFinal_ex(ctx,out,out_len);
+    if (aead) {
+      auth_tag_len = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AUTH_TAG_MAX, auth_tag) ? AUTH_TAG_MAX : 0;
+    }
+    // The expanded key stays in ctx for reset().
     initialised = false;
+    has_key = true;
     return 1;
   }
 
 
+  // CryptoStream
+  bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) {
+    return CipherUpdateInto(data, len, out, out_len);
+  }
+
+  bool StreamFinal(unsigned char *out, int *out_len) {
+    return CipherFinalInto(out, out_len);
+  }
+
+  bool StreamReady() { return initialised; }
+
+  struct cipher_stream *StreamInputState() { return &stream; }
+
  protected:
 
   static Handle<Value>
@@ -1103,304 +1767,378 @@ class Hash : public ObjectWrap {
   {
     HandleScope scope;
 
-    Hash *hash = new Hash();
-    hash->Wrap(args.This());
+    Cipher *cipher = new Cipher();
+    cipher->Wrap(args.This());
     return args.This();
   }
 
   static Handle<Value>
-  HashInit(const Arguments& args) {
-    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
-
+  CipherInit(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
+		
     HandleScope scope;
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      return ThrowException(String::New("Must give hashtype string as argument"));
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    StreamReset(&cipher->stream);
+
+    if (args.Length() <= 1 || !IsAlgorithm(args[0]) || !IsBytes(args[1])) {
+      return ThrowException(String::New("Must give cipher-type, key"));
     }
+    
 
-    String::Utf8Value hashType(args[0]->ToString());
+    ArgBytes key_buf(args[1], BINARY);
 
-    bool r = hash->HashInit(*hashType);
+    if (key_buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    
+    const EVP_CIPHER *cipherType = ResolveCipher(args[0]);
+    if (!cipherType) {
+      UnknownAlgorithm("cipher", args[0]);
+      return args.This();
+    }
+    if (IsAead(cipherType)) {
+      return ThrowException(Exception::Error(String::New("AEAD ciphers need initiv")));
+    }
+
+    bool r = cipher->CipherInit(cipherType, key_buf.data, key_buf.len);
 
     return args.This();
   }
 
   static Handle<Value>
-  HashUpdate(const Arguments& args) {
-    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
-
+  CipherInitIv(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
+		
     HandleScope scope;
 
-    enum encoding enc = ParseEncoding(args[1]);
-    ssize_t len = DecodeBytes(args[0], enc);
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    if (len < 0) {
+    StreamReset(&cipher->stream);
+
+    if (args.Length() <= 2 || !IsAlgorithm(args[0]) || !IsBytes(args[1]) || !IsBytes(args[2])) {
+      return ThrowException(String::New("Must give cipher-type, key, and iv as argument"));
+    }
+    ArgBytes key_buf(args[1], BINARY);
+
+    if (key_buf.len < 0) {
       Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
       return ThrowException(exception);
     }
+    
+    ArgBytes iv_buf(args[2], BINARY);
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], enc);
-    assert(written == len);
+    if (iv_buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
 
-    int r = hash->HashUpdate(buf, len);
+    const EVP_CIPHER *cipherType = ResolveCipher(args[0]);
+    if (!cipherType) {
+      UnknownAlgorithm("cipher", args[0]);
+      return args.This();
+    }
+
+    bool r = cipher->CipherInitIv(cipherType, key_buf.data, key_buf.len, iv_buf.data, iv_buf.len);
 
     return args.This();
   }
 
+
+  // update([chunk, ...], ...) runs every chunk through and returns a
+  // single output for all of them.
   static Handle<Value>
-  HashDigest(const Arguments& args) {
-    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
+  CipherUpdateChunks(Cipher *cipher, Local<Array> chunks, Handle<Value> in_enc, Handle<Value> out_enc) {
+    enum encoding enc;
+    int type = StreamType(in_enc, &enc);
+
+    unsigned char *out = (unsigned char *) ScratchGrow(&cipher->stream.out_buf, EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0;
+    for (int i = 0; i < (int) chunks->Length(); i++) {
+      ArgBytes in;
+      char *data;
+      ssize_t len = StreamInputAs(&cipher->stream, chunks->Get(Integer::New(i)), type, enc, &in, &data);
+      if (len < 0) {
+        return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+      }
 
-    HandleScope scope;
+      out = (unsigned char *) ScratchGrow(&cipher->stream.out_buf, out_len + len + EVP_MAX_BLOCK_LENGTH);
+      int n = 0;
+      cipher->CipherUpdateInto(data, len, out + out_len, &n);
+      out_len += n;
+    }
 
-    unsigned char* md_value;
-    unsigned int md_len;
-    char* md_hexdigest;
-    int md_hex_len;
-    Local<Value> outString ;
+    return StreamOutput(&cipher->stream, out_enc, out, out_len, false);
+  }
 
-    int r = hash->HashDigest(&md_value, &md_len);
+  // update(data, [input_encoding], [output_encoding])
+  // Encodings can be binary, ascii, utf8, hex or base64, for input and
+  // output alike. Partial hex digits, base64 quantums and UTF-8
+  // sequences carry over to the next call.
+  static Handle<Value>
+  CipherUpdate(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
-    if (md_len == 0 || r == 0) {
-      return scope.Close(String::New(""));
+    HandleScope scope;
+
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return QueueUpdate(args, true);
     }
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      // Binary
-      outString = Encode(md_value, md_len, BINARY);
-    } else {
-      String::Utf8Value encoding(args[0]->ToString());
-      if (strcasecmp(*encoding, "hex") == 0) {
-        // Hex encoding
-        hex_encode(md_value, md_len, &md_hexdigest, &md_hex_len);
-        outString = Encode(md_hexdigest, md_hex_len, BINARY);
-        free(md_hexdigest);
-      } else if (strcasecmp(*encoding, "base64") == 0) {
-        base64(md_value, md_len, &md_hexdigest, &md_hex_len);
-        outString = Encode(md_hexdigest, md_hex_len, BINARY);
-        free(md_hexdigest);
-      } else if (strcasecmp(*encoding, "binary") == 0) {
-        outString = Encode(md_value, md_len, BINARY);
-      } else {
-	fprintf(stderr, "node-crypto : Hash .digest encoding "
-		"can be binary, hex or base64\n");
-      }
+    if (IsChunkArray(args[0])) {
+      return scope.Close(CipherUpdateChunks(cipher, Local<Array>::Cast(args[0]), args[1], args[2]));
     }
-    free(md_value);
-    return scope.Close(outString);
 
-  }
-
-  Hash () : ObjectWrap () 
-  {
-    initialised = false;
-  }
+    ArgBytes in;
+    char *data;
+    ssize_t len = StreamInput(&cipher->stream, args[0], args[1], &in, &data);
 
-  ~Hash ()
-  {
-  }
+    if (len == -1) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
 
- private:
+    unsigned char *out = (unsigned char *) ScratchReserve(&cipher->stream.out_buf, len + EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0;
+    cipher->CipherUpdateInto(data, len, out, &out_len);
 
-  EVP_MD_CTX mdctx;
-  const EVP_MD *md;
-  bool initialised;
+    return scope.Close(StreamOutput(&cipher->stream, args[2], out, out_len, false));
+  }
 
-};
+  static Handle<Value>
+  CipherFinal(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
-class Sign : public ObjectWrap {
- public:
-  static void
-  Initialize (v8::Handle<v8::Object> target)
-  {
     HandleScope scope;
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
-
-    t->InstanceTemplate()->SetInternalFieldCount(1);
-
-    NODE_SET_PROTOTYPE_METHOD(t, "init", SignInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "update", SignUpdate);
-    NODE_SET_PROTOTYPE_METHOD(t, "sign", SignFinal);
+    if (args.Length() > 0 && args[args.Length()-1]->IsFunction()) {
+      return QueueFinal(args);
+    }
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    target->Set(String::NewSymbol("Sign"), t->GetFunction());
-  }
+    if (!cipher->initialised) {
+      return scope.Close(String::New(""));
+    }
 
-  bool SignInit (const char* signType)
-  {
-    md = EVP_get_digestbyname(signType);
-    if(!md) {
-      printf("Unknown message digest %s\n", signType);
-      return false;
+    char *data;
+    ssize_t len = StreamFlushInput(&cipher->stream, &data);
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
     }
-    EVP_MD_CTX_init(&mdctx);
-    EVP_SignInit_ex(&mdctx, md, NULL);
-    initialised = true;
-    return true;
-    
-  }
 
-  int SignUpdate(char* data, int len) {
-    if (!initialised)
-      return 0;
-    EVP_SignUpdate(&mdctx, data, len);
-    return 1;
+    unsigned char *out = (unsigned char *) ScratchReserve(&cipher->stream.out_buf, len + 2 * EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0, final_len = 0;
+    cipher->CipherUpdateInto(data, len, out, &out_len);
+    cipher->CipherFinalInto(out + out_len, &final_len);
+    out_len += final_len;
+
+    return scope.Close(StreamOutput(&cipher->stream, args[0], out, out_len, true));
   }
 
-  int SignFinal(unsigned char** md_value, unsigned int *md_len, char* keyPem, int keyPemLen) {
-    if (!initialised)
-      return 0;
+  // updateInto(data, buffer, offset, [input_encoding])
+  // Writes the output into buffer at offset and returns the number of
+  // bytes written. buffer needs room for the decoded data plus one
+  // block.
+  static Handle<Value>
+  CipherUpdateInto(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
-    BIO *bp = NULL;
-    EVP_PKEY* pkey;
-    bp = BIO_new(BIO_s_mem()); 
-    if(!BIO_write(bp, keyPem, keyPemLen))
-      return 0;
+    HandleScope scope;
 
-    pkey = PEM_read_bio_PrivateKey( bp, NULL, NULL, NULL );
-    if (pkey == NULL)
-      return 0;
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    EVP_SignFinal(&mdctx, *md_value, md_len, pkey);
-    EVP_MD_CTX_cleanup(&mdctx);
-    initialised = false;
-    EVP_PKEY_free(pkey);
-    BIO_free(bp);
-    return 1;
-  }
+    if (args.Length() < 2 || !Buffer::HasInstance(args[1])) {
+      return ThrowException(Exception::TypeError(String::New("Must give data and output Buffer as argument")));
+    }
 
+    // Decoded as update() does, sharing its carry; put back if the
+    // output does not fit.
+    struct stream_codec saved = cipher->stream.in;
+    ArgBytes in;
+    char *data;
+    ssize_t len = StreamInput(&cipher->stream, args[0], args[3], &in, &data);
 
- protected:
+    if (len == -1) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
 
-  static Handle<Value>
-  New (const Arguments& args)
-  {
-    HandleScope scope;
+    Local<Object> out_obj = args[1]->ToObject();
+    size_t offset = args.Length() > 2 ? args[2]->Uint32Value() : 0;
+    size_t out_size = Buffer::Length(out_obj);
+    if (!cipher->initialised) {
+      return scope.Close(Integer::New(0));
+    }
+    if (offset > out_size ||
+        out_size - offset < (size_t) len + EVP_CIPHER_CTX_block_size(cipher->ctx)) {
+      cipher->stream.in = saved;
+      return ThrowException(Exception::RangeError(String::New("Output buffer too small")));
+    }
 
-    Sign *sign = new Sign();
-    sign->Wrap(args.This());
+    int out_len = 0;
+    cipher->CipherUpdateInto(data, len, (unsigned char*) Buffer::Data(out_obj) + offset, &out_len);
 
-    return args.This();
+    return scope.Close(Integer::New(out_len));
   }
 
+  // finalInto(buffer, offset)
+  // Writes the last block into buffer at offset and returns the number
+  // of bytes written. buffer needs room for one block, or for two and
+  // the decoded input if hex or base64 input is still carried.
   static Handle<Value>
-  SignInit(const Arguments& args) {
-    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+  CipherFinalInto(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
     HandleScope scope;
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      return ThrowException(String::New("Must give signtype string as argument"));
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+      return ThrowException(Exception::TypeError(String::New("Must give output Buffer as argument")));
     }
 
-    String::Utf8Value signType(args[0]->ToString());
+    Local<Object> out_obj = args[0]->ToObject();
+    size_t offset = args.Length() > 1 ? args[1]->Uint32Value() : 0;
+    size_t out_size = Buffer::Length(out_obj);
+    if (!cipher->initialised) {
+      return scope.Close(Integer::New(0));
+    }
+    struct stream_codec saved = cipher->stream.in;
+    char *data;
+    ssize_t len = StreamFlushInput(&cipher->stream, &data);
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
+    if (offset > out_size ||
+        out_size - offset < (size_t) len + (len > 0 ? 2 : 1) * EVP_CIPHER_CTX_block_size(cipher->ctx)) {
+      cipher->stream.in = saved;
+      return ThrowException(Exception::RangeError(String::New("Output buffer too small")));
+    }
 
-    bool r = sign->SignInit(*signType);
+    unsigned char *out = (unsigned char*) Buffer::Data(out_obj) + offset;
+    int out_len = 0, final_len = 0;
+    cipher->CipherUpdateInto(data, len, out, &out_len);
+    cipher->CipherFinalInto(out + out_len, &final_len);
+    out_len += final_len;
 
-    return args.This();
+    return scope.Close(Integer::New(out_len));
   }
 
+  // reset(iv): like initiv with the same cipher and key, without
+  // redoing the key setup. Works after final() too.
   static Handle<Value>
-  SignUpdate(const Arguments& args) {
-    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+  CipherReset(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
     HandleScope scope;
 
-    enum encoding enc = ParseEncoding(args[1]);
-    ssize_t len = DecodeBytes(args[0], enc);
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    if (len < 0) {
+    if (args.Length() < 1 || !IsBytes(args[0])) {
+      return ThrowException(String::New("Must give iv as argument"));
+    }
+
+    ArgBytes iv_buf(args[0], BINARY);
+
+    if (iv_buf.len < 0) {
       Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
       return ThrowException(exception);
     }
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], enc);
-    assert(written == len);
-
-    int r = sign->SignUpdate(buf, len);
+    if (!cipher->CipherReset(iv_buf.data, iv_buf.len)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("reset needs a keyed cipher and an IV of the right length")));
+    }
+    StreamReset(&cipher->stream);
+    cipher->auth_tag_len = 0;
 
     return args.This();
   }
 
+  // setAAD(data): additional authenticated data for an AEAD cipher,
+  // given before any update().
   static Handle<Value>
-  SignFinal(const Arguments& args) {
-    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+  CipherSetAAD(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
     HandleScope scope;
 
-    unsigned char* md_value;
-    unsigned int md_len;
-    char* md_hexdigest;
-    int md_hex_len;
-    Local<Value> outString;
-
-    md_len = 8192; // Maximum key size is 8192 bits
-    md_value = new unsigned char[md_len];
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    ssize_t len = DecodeBytes(args[0], BINARY);
+    ArgBytes buf(args[0], BINARY);
 
-    if (len < 0) {
+    if (buf.len < 0) {
       Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
       return ThrowException(exception);
     }
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], BINARY);
-    assert(written == len);
+    if (!cipher->CipherSetAAD(buf.data, buf.len)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("setAAD needs an initialised AEAD cipher")));
+    }
 
+    return args.This();
+  }
+
+  // getAuthTag([encoding]): the tag of an AEAD cipher, after final().
+  static Handle<Value>
+  CipherGetAuthTag(const Arguments& args) {
+    Cipher *cipher = ObjectWrap::Unwrap<Cipher>(args.This());
 
-    int r = sign->SignFinal(&md_value, &md_len, buf, len);
+    HandleScope scope;
 
-    if (md_len == 0 || r == 0) {
-      return scope.Close(String::New(""));
+    if (cipher->auth_tag_len == 0) {
+      return ThrowException(Exception::Error(String::New("getAuthTag needs an AEAD cipher after final")));
     }
 
-    if (args.Length() == 1 || !args[1]->IsString()) {
-      // Binary
-      outString = Encode(md_value, md_len, BINARY);
-    } else {
-      String::Utf8Value encoding(args[1]->ToString());
-      if (strcasecmp(*encoding, "hex") == 0) {
-        // Hex encoding
-        hex_encode(md_value, md_len, &md_hexdigest, &md_hex_len);
-        outString = Encode(md_hexdigest, md_hex_len, BINARY);
-        free(md_hexdigest);
-      } else if (strcasecmp(*encoding, "base64") == 0) {
-        base64(md_value, md_len, &md_hexdigest, &md_hex_len);
-        outString = Encode(md_hexdigest, md_hex_len, BINARY);
-        free(md_hexdigest);
-      } else if (strcasecmp(*encoding, "binary") == 0) {
-        outString = Encode(md_value, md_len, BINARY);
-      } else {
-	outString = String::New("");
-	fprintf(stderr, "node-crypto : Sign .sign encoding "
-		"can be binary, hex or base64\n");
-      }
+    Local<Value> outString = EncodeDigest(cipher->auth_tag, cipher->auth_tag_len, args[0]);
+    if (outString.IsEmpty()) {
+      return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
     }
     return scope.Close(outString);
-
   }
 
-  Sign () : ObjectWrap () 
+  Cipher () : CryptoStream () 
   {
     initialised = false;
+    has_key = false;
+    ctx = NULL;
+    aead = false;
+    auth_tag_len = 0;
+    StreamInit(&stream);
   }
 
-  ~Sign ()
+  ~Cipher ()
   {
+    ReleaseKey();
+    StreamFree(&stream);
   }
 
  private:
 
-  EVP_MD_CTX mdctx;
-  const EVP_MD *md;
+  EVP_CIPHER_CTX *ctx;         // from cipher_ctx_pool, kept after final() for reset()
+  const EVP_CIPHER *cipher;
   bool initialised;
+  bool has_key;               // ctx still holds the key after final()
+  bool aead;
+  unsigned char auth_tag[AUTH_TAG_MAX];
+  int auth_tag_len;
+  struct cipher_stream stream;
 
 };
 
-class Verify : public ObjectWrap {
+
+
+class Decipher : public CryptoStream {
  public:
   static void
   Initialize (v8::Handle<v8::Object> target)
@@ -1410,69 +2148,165 @@ class Verify : public ObjectWrap {
     Local<FunctionTemplate> t = FunctionTemplate::New(New);
 
     t->InstanceTemplate()->SetInternalFieldCount(1);
+    CryptoStream::InitializeStream(t);
 
-    NODE_SET_PROTOTYPE_METHOD(t, "init", VerifyInit);
-    NODE_SET_PROTOTYPE_METHOD(t, "update", VerifyUpdate);
-    NODE_SET_PROTOTYPE_METHOD(t, "verify", VerifyFinal);
+    NODE_SET_PROTOTYPE_METHOD(t, "init", DecipherInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", DecipherReset);
+    NODE_SET_PROTOTYPE_METHOD(t, "initiv", DecipherInitIv);
+    NODE_SET_PROTOTYPE_METHOD(t, "update", DecipherUpdate);
+    NODE_SET_PROTOTYPE_METHOD(t, "final", DecipherFinal);
+    NODE_SET_PROTOTYPE_METHOD(t, "finaltol", DecipherFinalTolerate);
+    NODE_SET_PROTOTYPE_METHOD(t, "updateInto", DecipherUpdateInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "finalInto", DecipherFinalInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAAD", DecipherSetAAD);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAuthTag", DecipherSetAuthTag);
 
-    target->Set(String::NewSymbol("Verify"), t->GetFunction());
+    target->Set(String::NewSymbol("Decipher"), t->GetFunction());
   }
 
-  bool VerifyInit (const char* verifyType)
+  bool DecipherInit(const EVP_CIPHER* cipherType, char* key_buf, int key_buf_len)
   {
-    md = EVP_get_digestbyname(verifyType);
-    if(!md) {
-      fprintf(stderr, "node-crypto : Unknown message digest %s\n", verifyType);
+    ReleaseKey();
+    ctx = (EVP_CIPHER_CTX*) cipher_ctx_pool->Get();
+    cipher = cipherType;
+    aead = IsAead(cipher);
+
+    if (!PassphraseCipherInit(ctx, cipher, key_buf, key_buf_len, 0))
       return false;
+    initialised = true;
+    return true;
+  }
+
+
+  bool DecipherInitIv(const EVP_CIPHER* cipherType, char* key, int key_len, char *iv, int iv_len)
+  {
+    ReleaseKey();
+    ctx = (EVP_CIPHER_CTX*) cipher_ctx_pool->Get();
+    cipher = cipherType;
+    aead = IsAead(cipher);
+    if (aead) {
+      if (!AeadCipherInit(ctx, cipher, key, key_len, iv, iv_len, 0)) {
+        fprintf(stderr, "node-crypto : Invalid key length %d or IV length %d\n", key_len, iv_len);
+        return false;
+      }
+      initialised = true;
+      return true;
+    }
+    if (EVP_CIPHER_iv_length(cipher)!=iv_len) {
+    	fprintf(stderr, "node-crypto : Invalid IV length %d\n", iv_len);
+      return false;
+    }
+    EVP_CipherInit(ctx,cipher,(unsigned char *)key,(unsigned char *)iv, false);
+    if (!EVP_CIPHER_CTX_set_key_length(ctx,key_len)) {
+    	fprintf(stderr, "node-crypto : Invalid key length %d\n", key_len);
+    	EVP_CIPHER_CTX_cleanup(ctx);
+    	return false;
     }
-    EVP_MD_CTX_init(&mdctx);
-    EVP_VerifyInit_ex(&mdctx, md, NULL);
     initialised = true;
     return true;
-    
   }
 
-  int VerifyUpdate(char* data, int len) {
+  int DecipherUpdate(char* data, int len, unsigned char** out, int* out_len) {
     if (!initialised)
       return 0;
-    EVP_VerifyUpdate(&mdctx, data, len);
+    *out_len=len+EVP_CIPHER_CTX_block_size(ctx);
+    *out=(unsigned char*)malloc(*out_len);
+    
+    EVP_CipherUpdate(ctx, *out, out_len, (unsigned char*)data, len);
     return 1;
   }
 
-  int VerifyFinal(char* keyPem, int keyPemLen, unsigned char* sig, int siglen) {
+  // out must have room for len + block size bytes.
+  int DecipherUpdateInto(char* data, int len, unsigned char* out, int* out_len) {
     if (!initialised)
       return 0;
+    EVP_CipherUpdate(ctx, out, out_len, (unsigned char*)data, len);
+    return 1;
+  }
 
-    BIO *bp = NULL;
-    EVP_PKEY* pkey;
-    X509 *        x509;
+  // Starts a new message under the same key: only the IV is loaded,
+  // the key schedule in ctx is kept.
+  bool DecipherReset(char *iv, int iv_len) {
+    if (!initialised && !has_key)
+      return false;
+    if (aead) {
+      if (iv_len != EVP_CIPHER_CTX_iv_length(ctx) &&
+          !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
+        return false;
+    } else if (iv_len != EVP_CIPHER_CTX_iv_length(ctx)) {
+      return false;
+    }
+    if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, (unsigned char *) iv, -1))
+      return false;
+    initialised = true;
+    has_key = false;
+    return true;
+  }
 
-    bp = BIO_new(BIO_s_mem()); 
-    if(!BIO_write(bp, keyPem, keyPemLen))
-      return 0;
+  void ReleaseKey() {
+    if (ctx != NULL) cipher_ctx_pool->Put(ctx);
+    ctx = NULL;
+    initialised = false;
+    has_key = false;
+  }
 
-    x509 = PEM_read_bio_X509(bp, NULL, NULL, NULL );
-    if (x509==NULL)
-      return 0;
+  bool DecipherSetAAD(char* data, int len) {
+    if (!initialised || !aead)
+      return false;
+    int out_len;
+    return EVP_CipherUpdate(ctx, NULL, &out_len, (unsigned char*)data, len);
+  }
 
-    pkey=X509_get_pubkey(x509);
-    if (pkey==NULL)
-      return 0;
+  bool DecipherSetAuthTag(unsigned char* tag, int len) {
+    if (!initialised || !aead || len < 1 || len > AUTH_TAG_MAX)
+      return false;
+    return EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, len, tag);
+  }
 
-    int r = EVP_VerifyFinal(&mdctx, sig, siglen, pkey);
-    EVP_PKEY_free (pkey);
+  int DecipherFinal(unsigned char** out, int *out_len, bool tolerate_padding) {
+    if (!initialised)
+      return 0;
+    *out = (unsigned char*) malloc(EVP_CIPHER_CTX_block_size(ctx));
+    return DecipherFinalInto(*out, out_len, tolerate_padding);
+  }
 
-    if (r != 1) {
-      ERR_print_errors_fp (stderr);
+  // out must have room for one block. Returns -1 if an AEAD cipher's
+  // tag does not match.
+  int DecipherFinalInto(unsigned char* out, int *out_len, bool tolerate_padding) {
+    if (!initialised)
+      return 0;
+    int r = 1;
+    if (aead) {
+      if (!EVP_CipherFinal_ex(ctx,out,out_len)) {
+        ERR_clear_error();
+        *out_len = 0;
+        r = -1;
+      }
+    } else if (tolerate_padding) {
+      local_EVP_DecryptFinal_ex(ctx,out,out_len);
+    } else {
+      EVP_CipherFinal_ex(ctx,out,out_len);
     }
-    X509_free(x509);
-    BIO_free(bp);
-    EVP_MD_CTX_cleanup(&mdctx);
+    // The expanded key stays in ctx for reset().
     initialised = false;
+    has_key = true;
     return r;
   }
 
 
+  // CryptoStream
+  bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) {
+    return DecipherUpdateInto(data, len, out, out_len);
+  }
+
+  bool StreamFinal(unsigned char *out, int *out_len) {
+    return DecipherFinalInto(out, out_len, false) == 1;
+  }
+
+  bool StreamReady() { return initialised; }
+
+  struct cipher_stream *StreamInputState() { return &stream; }
+
  protected:
 
   static Handle<Value>
@@ -1480,135 +2314,4013 @@ class Verify : public ObjectWrap {
   {
     HandleScope scope;
 
-    Verify *verify = new Verify();
-    verify->Wrap(args.This());
-
+    Decipher *cipher = new Decipher();
+    cipher->Wrap(args.This());
     return args.This();
   }
 
   static Handle<Value>
-  VerifyInit(const Arguments& args) {
-    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
-
+  DecipherInit(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+		
     HandleScope scope;
 
-    if (args.Length() == 0 || !args[0]->IsString()) {
-      return ThrowException(String::New("Must give verifytype string as argument"));
-    }
-
-    String::Utf8Value verifyType(args[0]->ToString());
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    bool r = verify->VerifyInit(*verifyType);
+    StreamReset(&cipher->stream);
+
+    if (args.Length() <= 1 || !IsAlgorithm(args[0]) || !IsBytes(args[1])) {
+      return ThrowException(String::New("Must give cipher-type, key as argument"));
+    }
+
+    ArgBytes key_buf(args[1], BINARY);
+
+    if (key_buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    
+    const EVP_CIPHER *cipherType = ResolveCipher(args[0]);
+    if (!cipherType) {
+      UnknownAlgorithm("cipher", args[0]);
+      return args.This();
+    }
+    if (IsAead(cipherType)) {
+      return ThrowException(Exception::Error(String::New("AEAD ciphers need initiv")));
+    }
+
+    bool r = cipher->DecipherInit(cipherType, key_buf.data, key_buf.len);
 
     return args.This();
   }
 
   static Handle<Value>
-  VerifyUpdate(const Arguments& args) {
-    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
+  DecipherInitIv(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+		
+    HandleScope scope;
+
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    StreamReset(&cipher->stream);
+
+    if (args.Length() <= 2 || !IsAlgorithm(args[0]) || !IsBytes(args[1]) || !IsBytes(args[2])) {
+      return ThrowException(String::New("Must give cipher-type, key, and iv as argument"));
+    }
+
+    ArgBytes key_buf(args[1], BINARY);
+
+    if (key_buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    
+    ArgBytes iv_buf(args[2], BINARY);
+
+    if (iv_buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    const EVP_CIPHER *cipherType = ResolveCipher(args[0]);
+    if (!cipherType) {
+      UnknownAlgorithm("cipher", args[0]);
+      return args.This();
+    }
+
+    bool r = cipher->DecipherInitIv(cipherType, key_buf.data, key_buf.len, iv_buf.data, iv_buf.len);
+
+    return args.This();
+  }
+
+  // update([chunk, ...], ...) runs every chunk through and returns a
+  // single output for all of them.
+  static Handle<Value>
+  DecipherUpdateChunks(Decipher *cipher, Local<Array> chunks, Handle<Value> in_enc, Handle<Value> out_enc) {
+    enum encoding enc;
+    int type = StreamType(in_enc, &enc);
+
+    unsigned char *out = (unsigned char *) ScratchGrow(&cipher->stream.out_buf, EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0;
+    for (int i = 0; i < (int) chunks->Length(); i++) {
+      ArgBytes in;
+      char *data;
+      ssize_t len = StreamInputAs(&cipher->stream, chunks->Get(Integer::New(i)), type, enc, &in, &data);
+      if (len < 0) {
+        return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+      }
+
+      out = (unsigned char *) ScratchGrow(&cipher->stream.out_buf, out_len + len + EVP_MAX_BLOCK_LENGTH);
+      int n = 0;
+      cipher->DecipherUpdateInto(data, len, out + out_len, &n);
+      out_len += n;
+    }
+
+    return StreamOutput(&cipher->stream, out_enc, out, out_len, false);
+  }
+
+  // update(data, [input_encoding], [output_encoding]), with the same
+  // encodings as Cipher.update.
+  static Handle<Value>
+  DecipherUpdate(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
 
     HandleScope scope;
 
-    enum encoding enc = ParseEncoding(args[1]);
-    ssize_t len = DecodeBytes(args[0], enc);
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return QueueUpdate(args, true);
+    }
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    if (IsChunkArray(args[0])) {
+      return scope.Close(DecipherUpdateChunks(cipher, Local<Array>::Cast(args[0]), args[1], args[2]));
+    }
+
+    ArgBytes in;
+    char *data;
+    ssize_t len = StreamInput(&cipher->stream, args[0], args[1], &in, &data);
+
+    if (len == -1) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
+
+    unsigned char *out = (unsigned char *) ScratchReserve(&cipher->stream.out_buf, len + EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0;
+    cipher->DecipherUpdateInto(data, len, out, &out_len);
+
+    return scope.Close(StreamOutput(&cipher->stream, args[2], out, out_len, false));
+  }
 
+  // Shared by final and finaltol.
+  static Handle<Value>
+  DecipherFinalStream(const Arguments& args, bool tolerate_padding) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+
+    HandleScope scope;
+
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    if (!cipher->initialised) {
+      return scope.Close(String::New(""));
+    }
+
+    char *data;
+    ssize_t len = StreamFlushInput(&cipher->stream, &data);
     if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
+
+    unsigned char *out = (unsigned char *) ScratchReserve(&cipher->stream.out_buf, len + 2 * EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0, final_len = 0;
+    cipher->DecipherUpdateInto(data, len, out, &out_len);
+    int r = cipher->DecipherFinalInto(out + out_len, &final_len, tolerate_padding);
+    out_len += final_len;
+
+    if (r == -1) {
+      return ThrowException(Exception::Error(String::New("Unsupported state or unable to authenticate data")));
+    }
+
+    return scope.Close(StreamOutput(&cipher->stream, args[0], out, out_len, true));
+  }
+
+  static Handle<Value>
+  DecipherFinal(const Arguments& args) {
+    if (args.Length() > 0 && args[args.Length()-1]->IsFunction()) {
+      return QueueFinal(args);
+    }
+    return DecipherFinalStream(args, false);
+  }
+
+  static Handle<Value>
+  DecipherFinalTolerate(const Arguments& args) {
+    return DecipherFinalStream(args, true);
+  }
+
+  // updateInto(data, buffer, offset, [input_encoding])
+  // Writes the output into buffer at offset and returns the number of
+  // bytes written. buffer needs room for the decoded data plus one
+  // block.
+  static Handle<Value>
+  DecipherUpdateInto(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+
+    HandleScope scope;
+
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() < 2 || !Buffer::HasInstance(args[1])) {
+      return ThrowException(Exception::TypeError(String::New("Must give data and output Buffer as argument")));
+    }
+
+    // Decoded as update() does, sharing its carry; put back if the
+    // output does not fit.
+    struct stream_codec saved = cipher->stream.in;
+    ArgBytes in;
+    char *data;
+    ssize_t len = StreamInput(&cipher->stream, args[0], args[3], &in, &data);
+
+    if (len == -1) {
       Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
       return ThrowException(exception);
     }
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
 
-    char* buf = new char[len];
-    ssize_t written = DecodeWrite(buf, len, args[0], enc);
-    assert(written == len);
+    Local<Object> out_obj = args[1]->ToObject();
+    size_t offset = args.Length() > 2 ? args[2]->Uint32Value() : 0;
+    size_t out_size = Buffer::Length(out_obj);
+    if (!cipher->initialised) {
+      return scope.Close(Integer::New(0));
+    }
+    if (offset > out_size ||
+        out_size - offset < (size_t) len + EVP_CIPHER_CTX_block_size(cipher->ctx)) {
+      cipher->stream.in = saved;
+      return ThrowException(Exception::RangeError(String::New("Output buffer too small")));
+    }
 
-    int r = verify->VerifyUpdate(buf, len);
+    int out_len = 0;
+    cipher->DecipherUpdateInto(data, len, (unsigned char*) Buffer::Data(out_obj) + offset, &out_len);
 
-    return args.This();
+    return scope.Close(Integer::New(out_len));
   }
 
+  // finalInto(buffer, offset)
+  // Writes the last block into buffer at offset and returns the number
+  // of bytes written. buffer needs room for one block, or for two and
+  // the decoded input if hex or base64 input is still carried.
   static Handle<Value>
-  VerifyFinal(const Arguments& args) {
-    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
+  DecipherFinalInto(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+
+    HandleScope scope;
+
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+      return ThrowException(Exception::TypeError(String::New("Must give output Buffer as argument")));
+    }
+
+    Local<Object> out_obj = args[0]->ToObject();
+    size_t offset = args.Length() > 1 ? args[1]->Uint32Value() : 0;
+    size_t out_size = Buffer::Length(out_obj);
+    if (!cipher->initialised) {
+      return scope.Close(Integer::New(0));
+    }
+    struct stream_codec saved = cipher->stream.in;
+    char *data;
+    ssize_t len = StreamFlushInput(&cipher->stream, &data);
+    if (len < 0) {
+      return ThrowException(Exception::Error(String::New(StreamInputError(&cipher->stream))));
+    }
+    if (offset > out_size ||
+        out_size - offset < (size_t) len + (len > 0 ? 2 : 1) * EVP_CIPHER_CTX_block_size(cipher->ctx)) {
+      cipher->stream.in = saved;
+      return ThrowException(Exception::RangeError(String::New("Output buffer too small")));
+    }
+
+    unsigned char *out = (unsigned char*) Buffer::Data(out_obj) + offset;
+    int out_len = 0, final_len = 0;
+    cipher->DecipherUpdateInto(data, len, out, &out_len);
+    int r = cipher->DecipherFinalInto(out + out_len, &final_len, false);
+    out_len += final_len;
+    if (r == -1) {
+      return ThrowException(Exception::Error(String::New("Unsupported state or unable to authenticate data")));
+    }
+
+    return scope.Close(Integer::New(out_len));
+  }
+
+  // reset(iv): like initiv with the same cipher and key, without
+  // redoing the key setup. Works after final() too.
+  static Handle<Value>
+  DecipherReset(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
 
     HandleScope scope;
 
-    ssize_t klen = DecodeBytes(args[0], BINARY);
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    if (klen < 0) {
+    if (args.Length() < 1 || !IsBytes(args[0])) {
+      return ThrowException(String::New("Must give iv as argument"));
+    }
+
+    ArgBytes iv_buf(args[0], BINARY);
+
+    if (iv_buf.len < 0) {
       Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
       return ThrowException(exception);
     }
 
-    char* kbuf = new char[klen];
-    ssize_t kwritten = DecodeWrite(kbuf, klen, args[0], BINARY);
-    assert(kwritten == klen);
+    if (!cipher->DecipherReset(iv_buf.data, iv_buf.len)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("reset needs a keyed cipher and an IV of the right length")));
+    }
+    StreamReset(&cipher->stream);
+
+    return args.This();
+  }
+
+  // setAAD(data): additional authenticated data for an AEAD cipher,
+  // given before any update().
+  static Handle<Value>
+  DecipherSetAAD(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+
+    HandleScope scope;
 
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
 
-    ssize_t hlen = DecodeBytes(args[1], BINARY);
+    ArgBytes buf(args[0], BINARY);
 
-    if (hlen < 0) {
+    if (buf.len < 0) {
       Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
       return ThrowException(exception);
     }
-    
-    unsigned char* hbuf = new unsigned char[hlen];
-    ssize_t hwritten = DecodeWrite((char *)hbuf, hlen, args[1], BINARY);
-    assert(hwritten == hlen);
-    unsigned char* dbuf;
-    int dlen;
 
-    int r=-1;
+    if (!cipher->DecipherSetAAD(buf.data, buf.len)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("setAAD needs an initialised AEAD cipher")));
+    }
 
-    if (args.Length() == 2 || !args[2]->IsString()) {
-      // Binary
-      r = verify->VerifyFinal(kbuf, klen, hbuf, hlen);
-    } else {
-      String::Utf8Value encoding(args[2]->ToString());
+    return args.This();
+  }
+
+  // setAuthTag(tag, [encoding]): the tag final() checks the data against.
+  static Handle<Value>
+  DecipherSetAuthTag(const Arguments& args) {
+    Decipher *cipher = ObjectWrap::Unwrap<Decipher>(args.This());
+
+    HandleScope scope;
+
+    if (cipher->StreamBusy()) return ThrowStreamBusy();
+
+    ArgBytes buf(args[0], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    unsigned char tag[base64_decoded_max(4 * AUTH_TAG_MAX)];
+    unsigned char *tag_data = (unsigned char *) buf.data;
+    ssize_t tag_len = buf.len;
+    if (args.Length() > 1 && args[1]->IsString()) {
+      String::Utf8Value encoding(args[1]->ToString());
       if (strcasecmp(*encoding, "hex") == 0) {
-        // Hex encoding
-        hex_decode(hbuf, hlen, (char **)&dbuf, &dlen);
-        r = verify->VerifyFinal(kbuf, klen, dbuf, dlen);
-	free(dbuf);
+        tag_len = buf.len <= 2 * AUTH_TAG_MAX ? hex_decode_raw(buf.data, buf.len, tag) : -1;
+        tag_data = tag;
       } else if (strcasecmp(*encoding, "base64") == 0) {
-        // Base64 encoding
-        unbase64(hbuf, hlen, (char **)&dbuf, &dlen);
-        r = verify->VerifyFinal(kbuf, klen, dbuf, dlen);
-	free(dbuf);
-      } else if (strcasecmp(*encoding, "binary") == 0) {
-        r = verify->VerifyFinal(kbuf, klen, hbuf, hlen);
-      } else {
-	fprintf(stderr, "node-crypto : Verify .verify encoding "
-		"can be binary, hex or base64\n");
+        tag_len = buf.len <= 4 * AUTH_TAG_MAX ? base64_decode_raw(buf.data, buf.len, tag, base64_flags) : -1;
+        tag_data = tag;
       }
     }
 
-    return scope.Close(Integer::New(r));
+    if (tag_len < 0 || !cipher->DecipherSetAuthTag(tag_data, tag_len)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("Invalid authentication tag")));
+    }
+
+    return args.This();
   }
 
-  Verify () : ObjectWrap () 
+  Decipher () : CryptoStream () 
   {
     initialised = false;
+    has_key = false;
+    ctx = NULL;
+    aead = false;
+    StreamInit(&stream);
   }
 
-  ~Verify ()
+  ~Decipher ()
   {
+    ReleaseKey();
+    StreamFree(&stream);
   }
 
  private:
 
-  EVP_MD_CTX mdctx;
-  const EVP_MD *md;
+  EVP_CIPHER_CTX *ctx;         // from cipher_ctx_pool, kept after final() for reset()
+  const EVP_CIPHER *cipher;
   bool initialised;
-
+  bool has_key;               // ctx still holds the key after final()
+  bool aead;
+  struct cipher_stream stream;
 };
 
 
 
+
+class Hmac : public CryptoStream {
+ public:
+  static Persistent<FunctionTemplate> constructor_template;
+
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    CryptoStream::InitializeStream(t);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "init", HmacInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "update", HmacUpdate);
+    NODE_SET_PROTOTYPE_METHOD(t, "digest", HmacDigest);
+    NODE_SET_PROTOTYPE_METHOD(t, "copy", HmacCopy);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", HmacReset);
+
+    target->Set(String::NewSymbol("Hmac"), t->GetFunction());
+  }
+
+  bool HmacInit(const EVP_MD* hashType, char* key, int key_len)
+  {
+    md = hashType;
+    if (key != this->key) {
+      FreeKey();
+      this->key = (char*) malloc(key_len + 1);
+      this->key_len = key_len;
+      memcpy(this->key, key, key_len);
+    }
+    if (ctx == NULL) ctx = (HMAC_CTX*) hmac_ctx_pool->Get();
+    HMAC_Init_ex(ctx, this->key, this->key_len, md, NULL);
+    initialised = true;
+    return true;
+    
+  }
+
+  int HmacUpdate(char* data, int len) {
+    if (!initialised)
+      return 0;
+    HMAC_Update(ctx, (unsigned char*)data, len);
+    return 1;
+  }
+
+  // Starts this object from the current state of another, so a shared
+  // prefix is only hashed once.
+  bool HmacCopy(Hmac *from) {
+    if (!from->initialised)
+      return false;
+    // Some OpenSSL versions overwrite the destination of HMAC_CTX_copy
+    // without freeing what it holds, so start from a blank one.
+    if (ctx == NULL) ctx = (HMAC_CTX*) hmac_ctx_pool->Get();
+    HMAC_CTX_cleanup(ctx);
+    if (!HMAC_CTX_copy(ctx, from->ctx)) {
+      ReleaseContext();
+      return false;
+    }
+    md = from->md;
+    FreeKey();
+    key = (char*) malloc(from->key_len + 1);
+    key_len = from->key_len;
+    memcpy(key, from->key, key_len);
+    initialised = true;
+    return true;
+  }
+
+  int HmacDigest(unsigned char** md_value, unsigned int *md_len) {
+    if (!initialised)
+      return 0;
+    *md_value = (unsigned char*) malloc(EVP_MAX_MD_SIZE);
+    HMAC_Final(ctx, *md_value, md_len);
+    ReleaseContext();
+    return 1;
+  }
+
+  // Starts a new message with the digest and key given to the last
+  // init().
+  bool HmacReset() {
+    if (key == NULL)
+      return false;
+    return HmacInit(md, key, key_len);
+  }
+
+  // Gives the context back to the pool.
+  void ReleaseContext() {
+    if (ctx != NULL) hmac_ctx_pool->Put(ctx);
+    ctx = NULL;
+    initialised = false;
+  }
+
+  void FreeKey() {
+    if (key != NULL) {
+      OPENSSL_cleanse(key, key_len);
+      free(key);
+    }
+    key = NULL;
+    key_len = 0;
+  }
+
+  // CryptoStream: the digest is the only output.
+  bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) {
+    *out_len = 0;
+    return HmacUpdate(data, len);
+  }
+
+  bool StreamFinal(unsigned char *out, int *out_len) {
+    unsigned int md_len;
+    if (!initialised)
+      return false;
+    HMAC_Final(ctx, out, &md_len);
+    ReleaseContext();
+    *out_len = md_len;
+    return true;
+  }
+
+  bool StreamReady() { return initialised; }
+
+ protected:
+
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    Hmac *hmac = new Hmac();
+    hmac->Wrap(args.This());
+    return args.This();
+  }
+
+  static Handle<Value>
+  HmacInit(const Arguments& args) {
+    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+
+    HandleScope scope;
+
+    if (hmac->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() == 0 || !IsAlgorithm(args[0])) {
+      return ThrowException(String::New("Must give hashtype string as argument"));
+    }
+
+    ArgBytes buf(args[1], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    const EVP_MD *hashType = ResolveDigest(args[0]);
+    if (!hashType) {
+      UnknownAlgorithm("message digest", args[0]);
+      return args.This();
+    }
+
+    bool r = hmac->HmacInit(hashType, buf.data, buf.len);
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  HmacUpdate(const Arguments& args) {
+    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+
+    HandleScope scope;
+
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return QueueUpdate(args, false);
+    }
+    if (hmac->StreamBusy()) return ThrowStreamBusy();
+
+    enum encoding enc = ParseEncoding(args[1]);
+
+    if (IsChunkArray(args[0])) {
+      Local<Array> chunks = Local<Array>::Cast(args[0]);
+      for (int i = 0; i < (int) chunks->Length(); i++) {
+        ArgBytes buf(chunks->Get(Integer::New(i)), enc);
+        hmac->HmacUpdate(buf.data, buf.len);
+      }
+      return args.This();
+    }
+
+    ArgBytes buf(args[0], enc);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    int r = hmac->HmacUpdate(buf.data, buf.len);
+
+    return args.This();
+  }
+
+  // copy(): a new Hmac carrying on from this one's state. Digesting
+  // either leaves the other untouched.
+  static Handle<Value>
+  HmacCopy(const Arguments& args) {
+    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+
+    HandleScope scope;
+
+    if (hmac->StreamBusy()) return ThrowStreamBusy();
+
+    Local<Object> copy_obj = constructor_template->GetFunction()->NewInstance();
+    Hmac *copy = ObjectWrap::Unwrap<Hmac>(copy_obj);
+
+    if (!copy->HmacCopy(hmac)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("HMAC_CTX_copy failed")));
+    }
+
+    return scope.Close(copy_obj);
+  }
+
+  // reset(): starts over with the digest and key of the last init(), so
+  // one object can MAC message after message.
+  static Handle<Value>
+  HmacReset(const Arguments& args) {
+    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+
+    HandleScope scope;
+
+    if (hmac->StreamBusy()) return ThrowStreamBusy();
+
+    if (!hmac->HmacReset()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  HmacDigest(const Arguments& args) {
+    Hmac *hmac = ObjectWrap::Unwrap<Hmac>(args.This());
+
+    HandleScope scope;
+
+    if (args.Length() > 0 && args[args.Length()-1]->IsFunction()) {
+      return QueueFinal(args);
+    }
+    if (hmac->StreamBusy()) return ThrowStreamBusy();
+
+    unsigned char* md_value;
+    unsigned int md_len;
+    char* md_hexdigest;
+    int md_hex_len;
+    Local<Value> outString ;
+
+    int r = hmac->HmacDigest(&md_value, &md_len);
+
+    if (md_len == 0 || r == 0) {
+      return scope.Close(String::New(""));
+    }
+
+    if (args.Length() == 0 || !args[0]->IsString()) {
+      // Binary
+      outString = Encode(md_value, md_len, BINARY);
+    } else {
+      String::Utf8Value encoding(args[0]->ToString());
+      if (strcasecmp(*encoding, "hex") == 0) {
+        // Hex encoding
+        hex_encode(md_value, md_len, &md_hexdigest, &md_hex_len);
+        outString = Encode(md_hexdigest, md_hex_len, BINARY);
+        free(md_hexdigest);
+      } else if (strcasecmp(*encoding, "base64") == 0) {
+        base64(md_value, md_len, &md_hexdigest, &md_hex_len);
+        outString = Encode(md_hexdigest, md_hex_len, BINARY);
+        free(md_hexdigest);
+      } else if (strcasecmp(*encoding, "binary") == 0) {
+        outString = Encode(md_value, md_len, BINARY);
+      } else {
+	fprintf(stderr, "node-crypto : Hmac .digest encoding "
+		"can be binary, hex or base64\n");
+      }
+    }
+    free(md_value);
+    return scope.Close(outString);
+
+  }
+
+  Hmac () : CryptoStream () 
+  {
+    ctx = NULL;
+    md = NULL;
+    key = NULL;
+    key_len = 0;
+    initialised = false;
+  }
+
+  ~Hmac ()
+  {
+    ReleaseContext();
+    FreeKey();
+  }
+
+ private:
+
+  HMAC_CTX *ctx;              // from hmac_ctx_pool while initialised
+  const EVP_MD *md;
+  char *key;                  // kept for reset()
+  int key_len;
+  bool initialised;
+
+};
+
+Persistent<FunctionTemplate> Hmac::constructor_template;
+
+// A keyed HMAC context for MACing many messages under the same key. The
+// ipad/opad blocks are hashed once here; each hmac() call starts from a
+// copy of that state.
+class HmacKey : public ObjectWrap {
+ public:
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "hmac", HmacKeyHmac);
+
+    target->Set(String::NewSymbol("HmacKey"), t->GetFunction());
+  }
+
+  bool KeyInit(const EVP_MD* hashType, char* key, int key_len)
+  {
+    HMAC_CTX_init(&ctx);
+    if (!HMAC_Init_ex(&ctx, key, key_len, hashType, NULL)) {
+      HMAC_CTX_cleanup(&ctx);
+      return false;
+    }
+    initialised = true;
+    return true;
+  }
+
+  bool HmacKeyHmac(char* data, int len, unsigned char* md_value, unsigned int *md_len)
+  {
+    HMAC_CTX mac;
+    HMAC_CTX_init(&mac);
+    bool r = HMAC_CTX_copy(&mac, &ctx) &&
+             HMAC_Update(&mac, (unsigned char*)data, len) &&
+             HMAC_Final(&mac, md_value, md_len);
+    HMAC_CTX_cleanup(&mac);
+    return r;
+  }
+
+ protected:
+
+  // new HmacKey(alg, key)
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() <= 1 || !IsAlgorithm(args[0]) || !IsBytes(args[1])) {
+      return ThrowException(String::New("Must give hashtype and key as argument"));
+    }
+
+    const EVP_MD *hashType = ResolveDigest(args[0]);
+    if (!hashType) {
+      return ThrowException(Exception::Error(String::New("Unknown message digest")));
+    }
+
+    ArgBytes buf(args[1], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    HmacKey *key = new HmacKey();
+    if (!key->KeyInit(hashType, buf.data, buf.len)) {
+      delete key;
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("HMAC_Init_ex failed")));
+    }
+
+    key->Wrap(args.This());
+    return args.This();
+  }
+
+  // hmac(data, [enc])
+  static Handle<Value>
+  HmacKeyHmac(const Arguments& args) {
+    HmacKey *key = ObjectWrap::Unwrap<HmacKey>(args.This());
+
+    HandleScope scope;
+
+    ArgBytes buf(args[0], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (!key->HmacKeyHmac(buf.data, buf.len, md_value, &md_len)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("HMAC failed")));
+    }
+
+    Local<Value> outString = EncodeDigest(md_value, md_len, args[1]);
+    if (outString.IsEmpty()) {
+      return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
+    }
+    return scope.Close(outString);
+  }
+
+  HmacKey () : ObjectWrap ()
+  {
+    initialised = false;
+  }
+
+  ~HmacKey ()
+  {
+    if (initialised) HMAC_CTX_cleanup(&ctx);
+  }
+
+ private:
+
+  HMAC_CTX ctx;
+  bool initialised;
+
+};
+
+
+class Hash : public CryptoStream {
+ public:
+  static Persistent<FunctionTemplate> constructor_template;
+
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    CryptoStream::InitializeStream(t);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "init", HashInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "update", HashUpdate);
+    NODE_SET_PROTOTYPE_METHOD(t, "digest", HashDigest);
+    NODE_SET_PROTOTYPE_METHOD(t, "copy", HashCopy);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", HashReset);
+
+    target->Set(String::NewSymbol("Hash"), t->GetFunction());
+
+    NODE_SET_METHOD(target, "hashMany", HashMany);
+  }
+
+  bool HashInit (const EVP_MD* hashType)
+  {
+    md = hashType;
+    if (mdctx == NULL) mdctx = (EVP_MD_CTX*) md_ctx_pool->Get();
+    EVP_DigestInit_ex(mdctx, md, NULL);
+    initialised = true;
+    return true;
+    
+  }
+
+  int HashUpdate(char* data, int len) {
+    if (!initialised)
+      return 0;
+    EVP_DigestUpdate(mdctx, data, len);
+    return 1;
+  }
+
+  // Starts this object from the current state of another, so a shared
+  // prefix is only hashed once.
+  bool HashCopy(Hash *from) {
+    if (!from->initialised)
+      return false;
+    if (mdctx == NULL) mdctx = (EVP_MD_CTX*) md_ctx_pool->Get();
+    if (!EVP_MD_CTX_copy_ex(mdctx, from->mdctx)) {
+      ReleaseContext();
+      return false;
+    }
+    md = from->md;
+    initialised = true;
+    return true;
+  }
+
+  int HashDigest(unsigned char** md_value, unsigned int *md_len) {
+    if (!initialised)
+      return 0;
+    *md_value = (unsigned char*) malloc(EVP_MAX_MD_SIZE);
+    EVP_DigestFinal_ex(mdctx, *md_value, md_len);
+    ReleaseContext();
+    return 1;
+  }
+
+  // Starts a new message with the digest given to the last init().
+  bool HashReset() {
+    if (md == NULL)
+      return false;
+    return HashInit(md);
+  }
+
+  // Gives the context back to the pool.
+  void ReleaseContext() {
+    if (mdctx != NULL) md_ctx_pool->Put(mdctx);
+    mdctx = NULL;
+    initialised = false;
+  }
+
+  // CryptoStream: the digest is the only output.
+  bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) {
+    *out_len = 0;
+    return HashUpdate(data, len);
+  }
+
+  bool StreamFinal(unsigned char *out, int *out_len) {
+    unsigned int md_len;
+    if (!initialised)
+      return false;
+    EVP_DigestFinal_ex(mdctx, out, &md_len);
+    ReleaseContext();
+    *out_len = md_len;
+    return true;
+  }
+
+  bool StreamReady() { return initialised; }
+
+ protected:
+
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    Hash *hash = new Hash();
+    hash->Wrap(args.This());
+    return args.This();
+  }
+
+  static Handle<Value>
+  HashInit(const Arguments& args) {
+    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
+
+    HandleScope scope;
+
+    if (hash->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() == 0 || !IsAlgorithm(args[0])) {
+      return ThrowException(String::New("Must give hashtype string as argument"));
+    }
+
+    const EVP_MD *hashType = ResolveDigest(args[0]);
+    if (!hashType) {
+      UnknownAlgorithm("message digest", args[0]);
+      return args.This();
+    }
+
+    bool r = hash->HashInit(hashType);
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  HashUpdate(const Arguments& args) {
+    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
+
+    HandleScope scope;
+
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return QueueUpdate(args, false);
+    }
+    if (hash->StreamBusy()) return ThrowStreamBusy();
+
+    enum encoding enc = ParseEncoding(args[1]);
+
+    if (IsChunkArray(args[0])) {
+      Local<Array> chunks = Local<Array>::Cast(args[0]);
+      for (int i = 0; i < (int) chunks->Length(); i++) {
+        ArgBytes buf(chunks->Get(Integer::New(i)), enc);
+        hash->HashUpdate(buf.data, buf.len);
+      }
+      return args.This();
+    }
+
+    ArgBytes buf(args[0], enc);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    int r = hash->HashUpdate(buf.data, buf.len);
+
+    return args.This();
+  }
+
+  // copy(): a new Hash carrying on from this one's state. Digesting
+  // either leaves the other untouched.
+  static Handle<Value>
+  HashCopy(const Arguments& args) {
+    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
+
+    HandleScope scope;
+
+    if (hash->StreamBusy()) return ThrowStreamBusy();
+
+    Local<Object> copy_obj = constructor_template->GetFunction()->NewInstance();
+    Hash *copy = ObjectWrap::Unwrap<Hash>(copy_obj);
+
+    if (!copy->HashCopy(hash)) {
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("EVP_MD_CTX_copy_ex failed")));
+    }
+
+    return scope.Close(copy_obj);
+  }
+
+  // reset(): starts over with the digest of the last init(), so one
+  // object can hash message after message.
+  static Handle<Value>
+  HashReset(const Arguments& args) {
+    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
+
+    HandleScope scope;
+
+    if (hash->StreamBusy()) return ThrowStreamBusy();
+
+    if (!hash->HashReset()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  HashDigest(const Arguments& args) {
+    Hash *hash = ObjectWrap::Unwrap<Hash>(args.This());
+
+    HandleScope scope;
+
+    if (args.Length() > 0 && args[args.Length()-1]->IsFunction()) {
+      return QueueFinal(args);
+    }
+    if (hash->StreamBusy()) return ThrowStreamBusy();
+
+    unsigned char* md_value;
+    unsigned int md_len;
+    char* md_hexdigest;
+    int md_hex_len;
+    Local<Value> outString ;
+
+    int r = hash->HashDigest(&md_value, &md_len);
+
+    if (md_len == 0 || r == 0) {
+      return scope.Close(String::New(""));
+    }
+
+    if (args.Length() == 0 || !args[0]->IsString()) {
+      // Binary
+      outString = Encode(md_value, md_len, BINARY);
+    } else {
+      String::Utf8Value encoding(args[0]->ToString());
+      if (strcasecmp(*encoding, "hex") == 0) {
+        // Hex encoding
+        hex_encode(md_value, md_len, &md_hexdigest, &md_hex_len);
+        outString = Encode(md_hexdigest, md_hex_len, BINARY);
+        free(md_hexdigest);
+      } else if (strcasecmp(*encoding, "base64") == 0) {
+        base64(md_value, md_len, &md_hexdigest, &md_hex_len);
+        outString = Encode(md_hexdigest, md_hex_len, BINARY);
+        free(md_hexdigest);
+      } else if (strcasecmp(*encoding, "binary") == 0) {
+        outString = Encode(md_value, md_len, BINARY);
+      } else {
+	fprintf(stderr, "node-crypto : Hash .digest encoding "
+		"can be binary, hex or base64\n");
+      }
+    }
+    free(md_value);
+    return scope.Close(outString);
+
+  }
+
+  struct hash_many_request {
+    Persistent<Function> cb;
+    Persistent<Value> encoding;
+    const EVP_MD *md;
+    char *data;                 // every input, back to back
+    size_t *offsets;            // input i is data[offsets[i]..offsets[i+1])
+    unsigned char *md_values;   // count digests of md_size bytes
+    int md_size;
+    int count;
+    int pending;
+  };
+
+  struct hash_many_task {
+    struct hash_many_request *req;
+    int start;
+    int end;
+  };
+
+  // Batches are split into at most this many thread pool tasks, each
+  // covering at least HASH_MANY_MIN_BYTES of input.
+  static const int HASH_MANY_MAX_TASKS = 4;
+  static const size_t HASH_MANY_MIN_BYTES = 64 * 1024;
+
+  // One EVP_MD_CTX is reinitialised for every item in the range, no V8.
+  static void
+  HashItems(struct hash_many_request *req, int start, int end)
+  {
+    EVP_MD_CTX mdctx;
+    EVP_MD_CTX_init(&mdctx);
+    for (int i = start; i < end; i++) {
+      EVP_DigestInit_ex(&mdctx, req->md, NULL);
+      EVP_DigestUpdate(&mdctx, req->data + req->offsets[i], req->offsets[i+1] - req->offsets[i]);
+      EVP_DigestFinal_ex(&mdctx, req->md_values + i * req->md_size, NULL);
+    }
+    EVP_MD_CTX_cleanup(&mdctx);
+  }
+
+  static void
+  FreeHashMany(struct hash_many_request *req)
+  {
+    free(req->data);
+    free(req->offsets);
+    free(req->md_values);
+    free(req);
+  }
+
+  static Local<Array>
+  HashManyResults(struct hash_many_request *req, Handle<Value> encoding)
+  {
+    HandleScope scope;
+
+    Local<Array> results = Array::New(req->count);
+    for (int i = 0; i < req->count; i++) {
+      results->Set(Integer::New(i), EncodeDigest(req->md_values + i * req->md_size, req->md_size, encoding));
+    }
+    return scope.Close(results);
+  }
+
+  static int
+  EIO_HashMany(eio_req *req) {
+    struct hash_many_task *task = (struct hash_many_task *)(req->data);
+
+    HashItems(task->req, task->start, task->end);
+    return 0;
+  }
+
+  static int
+  EIO_AfterHashMany(eio_req *req) {
+    HandleScope scope;
+
+    ev_unref(EV_DEFAULT_UC);
+    struct hash_many_task *task = (struct hash_many_task *)(req->data);
+    struct hash_many_request *hm_req = task->req;
+    free(task);
+
+    // After callbacks all run on the event loop, so no locking needed.
+    if (--hm_req->pending > 0)
+      return 0;
+
+    Local<Value> argv[2];
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = HashManyResults(hm_req, hm_req->encoding);
+
+    TryCatch try_catch;
+
+    hm_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    hm_req->cb.Dispose();
+    hm_req->encoding.Dispose();
+    FreeHashMany(hm_req);
+
+    return 0;
+  }
+
+  // hashMany(algorithm, [data, ...], [encoding], [callback])
+  // Digests every input in a single call and returns an array of
+  // digest(encoding) results. With a callback the batch is spread over
+  // the thread pool and the results are delivered as
+  // callback(err, results).
+  static Handle<Value>
+  HashMany(const Arguments& args) {
+    HandleScope scope;
+
+    Local<Function> cb;
+    int argc = args.Length();
+    if (argc > 2 && args[argc-1]->IsFunction()) {
+      cb = Local<Function>::Cast(args[argc-1]);
+      argc--;
+    }
+
+    if (argc < 2 || !IsAlgorithm(args[0]) || !args[1]->IsArray()) {
+      return ThrowException(String::New("Must give algorithm and array of data as argument"));
+    }
+
+    const EVP_MD *md = ResolveDigest(args[0]);
+    if (!md) {
+      return ThrowException(Exception::Error(String::New("Unknown message digest")));
+    }
+
+    Local<Value> encoding = argc > 2 ? args[2] : Local<Value>::New(Undefined());
+    if (!IsDigestEncoding(encoding)) {
+      return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
+    }
+
+    Local<Array> items = Local<Array>::Cast(args[1]);
+
+    struct hash_many_request *hm_req =
+      (struct hash_many_request *)calloc(1, sizeof(struct hash_many_request));
+    hm_req->md = md;
+    hm_req->md_size = EVP_MD_size(md);
+    hm_req->count = items->Length();
+    hm_req->offsets = (size_t *)malloc((hm_req->count + 1) * sizeof(size_t));
+    hm_req->md_values = (unsigned char *)malloc(hm_req->count * hm_req->md_size + 1);
+
+    // Copy the inputs into one block; strings cannot be read off the
+    // main thread and Buffers could be changed underneath us.
+    size_t size = 0, alloc = 0;
+    for (int i = 0; i < hm_req->count; i++) {
+      ArgBytes buf(items->Get(Integer::New(i)), BINARY);
+      if (buf.len < 0) {
+        FreeHashMany(hm_req);
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+      if (size + buf.len > alloc) {
+        alloc = (size + buf.len) * 2;
+        hm_req->data = (char *)realloc(hm_req->data, alloc);
+      }
+      hm_req->offsets[i] = size;
+      memcpy(hm_req->data + size, buf.data, buf.len);
+      size += buf.len;
+    }
+    hm_req->offsets[hm_req->count] = size;
+
+    if (cb.IsEmpty()) {
+      HashItems(hm_req, 0, hm_req->count);
+      Local<Array> results = HashManyResults(hm_req, encoding);
+      FreeHashMany(hm_req);
+      return scope.Close(results);
+    }
+
+    size_t ntasks = size / HASH_MANY_MIN_BYTES;
+    if (ntasks > (size_t) HASH_MANY_MAX_TASKS) ntasks = HASH_MANY_MAX_TASKS;
+    if (ntasks > (size_t) hm_req->count) ntasks = hm_req->count;
+    if (ntasks < 1) ntasks = 1;
+
+    hm_req->cb = Persistent<Function>::New(cb);
+    hm_req->encoding = Persistent<Value>::New(encoding);
+    hm_req->pending = ntasks;
+
+    // Split on input boundaries so each task gets about the same number
+    // of bytes.
+    int start = 0;
+    for (size_t t = 0; t < ntasks; t++) {
+      int end = start;
+      if (t == ntasks - 1) {
+        end = hm_req->count;
+      } else {
+        // Leave at least one input for each task still to come.
+        int limit = hm_req->count - (ntasks - t - 1);
+        size_t target = size * (t + 1) / ntasks;
+        while (end < limit && hm_req->offsets[end + 1] <= target) end++;
+        if (end == start) end++;
+      }
+
+      struct hash_many_task *task = (struct hash_many_task *)malloc(sizeof(struct hash_many_task));
+      task->req = hm_req;
+      task->start = start;
+      task->end = end;
+      start = end;
+
+      eio_custom(EIO_HashMany, EIO_PRI_DEFAULT, EIO_AfterHashMany, task);
+      ev_ref(EV_DEFAULT_UC);
+    }
+
+    return Undefined();
+  }
+
+  Hash () : CryptoStream () 
+  {
+    mdctx = NULL;
+    md = NULL;
+    initialised = false;
+  }
+
+  ~Hash ()
+  {
+    ReleaseContext();
+  }
+
+ private:
+
+  EVP_MD_CTX *mdctx;           // from md_ctx_pool while initialised
+  const EVP_MD *md;
+  bool initialised;
+
+};
+
+Persistent<FunctionTemplate> Hash::constructor_template;
+
+// Parsed key material. Sign and Verify accept these in place of PEM
+// strings so the PEM/ASN.1 parse happens once per key instead of once
+// per signature.
+class PrivateKey : public ObjectWrap {
+ public:
+  static Persistent<FunctionTemplate> constructor_template;
+
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    target->Set(String::NewSymbol("PrivateKey"), t->GetFunction());
+  }
+
+  static bool
+  HasInstance (Handle<Value> val)
+  {
+    return val->IsObject() && constructor_template->HasInstance(val);
+  }
+
+  bool KeyInit(char* keyPem, int keyPemLen, char* passphrase)
+  {
+    BIO *bp = BIO_new(BIO_s_mem());
+    if (!BIO_write(bp, keyPem, keyPemLen)) {
+      BIO_free(bp);
+      return false;
+    }
+
+    pkey = PEM_read_bio_PrivateKey(bp, NULL, NULL, passphrase);
+    BIO_free(bp);
+    return pkey != NULL;
+  }
+
+  EVP_PKEY *pkey;
+
+ protected:
+
+  // new PrivateKey(pem, [passphrase])
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() == 0 || !IsBytes(args[0])) {
+      return ThrowException(String::New("Must give PEM private key as argument"));
+    }
+
+    ArgBytes buf(args[0], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    PrivateKey *key = new PrivateKey();
+    bool r;
+    if (args.Length() > 1 && args[1]->IsString()) {
+      String::Utf8Value passphrase(args[1]->ToString());
+      r = key->KeyInit(buf.data, buf.len, *passphrase);
+    } else {
+      r = key->KeyInit(buf.data, buf.len, NULL);
+    }
+
+    if (!r) {
+      delete key;
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("PEM_read_bio_PrivateKey failed")));
+    }
+
+    key->Wrap(args.This());
+    return args.This();
+  }
+
+  PrivateKey () : ObjectWrap ()
+  {
+    pkey = NULL;
+  }
+
+  ~PrivateKey ()
+  {
+    if (pkey) EVP_PKEY_free(pkey);
+  }
+};
+
+Persistent<FunctionTemplate> PrivateKey::constructor_template;
+
+
+class PublicKey : public ObjectWrap {
+ public:
+  static Persistent<FunctionTemplate> constructor_template;
+
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    target->Set(String::NewSymbol("PublicKey"), t->GetFunction());
+  }
+
+  static bool
+  HasInstance (Handle<Value> val)
+  {
+    return val->IsObject() && constructor_template->HasInstance(val);
+  }
+
+  // Accepts a SubjectPublicKeyInfo ("PUBLIC KEY") or PKCS#1
+  // ("RSA PUBLIC KEY") PEM block. The BIO is read-only so that
+  // BIO_reset() rewinds it for the second attempt.
+  bool KeyInit(char* keyPem, int keyPemLen)
+  {
+    BIO *bp = BIO_new_mem_buf(keyPem, keyPemLen);
+    if (bp == NULL)
+      return false;
+
+    pkey = PEM_read_bio_PUBKEY(bp, NULL, NULL, NULL);
+    if (pkey == NULL) {
+      BIO_reset(bp);
+      RSA *rsa = PEM_read_bio_RSAPublicKey(bp, NULL, NULL, NULL);
+      if (rsa != NULL) {
+        pkey = EVP_PKEY_new();
+        EVP_PKEY_assign_RSA(pkey, rsa);
+      }
+    }
+    BIO_free(bp);
+    return pkey != NULL;
+  }
+
+  EVP_PKEY *pkey;
+
+ protected:
+
+  // new PublicKey(pem)
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() == 0 || !IsBytes(args[0])) {
+      return ThrowException(String::New("Must give PEM public key as argument"));
+    }
+
+    ArgBytes buf(args[0], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    PublicKey *key = new PublicKey();
+    bool r = key->KeyInit(buf.data, buf.len);
+
+    if (!r) {
+      delete key;
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("PEM_read_bio_PUBKEY failed")));
+    }
+
+    key->Wrap(args.This());
+    return args.This();
+  }
+
+  PublicKey () : ObjectWrap ()
+  {
+    pkey = NULL;
+  }
+
+  ~PublicKey ()
+  {
+    if (pkey) EVP_PKEY_free(pkey);
+  }
+};
+
+Persistent<FunctionTemplate> PublicKey::constructor_template;
+
+
+class Certificate : public ObjectWrap {
+ public:
+  static Persistent<FunctionTemplate> constructor_template;
+
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    target->Set(String::NewSymbol("Certificate"), t->GetFunction());
+  }
+
+  static bool
+  HasInstance (Handle<Value> val)
+  {
+    return val->IsObject() && constructor_template->HasInstance(val);
+  }
+
+  bool CertInit(char* certPem, int certPemLen)
+  {
+    BIO *bp = BIO_new(BIO_s_mem());
+    if (!BIO_write(bp, certPem, certPemLen)) {
+      BIO_free(bp);
+      return false;
+    }
+
+    x509 = PEM_read_bio_X509(bp, NULL, NULL, NULL);
+    BIO_free(bp);
+    if (x509 == NULL)
+      return false;
+
+    pkey = X509_get_pubkey(x509);
+    return pkey != NULL;
+  }
+
+  X509 *x509;
+  EVP_PKEY *pkey;
+
+ protected:
+
+  // new Certificate(pem)
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() == 0 || !IsBytes(args[0])) {
+      return ThrowException(String::New("Must give PEM certificate as argument"));
+    }
+
+    ArgBytes buf(args[0], BINARY);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    Certificate *cert = new Certificate();
+    bool r = cert->CertInit(buf.data, buf.len);
+
+    if (!r) {
+      delete cert;
+      ERR_clear_error();
+      return ThrowException(Exception::Error(String::New("PEM_read_bio_X509 failed")));
+    }
+
+    cert->Wrap(args.This());
+    return args.This();
+  }
+
+  Certificate () : ObjectWrap ()
+  {
+    x509 = NULL;
+    pkey = NULL;
+  }
+
+  ~Certificate ()
+  {
+    if (pkey) EVP_PKEY_free(pkey);
+    if (x509) X509_free(x509);
+  }
+};
+
+Persistent<FunctionTemplate> Certificate::constructor_template;
+
+
+class Sign : public CryptoStream {
+ public:
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    CryptoStream::InitializeStream(t);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "init", SignInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "update", SignUpdate);
+    NODE_SET_PROTOTYPE_METHOD(t, "sign", SignFinal);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", SignReset);
+
+    target->Set(String::NewSymbol("Sign"), t->GetFunction());
+  }
+
+  bool SignInit (const EVP_MD* signType)
+  {
+    md = signType;
+    if (mdctx == NULL) mdctx = (EVP_MD_CTX*) md_ctx_pool->Get();
+    EVP_SignInit_ex(mdctx, md, NULL);
+    initialised = true;
+    return true;
+    
+  }
+
+  int SignUpdate(char* data, int len) {
+    if (!initialised)
+      return 0;
+    EVP_SignUpdate(mdctx, data, len);
+    return 1;
+  }
+
+  int SignFinal(unsigned char** md_value, unsigned int *md_len, char* keyPem, int keyPemLen) {
+    if (!initialised)
+      return 0;
+
+    EVP_PKEY* pkey = LoadPrivateKey(keyPem, keyPemLen);
+    if (pkey == NULL)
+      return 0;
+
+    int r = SignFinal(md_value, md_len, pkey);
+    EVP_PKEY_free(pkey);
+    return r;
+  }
+
+  int SignFinal(unsigned char** md_value, unsigned int *md_len, EVP_PKEY* pkey) {
+    if (!initialised)
+      return 0;
+
+    EVP_SignFinal(mdctx, *md_value, md_len, pkey);
+    // This may run on the thread pool; the caller releases the context.
+    initialised = false;
+    return 1;
+  }
+
+  // Starts a new message with the digest given to the last init().
+  bool SignReset() {
+    if (md == NULL)
+      return false;
+    return SignInit(md);
+  }
+
+  // Gives the context back to the pool. Called on the main thread once
+  // a final has cleared initialised.
+  void ReleaseContext() {
+    if (mdctx != NULL) md_ctx_pool->Put(mdctx);
+    mdctx = NULL;
+    initialised = false;
+  }
+
+  // CryptoStream: data only goes in; sign() is called after 'end'.
+  bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) {
+    *out_len = 0;
+    return SignUpdate(data, len);
+  }
+
+  bool StreamFinal(unsigned char *out, int *out_len) {
+    *out_len = 0;
+    return true;
+  }
+
+  bool StreamReady() { return initialised; }
+
+ protected:
+
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    Sign *sign = new Sign();
+    sign->Wrap(args.This());
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  SignInit(const Arguments& args) {
+    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+
+    HandleScope scope;
+
+    if (sign->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() == 0 || !IsAlgorithm(args[0])) {
+      return ThrowException(String::New("Must give signtype string as argument"));
+    }
+
+    const EVP_MD *signType = ResolveDigest(args[0]);
+    if (!signType) {
+      UnknownAlgorithm("message digest", args[0]);
+      return args.This();
+    }
+
+    bool r = sign->SignInit(signType);
+
+    return args.This();
+  }
+
+  // reset(): starts over with the digest of the last init(), so one
+  // object can sign message after message.
+  static Handle<Value>
+  SignReset(const Arguments& args) {
+    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+
+    HandleScope scope;
+
+    if (sign->StreamBusy()) return ThrowStreamBusy();
+
+    if (!sign->SignReset()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  SignUpdate(const Arguments& args) {
+    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+
+    HandleScope scope;
+
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return QueueUpdate(args, false);
+    }
+    if (sign->StreamBusy()) return ThrowStreamBusy();
+
+    enum encoding enc = ParseEncoding(args[1]);
+
+    if (IsChunkArray(args[0])) {
+      Local<Array> chunks = Local<Array>::Cast(args[0]);
+      for (int i = 0; i < (int) chunks->Length(); i++) {
+        ArgBytes buf(chunks->Get(Integer::New(i)), enc);
+        sign->SignUpdate(buf.data, buf.len);
+      }
+      return args.This();
+    }
+
+    ArgBytes buf(args[0], enc);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    int r = sign->SignUpdate(buf.data, buf.len);
+
+    return args.This();
+  }
+
+  struct sign_request {
+    Persistent<Function> cb;
+    Persistent<Value> encoding;
+    Persistent<Object> key_obj;
+    Sign *sign;
+    EVP_PKEY *pkey;
+    char *key_pem;
+    int key_pem_len;
+    unsigned char *md_value;
+    unsigned int md_len;
+    int r;
+  };
+
+  // Runs on the thread pool: PEM parse and EVP_SignFinal only, no V8.
+  static int
+  EIO_SignFinal(eio_req *req) {
+    struct sign_request *sign_req = (struct sign_request *)(req->data);
+
+    if (sign_req->pkey) {
+      sign_req->r = sign_req->sign->SignFinal(&sign_req->md_value, &sign_req->md_len,
+                                              sign_req->pkey);
+    } else {
+      sign_req->r = sign_req->sign->SignFinal(&sign_req->md_value, &sign_req->md_len,
+                                              sign_req->key_pem, sign_req->key_pem_len);
+    }
+    return 0;
+  }
+
+  static int
+  EIO_AfterSignFinal(eio_req *req) {
+    HandleScope scope;
+
+    ev_unref(EV_DEFAULT_UC);
+    struct sign_request *sign_req = (struct sign_request *)(req->data);
+    sign_req->sign->final_pending_ = false;
+    if (!sign_req->sign->initialised) sign_req->sign->ReleaseContext();
+    sign_req->sign->Unref();
+
+    Local<Value> argv[2];
+
+    if (sign_req->r == 0 || sign_req->md_len == 0) {
+      argv[0] = Exception::Error(String::New("SignFinal error"));
+      argv[1] = Local<Value>::New(Undefined());
+    } else {
+      argv[0] = Local<Value>::New(Null());
+      argv[1] = EncodeSignature(sign_req->md_value, sign_req->md_len, sign_req->encoding);
+    }
+
+    TryCatch try_catch;
+
+    sign_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    sign_req->cb.Dispose();
+    sign_req->encoding.Dispose();
+    sign_req->key_obj.Dispose();
+    delete [] sign_req->md_value;
+    if (sign_req->key_pem) free(sign_req->key_pem);
+    free(sign_req);
+
+    return 0;
+  }
+
+  static Local<Value>
+  EncodeSignature(unsigned char* md_value, unsigned int md_len, Handle<Value> encoding_v) {
+    HandleScope scope;
+
+    char* md_hexdigest;
+    int md_hex_len;
+    Local<Value> outString;
+
+    if (encoding_v.IsEmpty() || !encoding_v->IsString()) {
+      // Binary
+      outString = Encode(md_value, md_len, BINARY);
+    } else {
+      String::Utf8Value encoding(encoding_v->ToString());
+      if (strcasecmp(*encoding, "hex") == 0) {
+        // Hex encoding
+        hex_encode(md_value, md_len, &md_hexdigest, &md_hex_len);
+        outString = Encode(md_hexdigest, md_hex_len, BINARY);
+        free(md_hexdigest);
+      } else if (strcasecmp(*encoding, "base64") == 0) {
+        base64(md_value, md_len, &md_hexdigest, &md_hex_len);
+        outString = Encode(md_hexdigest, md_hex_len, BINARY);
+        free(md_hexdigest);
+      } else if (strcasecmp(*encoding, "binary") == 0) {
+        outString = Encode(md_value, md_len, BINARY);
+      } else {
+	outString = String::New("");
+	fprintf(stderr, "node-crypto : Sign .sign encoding "
+		"can be binary, hex or base64\n");
+      }
+    }
+    return scope.Close(outString);
+  }
+
+  // sign(key, [encoding], [callback])
+  // key is a PEM string or a PrivateKey. With a callback the key parse
+  // and the RSA operation run on the thread pool and the signature is
+  // delivered as callback(err, sig).
+  static Handle<Value>
+  SignFinalAsync(const Arguments& args, Local<Function> cb) {
+    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+
+    HandleScope scope;
+
+    if (!sign->initialised) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
+
+    struct sign_request *sign_req;
+
+    if (PrivateKey::HasInstance(args[0])) {
+      // The request holds the key object so it outlives the worker.
+      PrivateKey *key = ObjectWrap::Unwrap<PrivateKey>(args[0]->ToObject());
+      sign_req = (struct sign_request *)calloc(1, sizeof(struct sign_request));
+      sign_req->pkey = key->pkey;
+      sign_req->key_obj = Persistent<Object>::New(args[0]->ToObject());
+    } else {
+      ArgBytes buf(args[0], BINARY);
+
+      if (buf.len < 0) {
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+
+      sign_req = (struct sign_request *)calloc(1, sizeof(struct sign_request));
+
+      // The worker outlives buf, so it gets its own copy.
+      sign_req->key_pem = (char *)malloc(buf.len + 1);
+      sign_req->key_pem_len = buf.len;
+      memcpy(sign_req->key_pem, buf.data, buf.len);
+    }
+
+    sign_req->md_len = 8192; // Maximum key size is 8192 bits
+    sign_req->md_value = new unsigned char[sign_req->md_len];
+    sign_req->sign = sign;
+    sign_req->cb = Persistent<Function>::New(cb);
+    sign_req->encoding = Persistent<Value>::New(args.Length() > 2 ? args[1] : Local<Value>());
+
+    // The worker owns the context until EIO_AfterSignFinal.
+    sign->final_pending_ = true;
+    eio_custom(EIO_SignFinal, EIO_PRI_DEFAULT, EIO_AfterSignFinal, sign_req);
+
+    ev_ref(EV_DEFAULT_UC);
+    sign->Ref();
+
+    return Undefined();
+  }
+
+  static Handle<Value>
+  SignFinal(const Arguments& args) {
+    Sign *sign = ObjectWrap::Unwrap<Sign>(args.This());
+
+    HandleScope scope;
+
+    if (sign->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return SignFinalAsync(args, Local<Function>::Cast(args[args.Length()-1]));
+    }
+
+    unsigned char* md_value;
+    unsigned int md_len;
+    Local<Value> outString;
+
+    unsigned char md_buf[8192]; // Maximum key size is 8192 bits
+    md_len = sizeof(md_buf);
+    md_value = md_buf;
+
+    int r;
+
+    if (PrivateKey::HasInstance(args[0])) {
+      PrivateKey *key = ObjectWrap::Unwrap<PrivateKey>(args[0]->ToObject());
+      r = sign->SignFinal(&md_value, &md_len, key->pkey);
+    } else {
+      ArgBytes buf(args[0], BINARY);
+
+      if (buf.len < 0) {
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+
+      r = sign->SignFinal(&md_value, &md_len, buf.data, buf.len);
+    }
+    if (!sign->initialised) sign->ReleaseContext();
+
+    if (md_len == 0 || r == 0) {
+      return scope.Close(String::New(""));
+    }
+
+    outString = EncodeSignature(md_value, md_len, args.Length() == 1 ? Local<Value>() : args[1]);
+    return scope.Close(outString);
+
+  }
+
+  Sign () : CryptoStream () 
+  {
+    mdctx = NULL;
+    md = NULL;
+    initialised = false;
+  }
+
+  ~Sign ()
+  {
+    ReleaseContext();
+  }
+
+ private:
+
+  EVP_MD_CTX *mdctx;          // from md_ctx_pool until ReleaseContext()
+  const EVP_MD *md;
+  bool initialised;
+
+};
+
+class Verify : public CryptoStream {
+ public:
+  static void
+  Initialize (v8::Handle<v8::Object> target)
+  {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    CryptoStream::InitializeStream(t);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "init", VerifyInit);
+    NODE_SET_PROTOTYPE_METHOD(t, "update", VerifyUpdate);
+    NODE_SET_PROTOTYPE_METHOD(t, "verify", VerifyFinal);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", VerifyReset);
+
+    target->Set(String::NewSymbol("Verify"), t->GetFunction());
+
+    NODE_SET_METHOD(target, "verifyMany", VerifyMany);
+  }
+
+  bool VerifyInit (const EVP_MD* verifyType)
+  {
+    md = verifyType;
+    if (mdctx == NULL) mdctx = (EVP_MD_CTX*) md_ctx_pool->Get();
+    EVP_VerifyInit_ex(mdctx, md, NULL);
+    initialised = true;
+    return true;
+    
+  }
+
+  int VerifyUpdate(char* data, int len) {
+    if (!initialised)
+      return 0;
+    EVP_VerifyUpdate(mdctx, data, len);
+    return 1;
+  }
+
+  int VerifyFinal(char* keyPem, int keyPemLen, unsigned char* sig, int siglen) {
+    if (!initialised)
+      return 0;
+
+    EVP_PKEY* pkey = LoadCertificateKey(keyPem, keyPemLen);
+    if (pkey == NULL)
+      return 0;
+
+    int r = VerifyFinal(pkey, sig, siglen);
+    EVP_PKEY_free(pkey);
+    return r;
+  }
+
+  int VerifyFinal(EVP_PKEY* pkey, unsigned char* sig, int siglen) {
+    if (!initialised)
+      return 0;
+
+    int r = EVP_VerifyFinal(mdctx, sig, siglen, pkey);
+
+    if (r != 1) {
+      ERR_print_errors_fp (stderr);
+    }
+    // This may run on the thread pool; the caller releases the context.
+    initialised = false;
+    return r;
+  }
+
+  // Starts a new message with the digest given to the last init().
+  bool VerifyReset() {
+    if (md == NULL)
+      return false;
+    return VerifyInit(md);
+  }
+
+  // Gives the context back to the pool. Called on the main thread once
+  // a final has cleared initialised.
+  void ReleaseContext() {
+    if (mdctx != NULL) md_ctx_pool->Put(mdctx);
+    mdctx = NULL;
+    initialised = false;
+  }
+
+  // CryptoStream: data only goes in; verify() is called after 'end'.
+  bool StreamUpdate(char *data, int len, unsigned char *out, int *out_len) {
+    *out_len = 0;
+    return VerifyUpdate(data, len);
+  }
+
+  bool StreamFinal(unsigned char *out, int *out_len) {
+    *out_len = 0;
+    return true;
+  }
+
+  bool StreamReady() { return initialised; }
+
+ protected:
+
+  static Handle<Value>
+  New (const Arguments& args)
+  {
+    HandleScope scope;
+
+    Verify *verify = new Verify();
+    verify->Wrap(args.This());
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  VerifyInit(const Arguments& args) {
+    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
+
+    HandleScope scope;
+
+    if (verify->StreamBusy()) return ThrowStreamBusy();
+
+    if (args.Length() == 0 || !IsAlgorithm(args[0])) {
+      return ThrowException(String::New("Must give verifytype string as argument"));
+    }
+
+    const EVP_MD *verifyType = ResolveDigest(args[0]);
+    if (!verifyType) {
+      UnknownAlgorithm("message digest", args[0]);
+      return args.This();
+    }
+
+    bool r = verify->VerifyInit(verifyType);
+
+    return args.This();
+  }
+
+  // reset(): starts over with the digest of the last init(), so one
+  // object can verify message after message.
+  static Handle<Value>
+  VerifyReset(const Arguments& args) {
+    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
+
+    HandleScope scope;
+
+    if (verify->StreamBusy()) return ThrowStreamBusy();
+
+    if (!verify->VerifyReset()) {
+      return ThrowException(Exception::Error(String::New("Not initialised")));
+    }
+
+    return args.This();
+  }
+
+  static Handle<Value>
+  VerifyUpdate(const Arguments& args) {
+    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
+
+    HandleScope scope;
+
+    if (args.Length() > 1 && args[args.Length()-1]->IsFunction()) {
+      return QueueUpdate(args, false);
+    }
+    if (verify->StreamBusy()) return ThrowStreamBusy();
+
+    enum encoding enc = ParseEncoding(args[1]);
+
+    if (IsChunkArray(args[0])) {
+      Local<Array> chunks = Local<Array>::Cast(args[0]);
+      for (int i = 0; i < (int) chunks->Length(); i++) {
+        ArgBytes buf(chunks->Get(Integer::New(i)), enc);
+        verify->VerifyUpdate(buf.data, buf.len);
+      }
+      return args.This();
+    }
+
+    ArgBytes buf(args[0], enc);
+
+    if (buf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+
+    int r = verify->VerifyUpdate(buf.data, buf.len);
+
+    return args.This();
+  }
+
+  struct verify_request {
+    Persistent<Function> cb;
+    Persistent<Object> key_obj;
+    Verify *verify;
+    EVP_PKEY *pkey;
+    char *key_pem;
+    int key_pem_len;
+    unsigned char *sig;
+    int sig_len;
+    int r;
+  };
+
+  // Runs on the thread pool: PEM parse and EVP_VerifyFinal only, no V8.
+  static int
+  EIO_VerifyFinal(eio_req *req) {
+    struct verify_request *verify_req = (struct verify_request *)(req->data);
+
+    if (verify_req->sig && verify_req->pkey) {
+      verify_req->r = verify_req->verify->VerifyFinal(verify_req->pkey,
+                                                      verify_req->sig, verify_req->sig_len);
+    } else if (verify_req->sig) {
+      // Unlike the synchronous verify(), a certificate that does not
+      // parse is reported as an error rather than a mismatch.
+      EVP_PKEY *pkey = LoadCertificateKey(verify_req->key_pem, verify_req->key_pem_len);
+      if (pkey == NULL) {
+        ERR_clear_error();
+        verify_req->r = -1;
+      } else {
+        verify_req->r = verify_req->verify->VerifyFinal(pkey, verify_req->sig, verify_req->sig_len);
+        EVP_PKEY_free(pkey);
+      }
+    }
+    return 0;
+  }
+
+  static int
+  EIO_AfterVerifyFinal(eio_req *req) {
+    HandleScope scope;
+
+    ev_unref(EV_DEFAULT_UC);
+    struct verify_request *verify_req = (struct verify_request *)(req->data);
+    verify_req->verify->final_pending_ = false;
+    if (!verify_req->verify->initialised) verify_req->verify->ReleaseContext();
+    verify_req->verify->Unref();
+
+    Local<Value> argv[2];
+
+    // -1 means the key, signature encoding or OpenSSL failed, not that
+    // the signature does not match.
+    if (verify_req->r < 0) {
+      argv[0] = Exception::Error(String::New("VerifyFinal error"));
+      argv[1] = Local<Value>::New(Undefined());
+    } else {
+      argv[0] = Local<Value>::New(Null());
+      argv[1] = Integer::New(verify_req->r);
+    }
+
+    TryCatch try_catch;
+
+    verify_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    verify_req->cb.Dispose();
+    verify_req->key_obj.Dispose();
+    if (verify_req->sig) free(verify_req->sig);
+    if (verify_req->key_pem) free(verify_req->key_pem);
+    free(verify_req);
+
+    return 0;
+  }
+
+  // verify(cert, signature, [encoding], [callback])
+  // cert is a PEM certificate string, a Certificate or a PublicKey.
+  // With a callback the certificate parse and the public key operation
+  // run on the thread pool and the result is delivered as
+  // callback(err, r).
+  static Handle<Value>
+  VerifyFinal(const Arguments& args) {
+    Verify *verify = ObjectWrap::Unwrap<Verify>(args.This());
+
+    HandleScope scope;
+
+    if (verify->StreamBusy()) return ThrowStreamBusy();
+
+    Local<Function> cb;
+    int argc = args.Length();
+    if (argc > 2 && args[argc-1]->IsFunction()) {
+      cb = Local<Function>::Cast(args[argc-1]);
+      argc--;
+    }
+
+    EVP_PKEY* pkey = NULL;
+    ArgBytes kbuf;
+
+    if (Certificate::HasInstance(args[0])) {
+      pkey = ObjectWrap::Unwrap<Certificate>(args[0]->ToObject())->pkey;
+    } else if (PublicKey::HasInstance(args[0])) {
+      pkey = ObjectWrap::Unwrap<PublicKey>(args[0]->ToObject())->pkey;
+    } else {
+      kbuf.Decode(args[0], BINARY);
+
+      if (kbuf.len < 0) {
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+    }
+
+    ArgBytes hbuf(args[1], BINARY);
+
+    if (hbuf.len < 0) {
+      Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+      return ThrowException(exception);
+    }
+    
+    unsigned char* dbuf = NULL;
+    int dlen = 0;
+    unsigned char* sig = (unsigned char*) hbuf.data;
+    int siglen = hbuf.len;
+    bool bad_sig = false;
+
+    if (argc > 2 && args[2]->IsString()) {
+      String::Utf8Value encoding(args[2]->ToString());
+      if (strcasecmp(*encoding, "hex") == 0) {
+        // Hex encoding
+        // sig is left NULL on invalid hex.
+        bad_sig = hex_decode(sig, siglen, (char **)&dbuf, &dlen) < 0;
+        sig = dbuf;
+        siglen = dlen;
+      } else if (strcasecmp(*encoding, "base64") == 0) {
+        // Base64 encoding
+        // sig is left NULL on invalid base64.
+        bad_sig = unbase64(sig, siglen, (char **)&dbuf, &dlen, base64_flags) < 0;
+        sig = dbuf;
+        siglen = dlen;
+      } else if (strcasecmp(*encoding, "binary") == 0) {
+        // Binary - do nothing
+      } else {
+	fprintf(stderr, "node-crypto : Verify .verify encoding "
+		"can be binary, hex or base64\n");
+        sig = NULL;
+      }
+    }
+
+    if (!cb.IsEmpty()) {
+      if (!verify->initialised) {
+        if (dbuf) free(dbuf);
+        return ThrowException(Exception::Error(String::New("Not initialised")));
+      }
+
+      struct verify_request *verify_req = (struct verify_request *)calloc(1, sizeof(struct verify_request));
+
+      verify_req->pkey = pkey;
+      if (pkey) {
+        // The request holds the key object so it outlives the worker.
+        verify_req->key_obj = Persistent<Object>::New(args[0]->ToObject());
+      } else {
+        // The worker outlives kbuf, so it gets its own copy.
+        verify_req->key_pem = (char *)malloc(kbuf.len + 1);
+        verify_req->key_pem_len = kbuf.len;
+        memcpy(verify_req->key_pem, kbuf.data, kbuf.len);
+      }
+      if (sig) {
+        verify_req->sig = (unsigned char *)malloc(siglen + 1);
+        verify_req->sig_len = siglen;
+        memcpy(verify_req->sig, sig, siglen);
+      }
+      verify_req->r = -1;
+      verify_req->verify = verify;
+      verify_req->cb = Persistent<Function>::New(cb);
+
+      if (dbuf) free(dbuf);
+
+      // The worker owns the context until EIO_AfterVerifyFinal.
+      verify->final_pending_ = true;
+      eio_custom(EIO_VerifyFinal, EIO_PRI_DEFAULT, EIO_AfterVerifyFinal, verify_req);
+
+      ev_ref(EV_DEFAULT_UC);
+      verify->Ref();
+
+      return Undefined();
+    }
+
+    int r=-1;
+
+    // A signature that does not decode cannot match; the callback form
+    // reports it as an error instead.
+    if (bad_sig) {
+      r = 0;
+    } else if (sig && pkey) {
+      r = verify->VerifyFinal(pkey, sig, siglen);
+    } else if (sig) {
+      r = verify->VerifyFinal(kbuf.data, kbuf.len, sig, siglen);
+    }
+    if (!verify->initialised) verify->ReleaseContext();
+    if (dbuf) free(dbuf);
+
+    return scope.Close(Integer::New(r));
+  }
+
+  struct verify_item {
+    char *data;
+    int data_len;
+    unsigned char *sig;
+    int sig_len;
+    int r;
+  };
+
+  struct verify_many_request {
+    Persistent<Function> cb;
+    const EVP_MD *md;
+    EVP_PKEY *pkey;
+    struct verify_item *items;
+    int count;
+    int pending;
+  };
+
+  struct verify_many_task {
+    struct verify_many_request *req;
+    int start;
+    int end;
+  };
+
+  // Batches are split into at most this many thread pool tasks, each
+  // covering at least VERIFY_MANY_MIN_ITEMS items.
+  static const int VERIFY_MANY_MAX_TASKS = 4;
+  static const int VERIFY_MANY_MIN_ITEMS = 16;
+
+  // One EVP_MD_CTX is reinitialised for every item in the range, no V8.
+  static void
+  VerifyItems(const EVP_MD *md, EVP_PKEY *pkey, struct verify_item *items, int start, int end)
+  {
+    EVP_MD_CTX mdctx;
+    EVP_MD_CTX_init(&mdctx);
+    for (int i = start; i < end; i++) {
+      // A signature that did not decode cannot match.
+      if (items[i].sig == NULL) {
+        items[i].r = 0;
+        continue;
+      }
+      EVP_VerifyInit_ex(&mdctx, md, NULL);
+      EVP_VerifyUpdate(&mdctx, items[i].data, items[i].data_len);
+      items[i].r = EVP_VerifyFinal(&mdctx, items[i].sig, items[i].sig_len, pkey);
+      if (items[i].r != 1) {
+        ERR_clear_error();
+      }
+    }
+    EVP_MD_CTX_cleanup(&mdctx);
+  }
+
+  static void
+  FreeVerifyMany(struct verify_many_request *req)
+  {
+    for (int i = 0; i < req->count; i++) {
+      free(req->items[i].data);
+      if (req->items[i].sig) free(req->items[i].sig);
+    }
+    free(req->items);
+    EVP_PKEY_free(req->pkey);
+    free(req);
+  }
+
+  static Local<Array>
+  VerifyManyResults(struct verify_many_request *req)
+  {
+    HandleScope scope;
+
+    Local<Array> results = Array::New(req->count);
+    for (int i = 0; i < req->count; i++) {
+      results->Set(Integer::New(i), Integer::New(req->items[i].r));
+    }
+    return scope.Close(results);
+  }
+
+  static int
+  EIO_VerifyMany(eio_req *req) {
+    struct verify_many_task *task = (struct verify_many_task *)(req->data);
+
+    VerifyItems(task->req->md, task->req->pkey, task->req->items, task->start, task->end);
+    return 0;
+  }
+
+  static int
+  EIO_AfterVerifyMany(eio_req *req) {
+    HandleScope scope;
+
+    ev_unref(EV_DEFAULT_UC);
+    struct verify_many_task *task = (struct verify_many_task *)(req->data);
+    struct verify_many_request *vm_req = task->req;
+    free(task);
+
+    // After callbacks all run on the event loop, so no locking needed.
+    if (--vm_req->pending > 0)
+      return 0;
+
+    Local<Value> argv[2];
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = VerifyManyResults(vm_req);
+
+    TryCatch try_catch;
+
+    vm_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    vm_req->cb.Dispose();
+    FreeVerifyMany(vm_req);
+
+    return 0;
+  }
+
+  // verifyMany(algorithm, cert, [[data, signature], ...], [encoding], [callback])
+  // Verifies every pair against one key in a single call and returns an
+  // array of verify() results. cert is a PEM certificate string, a
+  // Certificate or a PublicKey; encoding applies to the signatures.
+  // With a callback the batch is spread over the thread pool and the
+  // results are delivered as callback(err, results).
+  static Handle<Value>
+  VerifyMany(const Arguments& args) {
+    HandleScope scope;
+
+    Local<Function> cb;
+    int argc = args.Length();
+    if (argc > 3 && args[argc-1]->IsFunction()) {
+      cb = Local<Function>::Cast(args[argc-1]);
+      argc--;
+    }
+
+    if (argc < 3 || !IsAlgorithm(args[0]) || !args[2]->IsArray()) {
+      return ThrowException(String::New("Must give algorithm, cert and array of [data, signature] as argument"));
+    }
+
+    const EVP_MD *md = ResolveDigest(args[0]);
+    if (!md) {
+      return ThrowException(Exception::Error(String::New("Unknown message digest")));
+    }
+
+    EVP_PKEY *pkey;
+    if (Certificate::HasInstance(args[1])) {
+      pkey = (EVP_PKEY *) pkey_ref(ObjectWrap::Unwrap<Certificate>(args[1]->ToObject())->pkey);
+    } else if (PublicKey::HasInstance(args[1])) {
+      pkey = (EVP_PKEY *) pkey_ref(ObjectWrap::Unwrap<PublicKey>(args[1]->ToObject())->pkey);
+    } else {
+      ArgBytes kbuf(args[1], BINARY);
+      if (kbuf.len < 0) {
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+      pkey = LoadCertificateKey(kbuf.data, kbuf.len);
+      if (pkey == NULL) {
+        ERR_clear_error();
+        return ThrowException(Exception::Error(String::New("PEM_read_bio_X509 failed")));
+      }
+    }
+
+    int sig_encoding = 0; // 0 binary, 1 hex, 2 base64
+    if (argc > 3 && args[3]->IsString()) {
+      String::Utf8Value encoding(args[3]->ToString());
+      if (strcasecmp(*encoding, "hex") == 0) {
+        sig_encoding = 1;
+      } else if (strcasecmp(*encoding, "base64") == 0) {
+        sig_encoding = 2;
+      } else if (strcasecmp(*encoding, "binary") != 0) {
+        EVP_PKEY_free(pkey);
+        return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
+      }
+    }
+
+    Local<Array> items = Local<Array>::Cast(args[2]);
+
+    struct verify_many_request *vm_req =
+      (struct verify_many_request *)calloc(1, sizeof(struct verify_many_request));
+    vm_req->md = md;
+    vm_req->pkey = pkey;
+    vm_req->count = items->Length();
+    vm_req->items = (struct verify_item *)calloc(vm_req->count + 1, sizeof(struct verify_item));
+
+    for (int i = 0; i < vm_req->count; i++) {
+      struct verify_item *item = &vm_req->items[i];
+      Local<Value> pair = items->Get(Integer::New(i));
+      Local<Value> data, sig;
+      if (pair->IsArray()) {
+        data = pair->ToObject()->Get(Integer::New(0));
+        sig = pair->ToObject()->Get(Integer::New(1));
+      }
+      if (data.IsEmpty() || sig.IsEmpty()) {
+        FreeVerifyMany(vm_req);
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+      ArgBytes dbuf(data, BINARY);
+      ArgBytes sbuf(sig, BINARY);
+      if (dbuf.len < 0 || sbuf.len < 0) {
+        FreeVerifyMany(vm_req);
+        Local<Value> exception = Exception::TypeError(String::New("Bad argument"));
+        return ThrowException(exception);
+      }
+
+      item->data = (char *)malloc(dbuf.len + 1);
+      item->data_len = dbuf.len;
+      memcpy(item->data, dbuf.data, dbuf.len);
+
+      if (sig_encoding == 1) {
+        hex_decode((unsigned char *)sbuf.data, sbuf.len, (char **)&item->sig, &item->sig_len);
+      } else if (sig_encoding == 2) {
+        unbase64((unsigned char *)sbuf.data, sbuf.len, (char **)&item->sig, &item->sig_len, base64_flags);
+      } else {
+        item->sig = (unsigned char *)malloc(sbuf.len + 1);
+        item->sig_len = sbuf.len;
+        memcpy(item->sig, sbuf.data, sbuf.len);
+      }
+    }
+
+    if (cb.IsEmpty()) {
+      VerifyItems(vm_req->md, vm_req->pkey, vm_req->items, 0, vm_req->count);
+      Local<Array> results = VerifyManyResults(vm_req);
+      FreeVerifyMany(vm_req);
+      return scope.Close(results);
+    }
+
+    int ntasks = vm_req->count / VERIFY_MANY_MIN_ITEMS;
+    if (ntasks > VERIFY_MANY_MAX_TASKS) ntasks = VERIFY_MANY_MAX_TASKS;
+    if (ntasks < 1) ntasks = 1;
+
+    vm_req->cb = Persistent<Function>::New(cb);
+    vm_req->pending = ntasks;
+
+    int per_task = vm_req->count / ntasks;
+    for (int i = 0; i < ntasks; i++) {
+      struct verify_many_task *task = (struct verify_many_task *)malloc(sizeof(struct verify_many_task));
+      task->req = vm_req;
+      task->start = i * per_task;
+      task->end = (i == ntasks - 1) ? vm_req->count : (i + 1) * per_task;
+
+      eio_custom(EIO_VerifyMany, EIO_PRI_DEFAULT, EIO_AfterVerifyMany, task);
+      ev_ref(EV_DEFAULT_UC);
+    }
+
+    return Undefined();
+  }
+
+  Verify () : CryptoStream () 
+  {
+    mdctx = NULL;
+    md = NULL;
+    initialised = false;
+  }
+
+  ~Verify ()
+  {
+    ReleaseContext();
+  }
+
+ private:
+
+  EVP_MD_CTX *mdctx;          // from md_ctx_pool until ReleaseContext()
+  const EVP_MD *md;
+  bool initialised;
+
+};
+
+
+
+// Sign and Verify run OpenSSL on the eio thread pool, so OpenSSL
+// needs locking and thread id callbacks.
+static pthread_mutex_t *crypto_locks;
+
+static void
+crypto_lock_cb(int mode, int n, const char *file, int line)
+{
+  if (mode & CRYPTO_LOCK) {
+    pthread_mutex_lock(&crypto_locks[n]);
+  } else {
+    pthread_mutex_unlock(&crypto_locks[n]);
+  }
+}
+
+static unsigned long
+crypto_id_cb(void)
+{
+  return (unsigned long) pthread_self();
+}
+
+static void
+InitCryptoLocks()
+{
+  if (CRYPTO_get_locking_callback() != NULL) {
+    // Someone else in the process (e.g. node itself) already did this.
+    return;
+  }
+  crypto_locks = (pthread_mutex_t *)malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+  for (int i = 0; i < CRYPTO_num_locks(); i++) {
+    pthread_mutex_init(&crypto_locks[i], NULL);
+  }
+  CRYPTO_set_id_callback(crypto_id_cb);
+  CRYPTO_set_locking_callback(crypto_lock_cb);
+}
+
+
+// digest(alg, data, [enc]): one-shot hash without a Hash object.
+static Handle<Value>
+Digest(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 2 || !IsAlgorithm(args[0])) {
+    return ThrowException(Exception::TypeError(String::New("Must give hashtype string and data as arguments")));
+  }
+
+  const EVP_MD *md = ResolveDigest(args[0]);
+  if (!md) {
+    return ThrowException(Exception::Error(String::New("Unknown message digest")));
+  }
+
+  ArgBytes buf(args[1], BINARY);
+  if (buf.len < 0) {
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+  if (!EVP_Digest(buf.data, buf.len, md_value, &md_len, md, NULL)) {
+    ERR_clear_error();
+    return ThrowException(Exception::Error(String::New("EVP_Digest failed")));
+  }
+
+  Local<Value> outString = EncodeDigest(md_value, md_len, args[2]);
+  if (outString.IsEmpty()) {
+    return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
+  }
+  return scope.Close(outString);
+}
+
+// hmac(alg, key, data, [enc]): one-shot HMAC without an Hmac object.
+static Handle<Value>
+HmacOneShot(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 3 || !IsAlgorithm(args[0])) {
+    return ThrowException(Exception::TypeError(String::New("Must give hashtype string, key and data as arguments")));
+  }
+
+  const EVP_MD *md = ResolveDigest(args[0]);
+  if (!md) {
+    return ThrowException(Exception::Error(String::New("Unknown message digest")));
+  }
+
+  ArgBytes kbuf(args[1], BINARY);
+  ArgBytes dbuf(args[2], BINARY);
+  if (kbuf.len < 0 || dbuf.len < 0) {
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+  if (!HMAC(md, kbuf.data, kbuf.len, (unsigned char *) dbuf.data, dbuf.len, md_value, &md_len)) {
+    ERR_clear_error();
+    return ThrowException(Exception::Error(String::New("HMAC failed")));
+  }
+
+  Local<Value> outString = EncodeDigest(md_value, md_len, args[3]);
+  if (outString.IsEmpty()) {
+    return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
+  }
+  return scope.Close(outString);
+}
+
+
+// File digests. The file is read with pread in large aligned chunks on
+// the thread pool and fed straight to the digest, so its contents never
+// pass through V8.
+#define HASH_FILE_CHUNK (1024 * 1024)
+
+struct hash_file_request {
+  Persistent<Function> cb;
+  Persistent<Value> encoding;
+  char *path;
+  const EVP_MD *md;
+  char *key;                  // HMAC key, NULL for a plain digest
+  int key_len;
+  off_t start;
+  off_t length;               // -1 for up to the end of the file
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  int err;
+  const char *syscall;
+};
+
+static int
+EIO_HashFile(eio_req *req)
+{
+  struct hash_file_request *hf_req = (struct hash_file_request *)(req->data);
+
+  int fd = open(hf_req->path, O_RDONLY);
+  if (fd < 0) {
+    hf_req->err = errno;
+    hf_req->syscall = "open";
+    return 0;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, hf_req->start, hf_req->length < 0 ? 0 : hf_req->length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  void *buf;
+  if (posix_memalign(&buf, 4096, HASH_FILE_CHUNK) != 0) {
+    close(fd);
+    hf_req->err = ENOMEM;
+    hf_req->syscall = "malloc";
+    return 0;
+  }
+
+  EVP_MD_CTX mdctx;
+  HMAC_CTX hctx;
+  if (hf_req->key) {
+    HMAC_CTX_init(&hctx);
+    HMAC_Init_ex(&hctx, hf_req->key, hf_req->key_len, hf_req->md, NULL);
+  } else {
+    EVP_MD_CTX_init(&mdctx);
+    EVP_DigestInit_ex(&mdctx, hf_req->md, NULL);
+  }
+
+  off_t pos = hf_req->start;
+  off_t left = hf_req->length;
+  while (left != 0) {
+    size_t want = HASH_FILE_CHUNK;
+    if (left > 0 && left < (off_t) want) want = left;
+    ssize_t r = pread(fd, buf, want, pos);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      hf_req->err = errno;
+      hf_req->syscall = "read";
+      break;
+    }
+    if (r == 0) {
+      // An explicit length must fit in the file.
+      if (left > 0) {
+        hf_req->err = ERANGE;
+        hf_req->syscall = "read";
+      }
+      break;
+    }
+    if (hf_req->key) {
+      HMAC_Update(&hctx, (unsigned char *) buf, r);
+    } else {
+      EVP_DigestUpdate(&mdctx, buf, r);
+    }
+    pos += r;
+    if (left > 0) left -= r;
+  }
+
+  if (hf_req->key) {
+    if (!hf_req->err) HMAC_Final(&hctx, hf_req->md_value, &hf_req->md_len);
+    HMAC_CTX_cleanup(&hctx);
+  } else {
+    if (!hf_req->err) EVP_DigestFinal_ex(&mdctx, hf_req->md_value, &hf_req->md_len);
+    EVP_MD_CTX_cleanup(&mdctx);
+  }
+
+  free(buf);
+  close(fd);
+  return 0;
+}
+
+static int
+EIO_AfterHashFile(eio_req *req)
+{
+  HandleScope scope;
+
+  ev_unref(EV_DEFAULT_UC);
+  struct hash_file_request *hf_req = (struct hash_file_request *)(req->data);
+
+  Local<Value> argv[2];
+  if (hf_req->err) {
+    argv[0] = ErrnoException(hf_req->err, hf_req->syscall);
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = EncodeDigest(hf_req->md_value, hf_req->md_len, hf_req->encoding);
+  }
+
+  TryCatch try_catch;
+
+  hf_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  hf_req->cb.Dispose();
+  hf_req->encoding.Dispose();
+  free(hf_req->path);
+  if (hf_req->key) free(hf_req->key);
+  free(hf_req);
+
+  return 0;
+}
+
+// Shared by hashFile and hmacFile; key_arg is 0 for hashFile.
+static Handle<Value>
+StartHashFile(const Arguments& args, int key_arg)
+{
+  HandleScope scope;
+
+  int argc = args.Length();
+  int first_opt = key_arg ? key_arg + 1 : 2;
+  if (argc < first_opt + 1 || !args[argc-1]->IsFunction() ||
+      !args[0]->IsString() || !IsAlgorithm(args[1]) || (key_arg && !IsBytes(args[key_arg]))) {
+    return ThrowException(Exception::TypeError(String::New(key_arg ?
+      "Must give path, algorithm, key and callback as argument" :
+      "Must give path, algorithm and callback as argument")));
+  }
+  Local<Function> cb = Local<Function>::Cast(args[argc-1]);
+
+  const EVP_MD *md = ResolveDigest(args[1]);
+  if (!md) {
+    return ThrowException(Exception::Error(String::New("Unknown message digest")));
+  }
+
+  // Optional encoding string and {start, length} range, in that order.
+  Local<Value> encoding = Local<Value>::New(Undefined());
+  off_t start = 0, length = -1;
+  for (int i = first_opt; i < argc - 1; i++) {
+    if (args[i]->IsString()) {
+      encoding = args[i];
+    } else if (args[i]->IsObject()) {
+      Local<Object> range = args[i]->ToObject();
+      Local<Value> start_v = range->Get(String::NewSymbol("start"));
+      Local<Value> length_v = range->Get(String::NewSymbol("length"));
+      if (start_v->IsNumber()) start = start_v->IntegerValue();
+      if (length_v->IsNumber()) length = length_v->IntegerValue();
+      if (start < 0 || (length_v->IsNumber() && length < 0)) {
+        return ThrowException(Exception::RangeError(String::New("Bad range")));
+      }
+    }
+  }
+  if (!IsDigestEncoding(encoding)) {
+    return ThrowException(Exception::Error(String::New("Encoding can be binary, hex or base64")));
+  }
+
+  struct hash_file_request *hf_req =
+    (struct hash_file_request *)calloc(1, sizeof(struct hash_file_request));
+
+  if (key_arg) {
+    ArgBytes kbuf(args[key_arg], BINARY);
+    if (kbuf.len < 0) {
+      free(hf_req);
+      return ThrowException(Exception::TypeError(String::New("Bad argument")));
+    }
+    hf_req->key = (char *)malloc(kbuf.len + 1);
+    hf_req->key_len = kbuf.len;
+    memcpy(hf_req->key, kbuf.data, kbuf.len);
+  }
+
+  String::Utf8Value path(args[0]->ToString());
+  hf_req->path = strdup(*path);
+  hf_req->md = md;
+  hf_req->start = start;
+  hf_req->length = length;
+  hf_req->cb = Persistent<Function>::New(cb);
+  hf_req->encoding = Persistent<Value>::New(encoding);
+
+  eio_custom(EIO_HashFile, EIO_PRI_DEFAULT, EIO_AfterHashFile, hf_req);
+  ev_ref(EV_DEFAULT_UC);
+
+  return Undefined();
+}
+
+// hashFile(path, algorithm, [encoding], [{start, length}], callback)
+static Handle<Value>
+HashFile(const Arguments& args)
+{
+  return StartHashFile(args, 0);
+}
+
+// hmacFile(path, algorithm, key, [encoding], [{start, length}], callback)
+static Handle<Value>
+HmacFile(const Arguments& args)
+{
+  return StartHashFile(args, 2);
+}
+
+
+// File encryption. One thread pool task runs the cipher and the writes
+// while a helper thread reads ahead into the other of two buffers, so
+// reading overlaps with encrypting and writing. The data never reaches
+// V8; progress is reported to the event loop through an ev_async.
+#define FILE_CIPHER_CHUNK (1024 * 1024)
+
+struct file_cipher_request {
+  Persistent<Function> cb;
+  Persistent<Function> progress_cb;
+  char *src;
+  char *dst;
+  EVP_CIPHER_CTX ctx;
+  int in_fd;
+  int out_fd;
+
+  // Read-ahead state, guarded by lock.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *bufs[2];
+  ssize_t lens[2];
+  bool full[2];
+  bool abort;
+  int read_err;
+
+  off_t bytes_read;           // also guarded by lock
+  off_t bytes_written;
+  ev_async progress_watcher;
+
+  int err;
+  const char *syscall;
+  bool cipher_failed;
+};
+
+static void *
+FileCipherReader(void *arg)
+{
+  struct file_cipher_request *fc_req = (struct file_cipher_request *) arg;
+
+  for (int i = 0; ; i ^= 1) {
+    pthread_mutex_lock(&fc_req->lock);
+    while (fc_req->full[i] && !fc_req->abort)
+      pthread_cond_wait(&fc_req->cond, &fc_req->lock);
+    bool abort = fc_req->abort;
+    pthread_mutex_unlock(&fc_req->lock);
+    if (abort) break;
+
+    ssize_t r;
+    do {
+      r = read(fc_req->in_fd, fc_req->bufs[i], FILE_CIPHER_CHUNK);
+    } while (r < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&fc_req->lock);
+    if (r < 0) fc_req->read_err = errno;
+    fc_req->lens[i] = r < 0 ? 0 : r;
+    fc_req->full[i] = true;
+    pthread_cond_broadcast(&fc_req->cond);
+    pthread_mutex_unlock(&fc_req->lock);
+
+    // An empty buffer tells the cipher side that input is done.
+    if (r <= 0) break;
+  }
+  return NULL;
+}
+
+static bool
+WriteAll(int fd, unsigned char *data, int len)
+{
+  while (len > 0) {
+    ssize_t r = write(fd, data, len);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += r;
+    len -= r;
+  }
+  return true;
+}
+
+static int
+EIO_FileCipher(eio_req *req)
+{
+  struct file_cipher_request *fc_req = (struct file_cipher_request *)(req->data);
+
+  fc_req->in_fd = open(fc_req->src, O_RDONLY);
+  if (fc_req->in_fd < 0) {
+    fc_req->err = errno;
+    fc_req->syscall = "open";
+    return 0;
+  }
+  fc_req->out_fd = open(fc_req->dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fc_req->out_fd < 0) {
+    fc_req->err = errno;
+    fc_req->syscall = "open";
+    close(fc_req->in_fd);
+    return 0;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fc_req->in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  void *bufs[3];
+  for (int i = 0; i < 3; i++) {
+    if (posix_memalign(&bufs[i], 4096, FILE_CIPHER_CHUNK + EVP_MAX_BLOCK_LENGTH) != 0) {
+      while (i-- > 0) free(bufs[i]);
+      fc_req->err = ENOMEM;
+      fc_req->syscall = "malloc";
+      close(fc_req->in_fd);
+      close(fc_req->out_fd);
+      return 0;
+    }
+  }
+  fc_req->bufs[0] = (char *) bufs[0];
+  fc_req->bufs[1] = (char *) bufs[1];
+  unsigned char *out = (unsigned char *) bufs[2];
+
+  pthread_t reader;
+  int r = pthread_create(&reader, NULL, FileCipherReader, fc_req);
+  if (r != 0) {
+    fc_req->err = r;
+    fc_req->syscall = "pthread_create";
+    close(fc_req->in_fd);
+    close(fc_req->out_fd);
+    unlink(fc_req->dst);
+    for (int i = 0; i < 3; i++) free(bufs[i]);
+    return 0;
+  }
+
+  for (int i = 0; ; i ^= 1) {
+    pthread_mutex_lock(&fc_req->lock);
+    while (!fc_req->full[i])
+      pthread_cond_wait(&fc_req->cond, &fc_req->lock);
+    ssize_t len = fc_req->lens[i];
+    if (fc_req->read_err) {
+      fc_req->err = fc_req->read_err;
+      fc_req->syscall = "read";
+    }
+    pthread_mutex_unlock(&fc_req->lock);
+    if (fc_req->err) break;
+
+    int out_len = 0;
+    if (len == 0) {
+      if (!EVP_CipherFinal_ex(&fc_req->ctx, out, &out_len)) {
+        fc_req->cipher_failed = true;
+        break;
+      }
+    } else if (!EVP_CipherUpdate(&fc_req->ctx, out, &out_len, (unsigned char *) fc_req->bufs[i], len)) {
+      fc_req->cipher_failed = true;
+      break;
+    }
+
+    if (!WriteAll(fc_req->out_fd, out, out_len)) {
+      fc_req->err = errno;
+      fc_req->syscall = "write";
+      break;
+    }
+
+    pthread_mutex_lock(&fc_req->lock);
+    fc_req->full[i] = false;
+    fc_req->bytes_read += len;
+    fc_req->bytes_written += out_len;
+    pthread_cond_broadcast(&fc_req->cond);
+    pthread_mutex_unlock(&fc_req->lock);
+
+    if (len == 0) break;
+    ev_async_send(EV_DEFAULT_UC, &fc_req->progress_watcher);
+  }
+  // The error queue is per thread, so it has to be cleared here.
+  if (fc_req->cipher_failed) ERR_clear_error();
+
+  pthread_mutex_lock(&fc_req->lock);
+  fc_req->abort = true;
+  pthread_cond_broadcast(&fc_req->cond);
+  pthread_mutex_unlock(&fc_req->lock);
+  pthread_join(reader, NULL);
+
+  if (close(fc_req->out_fd) < 0 && !fc_req->err && !fc_req->cipher_failed) {
+    fc_req->err = errno;
+    fc_req->syscall = "close";
+  }
+  close(fc_req->in_fd);
+  // Do not leave half a file behind.
+  if (fc_req->err || fc_req->cipher_failed) unlink(fc_req->dst);
+
+  for (int i = 0; i < 3; i++) free(bufs[i]);
+  return 0;
+}
+
+static void
+FileCipherProgress(EV_P_ ev_async *watcher, int revents)
+{
+  HandleScope scope;
+
+  struct file_cipher_request *fc_req = (struct file_cipher_request *)(watcher->data);
+  if (fc_req->progress_cb.IsEmpty())
+    return;
+
+  pthread_mutex_lock(&fc_req->lock);
+  off_t bytes_read = fc_req->bytes_read;
+  off_t bytes_written = fc_req->bytes_written;
+  pthread_mutex_unlock(&fc_req->lock);
+
+  Local<Value> argv[2];
+  argv[0] = Number::New((double) bytes_read);
+  argv[1] = Number::New((double) bytes_written);
+
+  TryCatch try_catch;
+
+  fc_req->progress_cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+}
+
+static int
+EIO_AfterFileCipher(eio_req *req)
+{
+  HandleScope scope;
+
+  ev_unref(EV_DEFAULT_UC);
+  struct file_cipher_request *fc_req = (struct file_cipher_request *)(req->data);
+
+  ev_ref(EV_DEFAULT_UC);
+  ev_async_stop(EV_DEFAULT_UC, &fc_req->progress_watcher);
+
+  Local<Value> argv[3];
+  if (fc_req->err) {
+    argv[0] = ErrnoException(fc_req->err, fc_req->syscall);
+  } else if (fc_req->cipher_failed) {
+    argv[0] = Exception::Error(String::New("Cipher failed (bad key or corrupt input)"));
+  } else {
+    argv[0] = Local<Value>::New(Null());
+  }
+  argv[1] = Number::New((double) fc_req->bytes_read);
+  argv[2] = Number::New((double) fc_req->bytes_written);
+
+  TryCatch try_catch;
+
+  fc_req->cb->Call(Context::GetCurrent()->Global(), 3, argv);
+
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  fc_req->cb.Dispose();
+  if (!fc_req->progress_cb.IsEmpty()) fc_req->progress_cb.Dispose();
+  EVP_CIPHER_CTX_cleanup(&fc_req->ctx);
+  pthread_mutex_destroy(&fc_req->lock);
+  pthread_cond_destroy(&fc_req->cond);
+  free(fc_req->src);
+  free(fc_req->dst);
+  free(fc_req);
+
+  return 0;
+}
+
+// Shared by encryptFile and decryptFile. The key and iv are raw bytes,
+// as for initiv.
+static Handle<Value>
+StartFileCipher(const Arguments& args, int encrypt)
+{
+  HandleScope scope;
+
+  int argc = args.Length();
+  if (argc < 6 || !args[argc-1]->IsFunction() || !args[0]->IsString() || !args[1]->IsString() ||
+      !IsAlgorithm(args[2]) || !IsBytes(args[3]) || !IsBytes(args[4])) {
+    return ThrowException(Exception::TypeError(String::New(
+      "Must give source, destination, cipher-type, key, iv and callback as argument")));
+  }
+  Local<Function> cb = Local<Function>::Cast(args[argc-1]);
+  Local<Function> progress_cb;
+  if (argc > 6 && args[5]->IsFunction()) {
+    progress_cb = Local<Function>::Cast(args[5]);
+  }
+
+  const EVP_CIPHER *cipher = ResolveCipher(args[2]);
+  if (!cipher) {
+    return ThrowException(Exception::Error(String::New("Unknown cipher")));
+  }
+  if (IsAead(cipher)) {
+    return ThrowException(Exception::Error(String::New("AEAD ciphers cannot be used on files")));
+  }
+
+  ArgBytes key_buf(args[3], BINARY);
+  ArgBytes iv_buf(args[4], BINARY);
+  if (key_buf.len < 0 || iv_buf.len < 0) {
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+  if (EVP_CIPHER_iv_length(cipher) != iv_buf.len) {
+    return ThrowException(Exception::Error(String::New("Invalid IV length")));
+  }
+
+  struct file_cipher_request *fc_req =
+    (struct file_cipher_request *)calloc(1, sizeof(struct file_cipher_request));
+
+  EVP_CIPHER_CTX_init(&fc_req->ctx);
+  if (!EVP_CipherInit_ex(&fc_req->ctx, cipher, NULL, NULL, NULL, encrypt) ||
+      !EVP_CIPHER_CTX_set_key_length(&fc_req->ctx, key_buf.len) ||
+      !EVP_CipherInit_ex(&fc_req->ctx, NULL, NULL, (unsigned char *) key_buf.data,
+                         (unsigned char *) iv_buf.data, encrypt)) {
+    EVP_CIPHER_CTX_cleanup(&fc_req->ctx);
+    free(fc_req);
+    ERR_clear_error();
+    return ThrowException(Exception::Error(String::New("Invalid key length")));
+  }
+
+  String::Utf8Value src(args[0]->ToString());
+  String::Utf8Value dst(args[1]->ToString());
+  fc_req->src = strdup(*src);
+  fc_req->dst = strdup(*dst);
+  pthread_mutex_init(&fc_req->lock, NULL);
+  pthread_cond_init(&fc_req->cond, NULL);
+  fc_req->cb = Persistent<Function>::New(cb);
+  if (!progress_cb.IsEmpty()) {
+    fc_req->progress_cb = Persistent<Function>::New(progress_cb);
+  }
+
+  // The watcher must not keep the loop alive by itself; the eio request
+  // already does.
+  ev_async_init(&fc_req->progress_watcher, FileCipherProgress);
+  fc_req->progress_watcher.data = fc_req;
+  ev_async_start(EV_DEFAULT_UC, &fc_req->progress_watcher);
+  ev_unref(EV_DEFAULT_UC);
+
+  eio_custom(EIO_FileCipher, EIO_PRI_DEFAULT, EIO_AfterFileCipher, fc_req);
+  ev_ref(EV_DEFAULT_UC);
+
+  return Undefined();
+}
+
+// encryptFile(src, dst, cipher-type, key, iv, [progress], callback)
+// progress(bytesRead, bytesWritten) is called as the work goes on and
+// callback(err, bytesRead, bytesWritten) at the end.
+static Handle<Value>
+EncryptFile(const Arguments& args)
+{
+  return StartFileCipher(args, 1);
+}
+
+// decryptFile(src, dst, cipher-type, key, iv, [progress], callback)
+static Handle<Value>
+DecryptFile(const Arguments& args)
+{
+  return StartFileCipher(args, 0);
+}
+
+// Parallel CTR mode. Each counter block is independent, so the input is
+// cut into block aligned segments and every segment is run on its own
+// thread with the counter advanced to where it starts. The result is
+// byte for byte what a single update() would produce. GCM is not split:
+// its GHASH runs over the whole message in order.
+#define PARALLEL_MAX_THREADS 16
+#define PARALLEL_MIN_SEGMENT (64 * 1024)
+
+struct parallel_request {
+  Persistent<Function> cb;
+  Persistent<Object> in_obj;  // keeps a Buffer input alive
+  Persistent<Object> out_obj;
+  const EVP_CIPHER *cipher;
+  unsigned char key[EVP_MAX_KEY_LENGTH];
+  int key_len;
+  unsigned char iv[EVP_MAX_IV_LENGTH];
+  int enc;
+  char *in;
+  char *in_copy;              // string input, copied
+  char *out;
+  size_t len;
+  int nthreads;
+  bool failed;
+};
+
+struct parallel_segment {
+  struct parallel_request *req;
+  size_t start;
+  size_t len;
+  bool failed;
+};
+
+// Adds blocks to the big endian counter in iv, as the CTR mode
+// increment does.
+static void
+CounterAdd(unsigned char *iv, int iv_len, uint64_t blocks)
+{
+  for (int i = iv_len - 1; i >= 0 && blocks; i--) {
+    blocks += iv[i];
+    iv[i] = (unsigned char) blocks;
+    blocks >>= 8;
+  }
+}
+
+static void *
+ParallelSegment(void *arg)
+{
+  struct parallel_segment *seg = (struct parallel_segment *) arg;
+  struct parallel_request *req = seg->req;
+  int iv_len = EVP_CIPHER_iv_length(req->cipher);
+
+  unsigned char iv[EVP_MAX_IV_LENGTH];
+  memcpy(iv, req->iv, iv_len);
+  CounterAdd(iv, iv_len, seg->start / iv_len);
+
+  EVP_CIPHER_CTX ctx;
+  EVP_CIPHER_CTX_init(&ctx);
+  int out_len;
+  seg->failed = !EVP_CipherInit_ex(&ctx, req->cipher, NULL, NULL, NULL, req->enc) ||
+                !EVP_CIPHER_CTX_set_key_length(&ctx, req->key_len) ||
+                !EVP_CipherInit_ex(&ctx, NULL, NULL, req->key, iv, req->enc) ||
+                !EVP_CipherUpdate(&ctx, (unsigned char *) req->out + seg->start, &out_len,
+                                  (unsigned char *) req->in + seg->start, seg->len);
+  EVP_CIPHER_CTX_cleanup(&ctx);
+  return NULL;
+}
+
+static void
+ParallelCrypt(struct parallel_request *req)
+{
+  int iv_len = EVP_CIPHER_iv_length(req->cipher);
+  size_t blocks = (req->len + iv_len - 1) / iv_len;
+  int n = req->nthreads;
+  if ((size_t) n > req->len / PARALLEL_MIN_SEGMENT) n = req->len / PARALLEL_MIN_SEGMENT;
+  if (n < 1) n = 1;
+
+  struct parallel_segment segs[PARALLEL_MAX_THREADS];
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  size_t start = 0;
+  for (int i = 0; i < n; i++) {
+    size_t end = i == n - 1 ? req->len : (blocks * (i + 1) / n) * iv_len;
+    segs[i].req = req;
+    segs[i].start = start;
+    segs[i].len = end - start;
+    segs[i].failed = false;
+    start = end;
+  }
+
+  // This thread takes the first segment itself.
+  int started = 1;
+  for (int i = 1; i < n; i++, started++) {
+    if (pthread_create(&threads[i], NULL, ParallelSegment, &segs[i]) != 0)
+      break;
+  }
+  for (int i = started; i < n; i++) {
+    ParallelSegment(&segs[i]);
+  }
+  ParallelSegment(&segs[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  req->failed = false;
+  for (int i = 0; i < n; i++) {
+    if (segs[i].failed) req->failed = true;
+  }
+  if (req->failed) ERR_clear_error();
+}
+
+static void
+FreeParallel(struct parallel_request *req)
+{
+  if (!req->in_obj.IsEmpty()) req->in_obj.Dispose();
+  req->out_obj.Dispose();
+  if (req->in_copy) free(req->in_copy);
+  memset(req->key, 0, sizeof(req->key));
+  free(req);
+}
+
+static int
+EIO_Parallel(eio_req *req)
+{
+  ParallelCrypt((struct parallel_request *)(req->data));
+  return 0;
+}
+
+static int
+EIO_AfterParallel(eio_req *req)
+{
+  HandleScope scope;
+
+  ev_unref(EV_DEFAULT_UC);
+  struct parallel_request *p_req = (struct parallel_request *)(req->data);
+
+  Local<Value> argv[2];
+  if (p_req->failed) {
+    argv[0] = Exception::Error(String::New("Cipher failed"));
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(p_req->out_obj);
+  }
+
+  TryCatch try_catch;
+
+  p_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  p_req->cb.Dispose();
+  FreeParallel(p_req);
+
+  return 0;
+}
+
+// Shared by encryptParallel and decryptParallel.
+static Handle<Value>
+StartParallel(const Arguments& args, int enc)
+{
+  HandleScope scope;
+
+  Local<Function> cb;
+  int argc = args.Length();
+  if (argc > 4 && args[argc-1]->IsFunction()) {
+    cb = Local<Function>::Cast(args[argc-1]);
+    argc--;
+  }
+
+  if (argc < 4 || !IsAlgorithm(args[0]) || !IsBytes(args[1]) || !IsBytes(args[2]) || !IsBytes(args[3])) {
+    return ThrowException(Exception::TypeError(String::New(
+      "Must give cipher-type, key, iv and data as argument")));
+  }
+
+  const EVP_CIPHER *cipher = ResolveCipher(args[0]);
+  if (!cipher) {
+    return ThrowException(Exception::Error(String::New("Unknown cipher")));
+  }
+  if (EVP_CIPHER_mode(cipher) != EVP_CIPH_CTR_MODE) {
+    return ThrowException(Exception::Error(String::New("Only CTR mode ciphers can run in parallel")));
+  }
+
+  ArgBytes key_buf(args[1], BINARY);
+  ArgBytes iv_buf(args[2], BINARY);
+  if (key_buf.len < 0 || iv_buf.len < 0) {
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+  if (key_buf.len > EVP_MAX_KEY_LENGTH) {
+    return ThrowException(Exception::Error(String::New("Invalid key length")));
+  }
+  if (EVP_CIPHER_iv_length(cipher) != iv_buf.len) {
+    return ThrowException(Exception::Error(String::New("Invalid IV length")));
+  }
+
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 4 && args[4]->IsNumber()) nthreads = args[4]->Int32Value();
+  if (nthreads > PARALLEL_MAX_THREADS) nthreads = PARALLEL_MAX_THREADS;
+  if (nthreads < 1) nthreads = 1;
+
+  struct parallel_request *p_req =
+    (struct parallel_request *)calloc(1, sizeof(struct parallel_request));
+  p_req->cipher = cipher;
+  p_req->enc = enc;
+  p_req->key_len = key_buf.len;
+  memcpy(p_req->key, key_buf.data, key_buf.len);
+  memcpy(p_req->iv, iv_buf.data, iv_buf.len);
+  p_req->nthreads = nthreads;
+
+  if (Buffer::HasInstance(args[3])) {
+    Local<Object> in_obj = args[3]->ToObject();
+    p_req->in = Buffer::Data(in_obj);
+    p_req->len = Buffer::Length(in_obj);
+    if (!cb.IsEmpty()) p_req->in_obj = Persistent<Object>::New(in_obj);
+  } else {
+    ArgBytes in_buf(args[3], BINARY);
+    if (in_buf.len < 0) {
+      FreeParallel(p_req);
+      return ThrowException(Exception::TypeError(String::New("Bad argument")));
+    }
+    p_req->in = p_req->in_copy = (char *)malloc(in_buf.len + 1);
+    p_req->len = in_buf.len;
+    memcpy(p_req->in_copy, in_buf.data, in_buf.len);
+  }
+
+  Buffer *out = Buffer::New(p_req->len);
+  p_req->out_obj = Persistent<Object>::New(out->handle_);
+  p_req->out = Buffer::Data(p_req->out_obj);
+
+  if (cb.IsEmpty()) {
+    ParallelCrypt(p_req);
+    bool failed = p_req->failed;
+    Local<Object> result = Local<Object>::New(p_req->out_obj);
+    FreeParallel(p_req);
+    if (failed) {
+      return ThrowException(Exception::Error(String::New("Cipher failed")));
+    }
+    return scope.Close(result);
+  }
+
+  p_req->cb = Persistent<Function>::New(cb);
+  eio_custom(EIO_Parallel, EIO_PRI_DEFAULT, EIO_AfterParallel, p_req);
+  ev_ref(EV_DEFAULT_UC);
+
+  return Undefined();
+}
+
+// encryptParallel(cipher-type, key, iv, data, [threads], [callback])
+// CTR mode encryption spread over threads; returns a Buffer, or passes
+// it to callback(err, buffer).
+static Handle<Value>
+EncryptParallel(const Arguments& args)
+{
+  return StartParallel(args, 1);
+}
+
+// decryptParallel(cipher-type, key, iv, data, [threads], [callback])
+static Handle<Value>
+DecryptParallel(const Arguments& args)
+{
+  return StartParallel(args, 0);
+}
+
+// Key derivation: pbkdf2, scrypt and hkdf. The inputs are copied so the
+// work can run on the thread pool; the result is a Buffer.
+#define KDF_PBKDF2 0
+#define KDF_SCRYPT 1
+#define KDF_HKDF 2
+
+#define SCRYPT_DEFAULT_N 16384
+#define SCRYPT_DEFAULT_R 8
+#define SCRYPT_DEFAULT_P 1
+#define SCRYPT_DEFAULT_MAXMEM (32 << 20)
+
+struct kdf_request {
+  int kind;
+  const EVP_MD *md;
+  char *pass;
+  int pass_len;
+  char *salt;
+  int salt_len;
+  char *info;
+  int info_len;
+  int iterations;
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+  uint64_t maxmem;
+  Persistent<Object> out_obj;
+  char *out;
+  int out_len;
+  bool failed;
+  Persistent<Function> cb;
+};
+
+// Copies a string or Buffer argument; returns NULL if it does not decode.
+static char *
+KdfCopyArg(Handle<Value> val, int *len)
+{
+  ArgBytes buf(val, BINARY);
+  if (buf.len < 0) return NULL;
+  char *copy = (char *)malloc(buf.len + 1);
+  memcpy(copy, buf.data, buf.len);
+  *len = buf.len;
+  return copy;
+}
+
+static void
+RunKdf(struct kdf_request *req)
+{
+  unsigned char *out = (unsigned char *)req->out;
+  int r = 0;
+
+  switch (req->kind) {
+    case KDF_PBKDF2:
+      r = PKCS5_PBKDF2_HMAC(req->pass, req->pass_len,
+                            (unsigned char *)req->salt, req->salt_len,
+                            req->iterations, req->md, req->out_len, out) ? 0 : -1;
+      break;
+    case KDF_SCRYPT:
+      r = kdf_scrypt((unsigned char *)req->pass, req->pass_len,
+                     (unsigned char *)req->salt, req->salt_len,
+                     req->N, req->r, req->p, req->maxmem, out, req->out_len);
+      break;
+    case KDF_HKDF:
+      r = kdf_hkdf(req->md, (unsigned char *)req->salt, req->salt_len,
+                   (unsigned char *)req->pass, req->pass_len,
+                   (unsigned char *)req->info, req->info_len, out, req->out_len);
+      break;
+  }
+
+  req->failed = r != 0;
+  if (req->failed) ERR_clear_error();
+}
+
+static void
+FreeKdf(struct kdf_request *req)
+{
+  if (req->pass) {
+    OPENSSL_cleanse(req->pass, req->pass_len);
+    free(req->pass);
+  }
+  if (req->salt) free(req->salt);
+  if (req->info) free(req->info);
+  req->out_obj.Dispose();
+  free(req);
+}
+
+static int
+EIO_Kdf(eio_req *req)
+{
+  RunKdf((struct kdf_request *)(req->data));
+  return 0;
+}
+
+static int
+EIO_AfterKdf(eio_req *req)
+{
+  HandleScope scope;
+
+  ev_unref(EV_DEFAULT_UC);
+  struct kdf_request *k_req = (struct kdf_request *)(req->data);
+
+  Local<Value> argv[2];
+  if (k_req->failed) {
+    argv[0] = Exception::Error(String::New("Key derivation failed"));
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(k_req->out_obj);
+  }
+
+  TryCatch try_catch;
+
+  k_req->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  k_req->cb.Dispose();
+  FreeKdf(k_req);
+
+  return 0;
+}
+
+// Allocates the output Buffer, then derives the key now or on the thread
+// pool when there is a callback. Takes ownership of k_req.
+static Handle<Value>
+StartKdf(struct kdf_request *k_req, int keylen, Local<Function> cb)
+{
+  HandleScope scope;
+
+  Buffer *out = Buffer::New(keylen);
+  k_req->out_obj = Persistent<Object>::New(out->handle_);
+  k_req->out = Buffer::Data(k_req->out_obj);
+  k_req->out_len = keylen;
+
+  if (cb.IsEmpty()) {
+    RunKdf(k_req);
+    bool failed = k_req->failed;
+    Local<Object> result = Local<Object>::New(k_req->out_obj);
+    FreeKdf(k_req);
+    if (failed) {
+      return ThrowException(Exception::Error(String::New("Key derivation failed")));
+    }
+    return scope.Close(result);
+  }
+
+  k_req->cb = Persistent<Function>::New(cb);
+  eio_custom(EIO_Kdf, EIO_PRI_DEFAULT, EIO_AfterKdf, k_req);
+  ev_ref(EV_DEFAULT_UC);
+
+  return Undefined();
+}
+
+// pbkdf2(password, salt, iterations, keylen, [digest], [callback])
+// PBKDF2 with HMAC over digest, sha1 by default. Returns a Buffer, or
+// passes it to callback(err, buffer).
+static Handle<Value>
+Pbkdf2(const Arguments& args)
+{
+  HandleScope scope;
+
+  Local<Function> cb;
+  int argc = args.Length();
+  if (argc > 4 && args[argc-1]->IsFunction()) {
+    cb = Local<Function>::Cast(args[argc-1]);
+    argc--;
+  }
+
+  if (argc < 4 || !IsBytes(args[0]) || !IsBytes(args[1]) ||
+      !args[2]->IsNumber() || !args[3]->IsNumber()) {
+    return ThrowException(Exception::TypeError(String::New(
+      "Must give password, salt, iterations and keylen as argument")));
+  }
+  if (args[2]->Int32Value() < 1 || args[3]->Int32Value() < 0) {
+    return ThrowException(Exception::Error(String::New("Bad iterations or keylen")));
+  }
+
+  const EVP_MD *md = EVP_sha1();
+  if (argc > 4 && IsAlgorithm(args[4])) {
+    md = ResolveDigest(args[4]);
+    if (!md) {
+      return ThrowException(Exception::Error(String::New("Unknown digest")));
+    }
+  }
+
+  struct kdf_request *k_req = (struct kdf_request *)calloc(1, sizeof(struct kdf_request));
+  k_req->kind = KDF_PBKDF2;
+  k_req->md = md;
+  k_req->iterations = args[2]->Int32Value();
+  k_req->pass = KdfCopyArg(args[0], &k_req->pass_len);
+  k_req->salt = KdfCopyArg(args[1], &k_req->salt_len);
+  if (!k_req->pass || !k_req->salt) {
+    FreeKdf(k_req);
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+
+  return scope.Close(StartKdf(k_req, args[3]->Int32Value(), cb));
+}
+
+// scrypt(password, salt, keylen, [options], [callback])
+// options may set the cost parameters N, r and p, and maxmem, the most
+// memory in bytes the derivation may use.
+static Handle<Value>
+Scrypt(const Arguments& args)
+{
+  HandleScope scope;
+
+  Local<Function> cb;
+  int argc = args.Length();
+  if (argc > 3 && args[argc-1]->IsFunction()) {
+    cb = Local<Function>::Cast(args[argc-1]);
+    argc--;
+  }
+
+  if (argc < 3 || !IsBytes(args[0]) || !IsBytes(args[1]) || !args[2]->IsNumber()) {
+    return ThrowException(Exception::TypeError(String::New(
+      "Must give password, salt and keylen as argument")));
+  }
+  if (args[2]->Int32Value() < 0) {
+    return ThrowException(Exception::Error(String::New("Bad keylen")));
+  }
+
+  uint64_t N = SCRYPT_DEFAULT_N, maxmem = SCRYPT_DEFAULT_MAXMEM;
+  uint32_t r = SCRYPT_DEFAULT_R, p = SCRYPT_DEFAULT_P;
+  if (argc > 3 && args[3]->IsObject()) {
+    Local<Object> options = args[3]->ToObject();
+    Local<Value> v;
+    v = options->Get(String::NewSymbol("N"));
+    if (v->IsNumber()) N = v->IntegerValue();
+    v = options->Get(String::NewSymbol("r"));
+    if (v->IsNumber()) r = v->Uint32Value();
+    v = options->Get(String::NewSymbol("p"));
+    if (v->IsNumber()) p = v->Uint32Value();
+    v = options->Get(String::NewSymbol("maxmem"));
+    if (v->IsNumber()) maxmem = v->IntegerValue();
+  }
+  if (kdf_scrypt_check(N, r, p, maxmem) != 0) {
+    return ThrowException(Exception::Error(String::New("Invalid scrypt parameters")));
+  }
+
+  struct kdf_request *k_req = (struct kdf_request *)calloc(1, sizeof(struct kdf_request));
+  k_req->kind = KDF_SCRYPT;
+  k_req->N = N;
+  k_req->r = r;
+  k_req->p = p;
+  k_req->maxmem = maxmem;
+  k_req->pass = KdfCopyArg(args[0], &k_req->pass_len);
+  k_req->salt = KdfCopyArg(args[1], &k_req->salt_len);
+  if (!k_req->pass || !k_req->salt) {
+    FreeKdf(k_req);
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+
+  return scope.Close(StartKdf(k_req, args[2]->Int32Value(), cb));
+}
+
+// hkdf(digest, key, salt, info, keylen, [callback])
+// HKDF extract and expand; keylen can be at most 255 digest lengths.
+static Handle<Value>
+Hkdf(const Arguments& args)
+{
+  HandleScope scope;
+
+  Local<Function> cb;
+  int argc = args.Length();
+  if (argc > 5 && args[argc-1]->IsFunction()) {
+    cb = Local<Function>::Cast(args[argc-1]);
+    argc--;
+  }
+
+  if (argc < 5 || !IsAlgorithm(args[0]) || !IsBytes(args[1]) || !IsBytes(args[2]) ||
+      !IsBytes(args[3]) || !args[4]->IsNumber()) {
+    return ThrowException(Exception::TypeError(String::New(
+      "Must give digest, key, salt, info and keylen as argument")));
+  }
+
+  const EVP_MD *md = ResolveDigest(args[0]);
+  if (!md) {
+    return ThrowException(Exception::Error(String::New("Unknown digest")));
+  }
+  int keylen = args[4]->Int32Value();
+  if (keylen < 0 || keylen > 255 * EVP_MD_size(md)) {
+    return ThrowException(Exception::Error(String::New("Bad keylen")));
+  }
+
+  struct kdf_request *k_req = (struct kdf_request *)calloc(1, sizeof(struct kdf_request));
+  k_req->kind = KDF_HKDF;
+  k_req->md = md;
+  k_req->pass = KdfCopyArg(args[1], &k_req->pass_len);
+  k_req->salt = KdfCopyArg(args[2], &k_req->salt_len);
+  k_req->info = KdfCopyArg(args[3], &k_req->info_len);
+  if (!k_req->pass || !k_req->salt || !k_req->info) {
+    FreeKdf(k_req);
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+
+  return scope.Close(StartKdf(k_req, keylen, cb));
+}
+
+static Handle<Value>
+SetCacheSize(LruCache* cache, const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() == 0 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+    return ThrowException(Exception::TypeError(String::New("Must give cache size as argument")));
+  }
+
+  cache->SetCapacity(args[0]->Uint32Value());
+  return Undefined();
+}
+
+static Handle<Value>
+CacheStats(LruCache* cache)
+{
+  HandleScope scope;
+
+  unsigned int capacity, size;
+  uint64_t hits, misses, evictions;
+  cache->Stats(&capacity, &size, &hits, &misses, &evictions);
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("capacity"), Integer::NewFromUnsigned(capacity));
+  stats->Set(String::NewSymbol("size"), Integer::NewFromUnsigned(size));
+  stats->Set(String::NewSymbol("hits"), Number::New((double) hits));
+  stats->Set(String::NewSymbol("misses"), Number::New((double) misses));
+  stats->Set(String::NewSymbol("evictions"), Number::New((double) evictions));
+  return scope.Close(stats);
+}
+
+// setKeyCacheSize(n): number of parsed PEM keys kept; 0 disables the cache.
+static Handle<Value>
+SetKeyCacheSize(const Arguments& args)
+{
+  return SetCacheSize(key_cache, args);
+}
+
+static Handle<Value>
+GetKeyCacheStats(const Arguments& args)
+{
+  return CacheStats(key_cache);
+}
+
+static Handle<Value>
+FlushKeyCache(const Arguments& args)
+{
+  HandleScope scope;
+
+  key_cache->Flush();
+  return Undefined();
+}
+
+// setCipherKeyCacheSize(n): number of passphrase derived cipher contexts
+// kept for Cipher.init/Decipher.init; 0 disables the cache.
+static Handle<Value>
+SetCipherKeyCacheSize(const Arguments& args)
+{
+  return SetCacheSize(cipher_key_cache, args);
+}
+
+static Handle<Value>
+GetCipherKeyCacheStats(const Arguments& args)
+{
+  return CacheStats(cipher_key_cache);
+}
+
+static Handle<Value>
+FlushCipherKeyCache(const Arguments& args)
+{
+  HandleScope scope;
+
+  cipher_key_cache->Flush();
+  return Undefined();
+}
+
+// setBase64Strict(bool): when on, base64 input must be canonical, padded
+// and free of whitespace.
+static Handle<Value>
+SetBase64Strict(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() > 0 && args[0]->BooleanValue()) {
+    base64_flags |= BASE64_STRICT;
+  } else {
+    base64_flags &= ~BASE64_STRICT;
+  }
+  return Undefined();
+}
+
+// setContextPoolSize(n): how many spare contexts of each type are kept.
+// 0 frees them all and stops pooling.
+static Handle<Value>
+SetContextPoolSize(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() == 0 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0 ||
+      args[0]->IntegerValue() > INT_MAX) {
+    return ThrowException(Exception::TypeError(String::New("Must give pool size as argument")));
+  }
+
+  int n = args[0]->Int32Value();
+  md_ctx_pool->SetCapacity(n);
+  cipher_ctx_pool->SetCapacity(n);
+  hmac_ctx_pool->SetCapacity(n);
+  return Undefined();
+}
+
+// getContextPoolStats(): the number of spare contexts of each type.
+static Handle<Value>
+GetContextPoolStats(const Arguments& args)
+{
+  HandleScope scope;
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("digest"), Integer::New(md_ctx_pool->Count()));
+  stats->Set(String::NewSymbol("cipher"), Integer::New(cipher_ctx_pool->Count()));
+  stats->Set(String::NewSymbol("hmac"), Integer::New(hmac_ctx_pool->Count()));
+  return scope.Close(stats);
+}
+
+// setAsyncThreshold(bytes): update() calls with a callback and less data
+// than this run inline when nothing is pending. 0 sends everything to
+// the thread pool.
+static Handle<Value>
+SetAsyncThreshold(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() == 0 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+    return ThrowException(Exception::TypeError(String::New("Must give threshold as argument")));
+  }
+  stream_inline_threshold = args[0]->Int32Value();
+  return Undefined();
+}
+
+
 extern "C" void
 init (Handle<Object> target) 
 {
   HandleScope scope;
 
+  InitCryptoLocks();
+  codec_init();
   ERR_load_crypto_strings();
   OpenSSL_add_all_digests();
   OpenSSL_add_all_algorithms();
@@ -1616,7 +6328,42 @@ init (Handle<Object> target)
   Cipher::Initialize(target);
   Decipher::Initialize(target);
   Hmac::Initialize(target);
+  HmacKey::Initialize(target);
   Hash::Initialize(target);
   Sign::Initialize(target);
   Verify::Initialize(target);
+  PrivateKey::Initialize(target);
+  PublicKey::Initialize(target);
+  Certificate::Initialize(target);
+  InitAlgorithms(target);
+
+  key_cache = new LruCache(KEY_CACHE_DEFAULT_CAPACITY, pkey_ref, pkey_unref);
+  NODE_SET_METHOD(target, "setKeyCacheSize", SetKeyCacheSize);
+  NODE_SET_METHOD(target, "getKeyCacheStats", GetKeyCacheStats);
+  NODE_SET_METHOD(target, "flushKeyCache", FlushKeyCache);
+  cipher_key_cache = new LruCache(CIPHER_KEY_CACHE_DEFAULT_CAPACITY, cipher_key_ref, cipher_key_unref);
+  NODE_SET_METHOD(target, "setCipherKeyCacheSize", SetCipherKeyCacheSize);
+  NODE_SET_METHOD(target, "getCipherKeyCacheStats", GetCipherKeyCacheStats);
+  NODE_SET_METHOD(target, "flushCipherKeyCache", FlushCipherKeyCache);
+  md_ctx_pool = new ContextPool(sizeof(EVP_MD_CTX), md_ctx_init, md_ctx_scrub,
+                                md_ctx_destroy, CONTEXT_POOL_DEFAULT_CAPACITY);
+  cipher_ctx_pool = new ContextPool(sizeof(EVP_CIPHER_CTX), cipher_ctx_init, cipher_ctx_scrub,
+                                    cipher_ctx_scrub, CONTEXT_POOL_DEFAULT_CAPACITY);
+  hmac_ctx_pool = new ContextPool(sizeof(HMAC_CTX), hmac_ctx_init, hmac_ctx_scrub,
+                                  hmac_ctx_destroy, CONTEXT_POOL_DEFAULT_CAPACITY);
+  NODE_SET_METHOD(target, "setContextPoolSize", SetContextPoolSize);
+  NODE_SET_METHOD(target, "getContextPoolStats", GetContextPoolStats);
+  NODE_SET_METHOD(target, "setBase64Strict", SetBase64Strict);
+  NODE_SET_METHOD(target, "setAsyncThreshold", SetAsyncThreshold);
+  NODE_SET_METHOD(target, "digest", Digest);
+  NODE_SET_METHOD(target, "hmac", HmacOneShot);
+  NODE_SET_METHOD(target, "hashFile", HashFile);
+  NODE_SET_METHOD(target, "hmacFile", HmacFile);
+  NODE_SET_METHOD(target, "encryptFile", EncryptFile);
+  NODE_SET_METHOD(target, "decryptFile", DecryptFile);
+  NODE_SET_METHOD(target, "encryptParallel", EncryptParallel);
+  NODE_SET_METHOD(target, "decryptParallel", DecryptParallel);
+  NODE_SET_METHOD(target, "pbkdf2", Pbkdf2);
+  NODE_SET_METHOD(target, "scrypt", Scrypt);
+  NODE_SET_METHOD(target, "hkdf", Hkdf);
 }
@@ -0,0 +1,211 @@
+#include "kdf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+
+int
+kdf_hkdf(const EVP_MD *md,
+         const unsigned char *salt, size_t salt_len,
+         const unsigned char *ikm, size_t ikm_len,
+         const unsigned char *info, size_t info_len,
+         unsigned char *out, size_t out_len)
+{
+  size_t md_len = EVP_MD_size(md);
+  if (out_len > 255 * md_len)
+    return -1;
+
+  unsigned char zeros[EVP_MAX_MD_SIZE];
+  if (salt_len == 0) {
+    memset(zeros, 0, md_len);
+    salt = zeros;
+    salt_len = md_len;
+  }
+
+  // Extract: PRK = HMAC(salt, IKM)
+  unsigned char prk[EVP_MAX_MD_SIZE];
+  unsigned int prk_len;
+  HMAC_CTX ctx;
+  HMAC_CTX_init(&ctx);
+  HMAC_Init_ex(&ctx, salt, salt_len, md, NULL);
+  HMAC_Update(&ctx, ikm, ikm_len);
+  HMAC_Final(&ctx, prk, &prk_len);
+
+  // Expand: T(i) = HMAC(PRK, T(i-1) | info | i)
+  unsigned char t[EVP_MAX_MD_SIZE];
+  unsigned int t_len = 0;
+  size_t done = 0;
+  for (unsigned char i = 1; done < out_len; i++) {
+    HMAC_Init_ex(&ctx, prk, prk_len, md, NULL);
+    HMAC_Update(&ctx, t, t_len);
+    HMAC_Update(&ctx, info, info_len);
+    HMAC_Update(&ctx, &i, 1);
+    HMAC_Final(&ctx, t, &t_len);
+
+    size_t n = out_len - done < t_len ? out_len - done : t_len;
+    memcpy(out + done, t, n);
+    done += n;
+  }
+  HMAC_CTX_cleanup(&ctx);
+
+  OPENSSL_cleanse(prk, sizeof(prk));
+  OPENSSL_cleanse(t, sizeof(t));
+  return 0;
+}
+
+
+// scrypt, following the reference code in RFC 7914. Blocks are kept as
+// little endian 32 bit words so Salsa20 can work on them directly.
+
+#define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static void
+salsa20_8(uint32_t B[16])
+{
+  uint32_t x[16];
+  memcpy(x, B, sizeof(x));
+  for (int i = 0; i < 8; i += 2) {
+    x[ 4] ^= ROTL(x[ 0]+x[12], 7);  x[ 8] ^= ROTL(x[ 4]+x[ 0], 9);
+    x[12] ^= ROTL(x[ 8]+x[ 4],13);  x[ 0] ^= ROTL(x[12]+x[ 8],18);
+    x[ 9] ^= ROTL(x[ 5]+x[ 1], 7);  x[13] ^= ROTL(x[ 9]+x[ 5], 9);
+    x[ 1] ^= ROTL(x[13]+x[ 9],13);  x[ 5] ^= ROTL(x[ 1]+x[13],18);
+    x[14] ^= ROTL(x[10]+x[ 6], 7);  x[ 2] ^= ROTL(x[14]+x[10], 9);
+    x[ 6] ^= ROTL(x[ 2]+x[14],13);  x[10] ^= ROTL(x[ 6]+x[ 2],18);
+    x[ 3] ^= ROTL(x[15]+x[11], 7);  x[ 7] ^= ROTL(x[ 3]+x[15], 9);
+    x[11] ^= ROTL(x[ 7]+x[ 3],13);  x[15] ^= ROTL(x[11]+x[ 7],18);
+    x[ 1] ^= ROTL(x[ 0]+x[ 3], 7);  x[ 2] ^= ROTL(x[ 1]+x[ 0], 9);
+    x[ 3] ^= ROTL(x[ 2]+x[ 1],13);  x[ 0] ^= ROTL(x[ 3]+x[ 2],18);
+    x[ 6] ^= ROTL(x[ 5]+x[ 4], 7);  x[ 7] ^= ROTL(x[ 6]+x[ 5], 9);
+    x[ 4] ^= ROTL(x[ 7]+x[ 6],13);  x[ 5] ^= ROTL(x[ 4]+x[ 7],18);
+    x[11] ^= ROTL(x[10]+x[ 9], 7);  x[ 8] ^= ROTL(x[11]+x[10], 9);
+    x[ 9] ^= ROTL(x[ 8]+x[11],13);  x[10] ^= ROTL(x[ 9]+x[ 8],18);
+    x[12] ^= ROTL(x[15]+x[14], 7);  x[13] ^= ROTL(x[12]+x[15], 9);
+    x[14] ^= ROTL(x[13]+x[12],13);  x[15] ^= ROTL(x[14]+x[13],18);
+  }
+  for (int i = 0; i < 16; i++)
+    B[i] += x[i];
+}
+
+// B and Y are 2r blocks of 16 words. The result goes to Y, with the
+// even blocks first and then the odd ones.
+static void
+blockmix_salsa8(const uint32_t *B, uint32_t *Y, uint32_t r)
+{
+  uint32_t X[16];
+  memcpy(X, &B[(2 * r - 1) * 16], sizeof(X));
+  for (uint32_t i = 0; i < 2 * r; i++) {
+    for (int k = 0; k < 16; k++)
+      X[k] ^= B[i * 16 + k];
+    salsa20_8(X);
+    memcpy(&Y[(i / 2 + (i & 1) * r) * 16], X, sizeof(X));
+  }
+}
+
+static uint32_t
+le32dec(const unsigned char *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+         ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+le32enc(unsigned char *p, uint32_t x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+// B is 128r bytes, V 128rN bytes and XY 256r bytes of scratch.
+static void
+romix(unsigned char *B, uint32_t r, uint64_t N, uint32_t *V, uint32_t *XY)
+{
+  size_t words = 32 * r;
+  uint32_t *X = XY, *Y = XY + words;
+
+  for (size_t k = 0; k < words; k++)
+    X[k] = le32dec(&B[4 * k]);
+
+  for (uint64_t i = 0; i < N; i++) {
+    memcpy(&V[i * words], X, words * 4);
+    blockmix_salsa8(X, Y, r);
+    uint32_t *T = X; X = Y; Y = T;
+  }
+  for (uint64_t i = 0; i < N; i++) {
+    // Integerify: the first 64 bits of the last block, mod N.
+    const uint32_t *last = &X[(2 * r - 1) * 16];
+    uint64_t j = (last[0] | ((uint64_t) last[1] << 32)) & (N - 1);
+    for (size_t k = 0; k < words; k++)
+      X[k] ^= V[j * words + k];
+    blockmix_salsa8(X, Y, r);
+    uint32_t *T = X; X = Y; Y = T;
+  }
+
+  for (size_t k = 0; k < words; k++)
+    le32enc(&B[4 * k], X[k]);
+}
+
+int
+kdf_scrypt_check(uint64_t N, uint32_t r, uint32_t p, uint64_t maxmem)
+{
+  if (N < 2 || (N & (N - 1)) != 0 || r == 0 || p == 0)
+    return -1;
+  if ((uint64_t) r * p >= (1 << 30))
+    return -1;
+  if (16 * (uint64_t) r < 64 && N >> (16 * r) != 0)
+    return -1;
+  if (N > (size_t) -1 / 128 / r)
+    return -1;
+  // B, V and XY.
+  if (128 * (uint64_t) r * ((uint64_t) p + N + 2) > maxmem)
+    return -1;
+  return 0;
+}
+
+int
+kdf_scrypt(const unsigned char *pass, size_t pass_len,
+           const unsigned char *salt, size_t salt_len,
+           uint64_t N, uint32_t r, uint32_t p, uint64_t maxmem,
+           unsigned char *out, size_t out_len)
+{
+  if (kdf_scrypt_check(N, r, p, maxmem) != 0)
+    return -1;
+
+  size_t B_len = 128 * (size_t) r * p;
+  unsigned char *B = (unsigned char *) malloc(B_len);
+  uint32_t *V = (uint32_t *) malloc(128 * (size_t) r * N);
+  uint32_t *XY = (uint32_t *) malloc(256 * (size_t) r);
+  int ret = -1;
+
+  if (B == NULL || V == NULL || XY == NULL)
+    goto done;
+
+  if (!PKCS5_PBKDF2_HMAC((const char *) pass, pass_len, salt, salt_len, 1,
+                         EVP_sha256(), B_len, B))
+    goto done;
+
+  for (uint32_t i = 0; i < p; i++)
+    romix(&B[128 * (size_t) r * i], r, N, V, XY);
+
+  if (!PKCS5_PBKDF2_HMAC((const char *) pass, pass_len, B, B_len, 1,
+                         EVP_sha256(), out_len, out))
+    goto done;
+  ret = 0;
+
+done:
+  if (B) {
+    OPENSSL_cleanse(B, B_len);
+    free(B);
+  }
+  if (V) {
+    OPENSSL_cleanse(V, 128 * (size_t) r * N);
+    free(V);
+  }
+  if (XY) {
+    OPENSSL_cleanse(XY, 256 * (size_t) r);
+    free(XY);
+  }
+  return ret;
+}
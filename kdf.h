@@ -0,0 +1,35 @@
+#ifndef NODE_CRYPTO_KDF_H_
+#define NODE_CRYPTO_KDF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+// Key derivation functions the OpenSSL versions we build against do not
+// provide. PBKDF2 comes from OpenSSL itself (PKCS5_PBKDF2_HMAC).
+//
+// Both functions are thread safe and only touch the memory they are
+// given, so they can run on the eio thread pool.
+
+// HKDF (RFC 5869) extract-then-expand with the given digest. An empty
+// salt means a string of zero bytes the size of the digest.
+// Returns 0, or -1 if out_len is more than 255 digest lengths.
+int kdf_hkdf(const EVP_MD *md,
+             const unsigned char *salt, size_t salt_len,
+             const unsigned char *ikm, size_t ikm_len,
+             const unsigned char *info, size_t info_len,
+             unsigned char *out, size_t out_len);
+
+// Returns 0 if scrypt accepts the cost parameters: N a power of two
+// greater than 1 and below 2^(16r), r * p below 2^30, and no more than
+// maxmem bytes of memory needed. Returns -1 otherwise.
+int kdf_scrypt_check(uint64_t N, uint32_t r, uint32_t p, uint64_t maxmem);
+
+// scrypt (RFC 7914). Returns 0, or -1 if kdf_scrypt_check rejects the
+// parameters or memory runs out.
+int kdf_scrypt(const unsigned char *pass, size_t pass_len,
+               const unsigned char *salt, size_t salt_len,
+               uint64_t N, uint32_t r, uint32_t p, uint64_t maxmem,
+               unsigned char *out, size_t out_len);
+
+#endif  // NODE_CRYPTO_KDF_H_
@@ -1,6 +1,7 @@
 var crypto=require("./crypto");
 var sys=require("sys");
 var fs=require("fs");
+var Buffer=require("buffer").Buffer;
 var test=require("mjsunit");
 
 
@@ -29,6 +30,9 @@ var s1 = (new crypto.Sign).init("RSA-SHA1").update("Test123").sign(keyPem, "base
 var verified = !!((new crypto.Verify).init("RSA-SHA1").update("Test").update("123").verify(certPem, s1, "base64"));
 test.assertTrue(verified, "sign and verify (base 64)");
 
+var badCertVerified = !!((new crypto.Verify).init("RSA-SHA1").update("Test123").verify("not a certificate", s1, "base64"));
+test.assertTrue(!badCertVerified, "verify with a certificate that does not parse");
+
 var s2 = (new crypto.Sign).init("RSA-SHA256").update("Test123").sign(keyPem); // binary
 var verified = !!((new crypto.Verify).init("RSA-SHA256").update("Test").update("123").verify(certPem, s2)); // binary
 test.assertTrue(verified, "sign and verify (binary)");
@@ -58,3 +62,654 @@ var decipher=(new crypto.Decipher).initiv("des-ede3-cbc",encryption_key,iv);
 var txt = decipher.update(ciph, 'hex', 'utf8');
 txt += decipher.final('utf8');
 test.assertEquals(txt, plaintext, "encryption and decryption with key and iv");
+
+// Test asynchronous signing and verifying
+var asyncSigned = false, asyncVerified = false;
+(new crypto.Sign).init("RSA-SHA1").update("Test123").sign(keyPem, "hex", function (err, sig) {
+  test.assertEquals(null, err, "async sign error");
+  test.assertEquals((new crypto.Sign).init("RSA-SHA1").update("Test123").sign(keyPem, "hex"), sig, "async sign matches sync sign");
+  asyncSigned = true;
+  (new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, sig, "hex", function (err, r) {
+    test.assertEquals(null, err, "async verify error");
+    test.assertEquals(1, r, "async sign and verify");
+    asyncVerified = true;
+  });
+});
+
+var pendingSign = (new crypto.Sign).init("RSA-SHA1").update("Test123");
+pendingSign.sign(keyPem, "hex", function (err, sig) {
+  test.assertEquals(null, err, "async sign error");
+});
+var refused = 0;
+try { pendingSign.update("more"); } catch (e) { refused++; }
+try { pendingSign.sign(keyPem, "hex", function () {}); } catch (e) { refused++; }
+test.assertEquals(2, refused, "signer busy while async sign runs");
+refused = false;
+try {
+  (new crypto.Sign).sign(keyPem, "hex", function () {});
+} catch (e) {
+  refused = true;
+}
+test.assertTrue(refused, "async sign needs init()");
+var asyncVerifyError = null;
+(new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, "not hex", "hex", function (err, r) {
+  asyncVerifyError = err;
+});
+var asyncBadCertError = null;
+(new crypto.Verify).init("RSA-SHA1").update("Test123").verify("not a certificate", s1, "base64", function (err, r) {
+  asyncBadCertError = err;
+});
+
+process.addListener("exit", function () {
+  test.assertTrue(asyncSigned, "async sign callback ran");
+  test.assertTrue(asyncVerified, "async verify callback ran");
+  test.assertTrue(asyncVerifyError instanceof Error, "async verify reports bad input as an error");
+  test.assertTrue(asyncBadCertError instanceof Error, "async verify reports a certificate that does not parse");
+});
+
+// Test signing and verifying with parsed key objects
+var privateKey = new crypto.PrivateKey(keyPem);
+var certificate = new crypto.Certificate(certPem);
+var publicKey = new crypto.PublicKey(fs.readFileSync("test_pubkey.pem"));
+
+var s3 = (new crypto.Sign).init("RSA-SHA1").update("Test123").sign(privateKey, "base64");
+test.assertEquals(s1, s3, "sign with PrivateKey matches sign with PEM");
+var verified = !!((new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certificate, s3, "base64"));
+test.assertTrue(verified, "verify with Certificate");
+var verified = !!((new crypto.Verify).init("RSA-SHA1").update("Test123").verify(publicKey, s3, "base64"));
+test.assertTrue(verified, "verify with PublicKey");
+var rsaPublicKey = new crypto.PublicKey(fs.readFileSync("test_rsa_pubkey.pem"));
+var verified = !!((new crypto.Verify).init("RSA-SHA1").update("Test123").verify(rsaPublicKey, s3, "base64"));
+test.assertTrue(verified, "verify with a PKCS#1 PublicKey");
+
+// Test the parsed key cache
+crypto.flushKeyCache();
+var before = crypto.getKeyCacheStats();
+test.assertEquals(0, before.size, "key cache flushed");
+(new crypto.Sign).init("RSA-SHA1").update("Test123").sign(keyPem);
+(new crypto.Sign).init("RSA-SHA1").update("Test123").sign(keyPem);
+var after = crypto.getKeyCacheStats();
+test.assertEquals(before.misses + 1, after.misses, "key cache miss on first use");
+test.assertEquals(before.hits + 1, after.hits, "key cache hit on second use");
+crypto.setKeyCacheSize(0);
+test.assertEquals(0, crypto.getKeyCacheStats().size, "key cache disabled");
+var verified = !!((new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, s1, "base64"));
+test.assertTrue(verified, "verify with key cache disabled");
+crypto.setKeyCacheSize(64);
+
+// Test batch verification
+var batch = [];
+for (var i = 0; i < 40; i++) {
+  var msg = "message " + i;
+  var sig = (new crypto.Sign).init("RSA-SHA256").update(msg).sign(privateKey, "hex");
+  batch.push([msg, i % 5 == 0 ? sig.replace(/^../, "00") : sig]);
+}
+var results = crypto.verifyMany("RSA-SHA256", certificate, batch, "hex");
+test.assertEquals(40, results.length, "verifyMany result count");
+for (var i = 0; i < 40; i++) {
+  test.assertEquals(i % 5 == 0 ? 0 : 1, results[i], "verifyMany result " + i);
+}
+test.assertEquals(0, crypto.verifyMany("RSA-SHA256", certificate, [["message 1", "not hex"]], "hex")[0], "verifyMany with invalid hex");
+test.assertEquals(0, crypto.verifyMany("RSA-SHA256", certificate, [["message 1", "!!"]], "base64")[0], "verifyMany with invalid base64");
+var asyncVerifiedMany = false;
+crypto.verifyMany("RSA-SHA256", certPem, batch, "hex", function (err, asyncResults) {
+  test.assertEquals(null, err, "async verifyMany error");
+  test.assertEquals(results.join(), asyncResults.join(), "async verifyMany matches sync");
+  asyncVerifiedMany = true;
+});
+process.addListener("exit", function () {
+  test.assertTrue(asyncVerifiedMany, "async verifyMany callback ran");
+});
+
+// Test Buffer arguments
+var b1 = (new crypto.Hash).init("sha1").update(new Buffer("Test123", "binary")).digest("hex");
+test.assertEquals(a0, b1, "hash Buffer input");
+var b2 = (new crypto.Hmac).init("sha1", new Buffer("Node", "binary")).update(new Buffer("some data", "binary")).update("to hmac").digest("hex");
+test.assertEquals('19fd6e1ba73d9ed2224dd5094a71babe85d9a892', b2, "hmac Buffer key and input");
+var cipher=(new crypto.Cipher).initiv("des-ede3-cbc", new Buffer(encryption_key, "binary"), new Buffer(iv, "binary"));
+var ciph=cipher.update(new Buffer(plaintext, "binary"), 'binary', 'hex');
+ciph+=cipher.final('hex');
+var decipher=(new crypto.Decipher).initiv("des-ede3-cbc",encryption_key,iv);
+var txt = decipher.update(ciph, 'hex', 'utf8');
+txt += decipher.final('utf8');
+test.assertEquals(txt, plaintext, "encryption with Buffer key, iv and input");
+var verified = !!((new crypto.Verify).init("RSA-SHA1").update(new Buffer("Test123", "binary")).verify(new Buffer(certPem, "binary"), s1, "base64"));
+test.assertTrue(verified, "verify with Buffer cert and input");
+
+// Test encrypting and decrypting into caller supplied Buffers
+var cipher=(new crypto.Cipher).initiv("des-ede3-cbc", encryption_key, iv);
+var out = new Buffer(256);
+var n = cipher.updateInto(plaintext, out, 0, 'utf8');
+n += cipher.finalInto(out, n);
+test.assertEquals(ciph, out.toString('binary', 0, n).replace(/[\s\S]/g, function (c) {
+  var h = c.charCodeAt(0).toString(16);
+  return h.length < 2 ? '0' + h : h;
+}), "updateInto/finalInto match update/final");
+
+var decipher=(new crypto.Decipher).initiv("des-ede3-cbc", encryption_key, iv);
+var plain = new Buffer(256);
+var m = decipher.updateInto(out.slice(0, n), plain, 0);
+m += decipher.finalInto(plain, m);
+test.assertEquals(plaintext, plain.toString('utf8', 0, m), "Decipher updateInto/finalInto");
+
+var hexDecipher=(new crypto.Decipher).initiv("des-ede3-cbc", encryption_key, iv);
+m = hexDecipher.updateInto(ciph.slice(0, 7), plain, 0, 'hex');
+m += hexDecipher.updateInto(ciph.slice(7), plain, m, 'hex');
+m += hexDecipher.finalInto(plain, m);
+test.assertEquals(plaintext, plain.toString('utf8', 0, m), "Decipher updateInto with hex input");
+
+var threw = false;
+try {
+  (new crypto.Cipher).initiv("des-ede3-cbc", encryption_key, iv).updateInto(plaintext, new Buffer(8), 0);
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "updateInto rejects a short output Buffer");
+
+// Test hex validation
+var threw = false;
+try {
+  (new crypto.Decipher).initiv("des-ede3-cbc", encryption_key, iv).update("zz", "hex", "binary");
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "Decipher rejects invalid hex");
+test.assertEquals(0, (new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, "not hex", "hex"), "verify rejects invalid hex");
+test.assertEquals(h1, (new crypto.Hash).init("sha1").update("Test123").digest("hex"), "hex digest");
+
+// Test base64 validation
+test.assertEquals(1, (new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, s1.replace(/(.{16})/g, "$1\n"), "base64"), "verify skips whitespace in base64");
+test.assertEquals(0, (new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, "!!" + s1, "base64"), "verify rejects invalid base64");
+crypto.setBase64Strict(true);
+test.assertEquals(0, (new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, s1.replace(/(.{16})/g, "$1\n"), "base64"), "strict base64 rejects whitespace");
+test.assertEquals(1, (new crypto.Verify).init("RSA-SHA1").update("Test123").verify(certPem, s1, "base64"), "strict base64 accepts canonical input");
+crypto.setBase64Strict(false);
+var threw = false;
+try {
+  (new crypto.Decipher).initiv("des-ede3-cbc", encryption_key, iv).update("a*b=", "base64", "binary");
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "Decipher rejects invalid base64");
+
+// Test one-shot digest and hmac
+test.assertEquals(a0, crypto.digest("sha1", "Test123", "hex"), "one-shot digest hex");
+test.assertEquals(a1, crypto.digest("md5", "Test123", "binary"), "one-shot digest binary");
+test.assertEquals(a2, crypto.digest("sha256", new Buffer("Test123"), "base64"), "one-shot digest Buffer base64");
+test.assertEquals(a3, crypto.digest("sha512", "Test123"), "one-shot digest default binary");
+test.assertEquals('19fd6e1ba73d9ed2224dd5094a71babe85d9a892', crypto.hmac("sha1", "Node", "some datato hmac", "hex"), "one-shot hmac");
+var threw = false;
+try {
+  crypto.digest("no-such-digest", "Test123");
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "one-shot digest rejects unknown algorithms");
+
+// Test algorithm IDs
+test.assertEquals("number", typeof crypto.algorithms.sha1, "algorithm registry has sha1");
+test.assertEquals(crypto.algorithms.sha1, crypto.algorithms["RSA-SHA1"], "aliases share an ID");
+test.assertEquals(a0, (new crypto.Hash).init(crypto.algorithms.sha1).update("Test123").digest("hex"), "Hash init by ID");
+test.assertEquals(h1, crypto.digest(crypto.algorithms.sha1, "Test123", "hex"), "digest by ID");
+test.assertEquals(1, (new crypto.Verify).init(crypto.algorithms["RSA-SHA1"]).update("Test123").verify(certPem, s1, "base64"), "Verify init by ID");
+var cipher=(new crypto.Cipher).initiv(crypto.algorithms["des-ede3-cbc"], encryption_key, iv);
+test.assertEquals(ciph, cipher.update(plaintext, 'utf8', 'hex') + cipher.final('hex'), "Cipher initiv by ID");
+
+// Test copying hash and hmac state
+var prefix = (new crypto.Hash).init("sha1").update("Test");
+var fork = prefix.copy();
+test.assertEquals(h1, fork.update("123").digest("hex"), "Hash copy carries the prefix");
+test.assertEquals(crypto.digest("sha1", "Test", "hex"), prefix.copy().digest("hex"), "intermediate digest from a copy");
+test.assertEquals(h1, prefix.update("123").digest("hex"), "original Hash unaffected by copy");
+var hprefix = (new crypto.Hmac).init("sha1", "Node").update("some data");
+test.assertEquals('19fd6e1ba73d9ed2224dd5094a71babe85d9a892', hprefix.copy().update("to hmac").digest("hex"), "Hmac copy");
+test.assertEquals('19fd6e1ba73d9ed2224dd5094a71babe85d9a892', hprefix.update("to hmac").digest("hex"), "original Hmac unaffected by copy");
+
+// Test reusable HMAC keys
+var hkey = new crypto.HmacKey("sha1", "Node");
+test.assertEquals('19fd6e1ba73d9ed2224dd5094a71babe85d9a892', hkey.hmac("some datato hmac", "hex"), "HmacKey hmac");
+test.assertEquals('19fd6e1ba73d9ed2224dd5094a71babe85d9a892', hkey.hmac(new Buffer("some datato hmac"), "hex"), "HmacKey reuse with Buffer");
+test.assertEquals(crypto.hmac("sha1", "Node", "other", "base64"), hkey.hmac("other", "base64"), "HmacKey matches one-shot hmac");
+
+// Test batch hashing
+var blobs = ["Test123", new Buffer("Test123"), "", "some data"];
+var many = crypto.hashMany("sha1", blobs, "hex");
+test.assertEquals(4, many.length, "hashMany returns one digest per input");
+test.assertEquals(h1, many[0], "hashMany string input");
+test.assertEquals(h1, many[1], "hashMany Buffer input");
+test.assertEquals(crypto.digest("sha1", "", "hex"), many[2], "hashMany empty input");
+var bigBlobs = [];
+for (var i = 0; i < 200; i++) bigBlobs.push("blob " + i + new Array(1000).join("x"));
+var hashManyAsync = null;
+crypto.hashMany(crypto.algorithms.sha256, bigBlobs, "base64", function (err, results) {
+  hashManyAsync = results;
+});
+process.addListener("exit", function () {
+  test.assertEquals(200, hashManyAsync.length, "async hashMany result count");
+  for (var i = 0; i < bigBlobs.length; i++) {
+    test.assertEquals(crypto.digest("sha256", bigBlobs[i], "base64"), hashManyAsync[i], "async hashMany result " + i);
+  }
+});
+
+// Test hashing files
+var fileDigest = null, fileRangeDigest = null, fileHmac = null, missingErr = null;
+crypto.hashFile("test_key.pem", "sha1", "hex", function (err, digest) {
+  fileDigest = digest;
+});
+crypto.hashFile("test_key.pem", crypto.algorithms.sha1, "hex", {start: 5, length: 20}, function (err, digest) {
+  fileRangeDigest = digest;
+});
+crypto.hmacFile("test_key.pem", "sha1", "Node", "base64", function (err, mac) {
+  fileHmac = mac;
+});
+crypto.hashFile("no_such_file.pem", "sha1", function (err, digest) {
+  missingErr = err;
+});
+var pastEndErr = null;
+crypto.hashFile("test_key.pem", "sha1", "hex", {start: 5, length: 1 << 20}, function (err, digest) {
+  pastEndErr = err;
+});
+process.addListener("exit", function () {
+  var pem = keyPem.toString();
+  test.assertEquals(crypto.digest("sha1", pem, "hex"), fileDigest, "hashFile");
+  test.assertEquals(crypto.digest("sha1", pem.substr(5, 20), "hex"), fileRangeDigest, "hashFile with a byte range");
+  test.assertEquals(crypto.hmac("sha1", "Node", pem, "base64"), fileHmac, "hmacFile");
+  test.assertTrue(missingErr instanceof Error, "hashFile reports a missing file");
+  test.assertTrue(pastEndErr instanceof Error, "hashFile reports a range past the end of the file");
+});
+
+// Test encrypting and decrypting files
+var fileRoundTrip = null, fileProgress = [], fileCipherBytes = null;
+crypto.encryptFile("test_key.pem", "test_key.pem.enc", "des-ede3-cbc", encryption_key, iv, function (bytesRead, bytesWritten) {
+  fileProgress.push(bytesRead);
+}, function (err, bytesRead, bytesWritten) {
+  test.assertEquals(null, err, "encryptFile");
+  fileCipherBytes = [bytesRead, bytesWritten];
+  crypto.decryptFile("test_key.pem.enc", "test_key.pem.dec", "des-ede3-cbc", encryption_key, iv, function (err) {
+    test.assertEquals(null, err, "decryptFile");
+    fileRoundTrip = fs.readFileSync("test_key.pem.dec").toString();
+    fs.unlinkSync("test_key.pem.enc");
+    fs.unlinkSync("test_key.pem.dec");
+  });
+});
+process.addListener("exit", function () {
+  var pem = keyPem.toString();
+  test.assertEquals(pem, fileRoundTrip, "encryptFile/decryptFile round trip");
+  test.assertEquals(pem.length, fileCipherBytes[0], "encryptFile bytes read");
+  // Progress may or may not arrive before the callback for a small file.
+  for (var i = 0; i < fileProgress.length; i++) {
+    test.assertTrue(fileProgress[i] <= pem.length, "encryptFile progress");
+  }
+  test.assertEquals((Math.floor(pem.length / 8) + 1) * 8, fileCipherBytes[1], "encryptFile bytes written");
+});
+var fileAeadThrew = false;
+try {
+  crypto.encryptFile("test_key.pem", "test_key.pem.enc", "aes-128-gcm", "0123456789abcdef", "123456789012", function () {});
+} catch (e) {
+  fileAeadThrew = true;
+}
+test.assertTrue(fileAeadThrew, "encryptFile rejects GCM");
+
+// Test AEAD ciphers
+function testAead(alg, key, nonce) {
+  var cipher = (new crypto.Cipher).initiv(alg, key, nonce);
+  cipher.setAAD("header");
+  var sealed = cipher.update(plaintext, 'utf8', 'hex') + cipher.final('hex');
+  var tag = cipher.getAuthTag('hex');
+  test.assertEquals(32, tag.length, alg + " tag length");
+
+  var decipher = (new crypto.Decipher).initiv(alg, key, nonce);
+  decipher.setAAD("header");
+  decipher.setAuthTag(tag, 'hex');
+  var opened = decipher.update(sealed, 'hex', 'utf8') + decipher.final('utf8');
+  test.assertEquals(plaintext, opened, alg + " round trip");
+
+  var threw = false;
+  decipher = (new crypto.Decipher).initiv(alg, key, nonce);
+  decipher.setAAD("other header");
+  decipher.setAuthTag(tag, 'hex');
+  decipher.update(sealed, 'hex', 'utf8');
+  try {
+    decipher.final('utf8');
+  } catch (e) {
+    threw = true;
+  }
+  test.assertTrue(threw, alg + " final rejects a bad tag");
+}
+testAead("aes-128-gcm", "0123456789abcdef", "123456789012");
+testAead("aes-256-gcm", "0123456789abcdef0123456789abcdef", "a longer 24 byte nonce..");
+
+// A re-initialised cipher does not keep the last tag
+var retagged = (new crypto.Cipher).initiv("aes-128-gcm", "0123456789abcdef", "123456789012");
+retagged.update(plaintext, 'utf8', 'hex');
+retagged.final('hex');
+retagged.initiv("aes-128-gcm", "0123456789abcdef", "210987654321");
+var staleTagThrew = false;
+try {
+  retagged.getAuthTag('hex');
+} catch (e) {
+  staleTagThrew = true;
+}
+test.assertTrue(staleTagThrew, "initiv clears the auth tag");
+
+var aeadInitThrew = 0;
+try { (new crypto.Cipher).init("aes-128-gcm", "passphrase"); } catch (e) { aeadInitThrew++; }
+try { (new crypto.Decipher).init("aes-128-gcm", "passphrase"); } catch (e) { aeadInitThrew++; }
+test.assertEquals(2, aeadInitThrew, "init rejects AEAD ciphers");
+
+// Test parallel CTR mode against the serial path
+var ctrKey = "0123456789abcdef", ctrIv = "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xf0";
+var bigPlain = new Buffer(300 * 1024 + 7);
+for (var i = 0; i < bigPlain.length; i++) bigPlain[i] = (i * 31 + 7) & 0xff;
+var serial = (new crypto.Cipher).initiv("aes-128-ctr", ctrKey, ctrIv);
+var serialOut = serial.update(bigPlain) + serial.final();
+var parallelOut = crypto.encryptParallel("aes-128-ctr", ctrKey, ctrIv, bigPlain, 4);
+test.assertEquals(serialOut.length, parallelOut.length, "encryptParallel output length");
+test.assertTrue(serialOut == parallelOut.toString('binary', 0, parallelOut.length), "encryptParallel matches serial CTR");
+var roundTrip = crypto.decryptParallel("aes-128-ctr", ctrKey, ctrIv, parallelOut, 3);
+test.assertTrue(bigPlain.toString('binary', 0, bigPlain.length) == roundTrip.toString('binary', 0, roundTrip.length), "decryptParallel round trip");
+var parallelAsync = null;
+crypto.encryptParallel("aes-128-ctr", ctrKey, ctrIv, bigPlain, 4, function (err, out) {
+  parallelAsync = out.toString('binary', 0, out.length);
+});
+process.addListener("exit", function () {
+  test.assertTrue(serialOut == parallelAsync, "async encryptParallel matches serial CTR");
+});
+var threw = false;
+try {
+  crypto.encryptParallel("aes-128-gcm", ctrKey, "123456789012", bigPlain);
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "encryptParallel rejects GCM");
+
+// Test reset(iv) against a freshly keyed cipher
+var iv2 = "87654321";
+var reused = (new crypto.Cipher).initiv("des-ede3-cbc", encryption_key, iv);
+reused.update(plaintext, 'utf8', 'hex');
+reused.final('hex');
+reused.reset(iv2);
+var resetCiph = reused.update(plaintext, 'utf8', 'hex') + reused.final('hex');
+var fresh = (new crypto.Cipher).initiv("des-ede3-cbc", encryption_key, iv2);
+test.assertEquals(fresh.update(plaintext, 'utf8', 'hex') + fresh.final('hex'), resetCiph, "Cipher reset(iv) matches initiv");
+var redec = (new crypto.Decipher).initiv("des-ede3-cbc", encryption_key, iv);
+redec.update(ciph, 'hex', 'utf8');
+redec.final('utf8');
+redec.reset(iv2);
+test.assertEquals(plaintext, redec.update(resetCiph, 'hex', 'utf8') + redec.final('utf8'), "Decipher reset(iv) round trip");
+var threw = false;
+try {
+  reused.reset("short");
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "reset rejects an IV of the wrong length");
+
+// Test the passphrase cipher context cache
+crypto.flushCipherKeyCache();
+var before = crypto.getCipherKeyCacheStats();
+test.assertEquals(0, before.size, "cipher key cache flushed");
+var c1 = (new crypto.Cipher).init("aes192", "MySecretKey123");
+var out1 = c1.update(plaintext, 'utf8', 'hex') + c1.final('hex');
+var c2 = (new crypto.Cipher).init("aes192", "MySecretKey123");
+var out2 = c2.update(plaintext, 'utf8', 'hex') + c2.final('hex');
+test.assertEquals(out1, out2, "cached cipher context gives the same output");
+var d1 = (new crypto.Decipher).init("aes192", "MySecretKey123");
+test.assertEquals(plaintext, d1.update(out2, 'hex', 'utf8') + d1.final('utf8'), "decipher with cached passphrase");
+var after = crypto.getCipherKeyCacheStats();
+test.assertEquals(before.misses + 2, after.misses, "cipher key cache misses per direction");
+test.assertEquals(before.hits + 1, after.hits, "cipher key cache hit on repeated init");
+crypto.setCipherKeyCacheSize(0);
+test.assertEquals(0, crypto.getCipherKeyCacheStats().size, "cipher key cache disabled");
+crypto.setCipherKeyCacheSize(64);
+
+// Test key derivation against the RFC 6070, 7914 and 5869 vectors
+function toHex(buf) {
+  return buf.toString('binary', 0, buf.length).replace(/[\s\S]/g, function (c) {
+    var h = c.charCodeAt(0).toString(16);
+    return h.length < 2 ? '0' + h : h;
+  });
+}
+test.assertEquals("0c60c80f961f0e71f3a9b524af6012062fe037a6", toHex(crypto.pbkdf2("password", "salt", 1, 20)), "pbkdf2 sha1");
+test.assertEquals("ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957", toHex(crypto.pbkdf2("password", "salt", 2, 20, "sha1")), "pbkdf2 two iterations");
+test.assertEquals("77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442" +
+                  "fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906",
+                  toHex(crypto.scrypt("", "", 64, {N: 16, r: 1, p: 1})), "scrypt");
+var threw = false;
+try {
+  crypto.scrypt("password", "salt", 64, {N: 1 << 20, r: 8, p: 1});
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "scrypt honours maxmem");
+var ikm = "", salt = "", info = "";
+for (var i = 0; i < 22; i++) ikm += "\x0b";
+for (var i = 0; i < 13; i++) salt += String.fromCharCode(i);
+for (var i = 0; i < 10; i++) info += String.fromCharCode(0xf0 + i);
+test.assertEquals("3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865",
+                  toHex(crypto.hkdf("sha256", ikm, salt, info, 42)), "hkdf sha256");
+var asyncKey = null;
+crypto.pbkdf2("password", "salt", 2, 20, "sha1", function (err, key) {
+  test.assertEquals(null, err, "async pbkdf2 error");
+  asyncKey = toHex(key);
+});
+process.addListener("exit", function () {
+  test.assertEquals("ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957", asyncKey, "async pbkdf2");
+});
+var derived = crypto.pbkdf2("passphrase", "salt", 1000, 16, "sha256");
+var kc = (new crypto.Cipher).initiv("aes-128-cbc", derived, "0123456789abcdef");
+var kd = (new crypto.Decipher).initiv("aes-128-cbc", derived, "0123456789abcdef");
+test.assertEquals(plaintext, kd.update(kc.update(plaintext, 'utf8', 'hex') + kc.final('hex'), 'hex', 'utf8') + kd.final('utf8'), "derived key as cipher key");
+
+// Test streaming in every encoding across awkward chunk boundaries
+var longText = "";
+for (var i = 0; i < 50; i++) longText += "Ünïcødé ☃ text " + i + " ";
+var whole = (new crypto.Cipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+var wholeB64 = whole.update(longText, 'utf8', 'base64') + whole.final('base64');
+var wholeHex = (new crypto.Cipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+wholeHex = wholeHex.update(longText, 'utf8', 'hex') + wholeHex.final('hex');
+var chunked = (new crypto.Cipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+var chunkedB64 = "";
+for (var i = 0; i < longText.length; i += 7) {
+  chunkedB64 += chunked.update(longText.substr(i, 7), 'utf8', 'base64');
+}
+chunkedB64 += chunked.final('base64');
+test.assertEquals(wholeB64, chunkedB64, "Cipher base64 output across chunks");
+var streamDec = (new crypto.Decipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+var streamPlain = "";
+for (var i = 0; i < wholeB64.length; i += 5) {
+  streamPlain += streamDec.update(wholeB64.substr(i, 5), 'base64', 'utf8');
+}
+streamPlain += streamDec.final('utf8');
+test.assertEquals(longText, streamPlain, "Decipher base64 input and utf8 output across chunks");
+var hexDec = (new crypto.Decipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+var reHex = "";
+for (var i = 0; i < wholeHex.length; i += 3) {
+  reHex += hexDec.update(wholeHex.substr(i, 3), 'hex', 'hex');
+}
+reHex += hexDec.final('hex');
+var ctrCipher = (new crypto.Cipher).initiv("aes-128-ctr", "0123456789abcdef", "fedcba9876543210");
+var ctrB64 = ctrCipher.update(longText, 'utf8', 'base64') + ctrCipher.final('base64');
+var ctrDec = (new crypto.Decipher).initiv("aes-128-ctr", "0123456789abcdef", "fedcba9876543210");
+test.assertEquals(longText, ctrDec.update(ctrB64, 'base64', 'utf8') + ctrDec.final('utf8'), "CTR base64 round trip");
+var cbcHex = (new crypto.Decipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+test.assertEquals(cbcHex.update(wholeHex, 'hex', 'hex') + cbcHex.final('hex'), reHex, "Decipher hex output across chunks");
+var threw = false;
+try {
+  var odd = (new crypto.Decipher).initiv("aes-128-cbc", "0123456789abcdef", "fedcba9876543210");
+  odd.update(wholeHex + "a", 'hex', 'binary');
+  odd.final('binary');
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "final rejects a dangling hex digit");
+
+// Test the stream interface
+var hashStream = (new crypto.Hash).init("sha1"), streamedDigest = "", hashEnded = false;
+hashStream.addListener("data", function (d) {
+  streamedDigest += d.toString('binary', 0, d.length);
+});
+hashStream.addListener("end", function () {
+  hashEnded = true;
+});
+hashStream.write("Test");
+hashStream.write(new Buffer("123", "binary"));
+hashStream.end();
+var cipherStream = (new crypto.Cipher).initiv("aes-128-ctr", ctrKey, ctrIv), streamedCipher = "";
+cipherStream.setHighWaterMark(64 * 1024);
+cipherStream.addListener("data", function (d) {
+  streamedCipher += d.toString('binary', 0, d.length);
+});
+var writeOk = true, drained = false;
+for (var i = 0; i < bigPlain.length; i += 50000) {
+  writeOk = cipherStream.write(bigPlain.slice(i, Math.min(i + 50000, bigPlain.length))) && writeOk;
+}
+cipherStream.addListener("drain", function () {
+  drained = true;
+});
+cipherStream.end();
+test.assertTrue(!writeOk, "write() reports the high-water mark");
+var threw = false;
+try {
+  cipherStream.update("more");
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "update() refused while stream writes are pending");
+var signStream = (new crypto.Sign).init("RSA-SHA1"), streamedSig = null;
+signStream.addListener("end", function () {
+  streamedSig = signStream.sign(keyPem, "hex");
+});
+signStream.write("Test123");
+signStream.end();
+var hexCipher = (new crypto.Cipher).init("aes192", "MySecretKey123");
+var hexCt = hexCipher.update("Hello World!", "utf8", "hex") + hexCipher.final("hex");
+var hexStream = (new crypto.Decipher).init("aes192", "MySecretKey123"), streamedHex = "";
+hexStream.addListener("data", function (d) {
+  streamedHex += d.toString('binary', 0, d.length);
+});
+hexStream.write(hexCt.slice(0, 7), "hex");
+hexStream.write(hexCt.slice(7), "hex");
+hexStream.end();
+var hexThrew = 0;
+try { (new crypto.Hash).init("sha1").write("abcd", "hex"); } catch (e) { hexThrew++; }
+try { (new crypto.Hash).init("sha1").update("abcd", "base64", function () {}); } catch (e) { hexThrew++; }
+test.assertEquals(2, hexThrew, "hash stream refuses hex and base64 strings");
+process.addListener("exit", function () {
+  test.assertTrue(hashEnded, "hash stream ended");
+  test.assertEquals((new crypto.Hash).init("sha1").update("Test123").digest("binary"), streamedDigest, "hash stream digest");
+  test.assertTrue(serialOut == streamedCipher, "cipher stream output matches update()");
+  test.assertTrue(drained, "cipher stream drained");
+  test.assertEquals((new crypto.Sign).init("RSA-SHA1").update("Test123").sign(keyPem, "hex"), streamedSig, "sign after stream end");
+  test.assertEquals("Hello World!", streamedHex, "decipher stream decodes hex across writes");
+});
+
+// Test async update() with callbacks
+var asyncOrder = [], asyncDigest = null, asyncCipher = [];
+var asyncHash = (new crypto.Hash).init("sha1");
+crypto.setAsyncThreshold(1024);
+asyncHash.update(bigPlain, function (err) {
+  test.assertEquals(null, err, "async hash update error");
+  asyncOrder.push(1);
+});
+asyncHash.update("small", function (err) {
+  asyncOrder.push(2);
+});
+asyncHash.digest("hex", function (err, d) {
+  asyncOrder.push(3);
+  asyncDigest = d;
+});
+var threw = false;
+try {
+  asyncHash.digest("hex");
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "digest() refused while async updates are pending");
+var reused = (new crypto.Hash).init("sha1"), reusedDigests = [], updateReturned = false;
+reused.update("tiny", function (err) {
+  test.assertTrue(updateReturned, "small update calls back after returning");
+});
+updateReturned = true;
+reused.digest("hex", function (err, d) {
+  reusedDigests.push(d);
+  reused.init("sha1");
+  reused.update("tiny", function (err) {});
+  reused.digest("hex", function (err, d) {
+    reusedDigests.push(d);
+  });
+});
+var asyncCipherObj = (new crypto.Cipher).initiv("aes-128-ctr", ctrKey, ctrIv);
+asyncCipherObj.update(bigPlain.slice(0, 200000), function (err, out) {
+  asyncCipher.push(out.toString('binary', 0, out.length));
+});
+asyncCipherObj.update(bigPlain.slice(200000, bigPlain.length), function (err, out) {
+  asyncCipher.push(out.toString('binary', 0, out.length));
+});
+asyncCipherObj.final(function (err, out) {
+  asyncCipher.push(out.toString('binary', 0, out.length));
+});
+process.addListener("exit", function () {
+  test.assertEquals("1,2,3", asyncOrder.join(","), "async callbacks in order");
+  var h = (new crypto.Hash).init("sha1");
+  h.update(bigPlain);
+  test.assertEquals(h.update("small").digest("hex"), asyncDigest, "async digest");
+  test.assertTrue(serialOut == asyncCipher.join(""), "async cipher output matches update()");
+  var tinyDigest = (new crypto.Hash).init("sha1").update("tiny").digest("hex");
+  test.assertEquals([tinyDigest, tinyDigest].join(","), reusedDigests.join(","), "hash reused after an async digest");
+});
+
+// Test update() with an array of chunks
+var chunked = (new crypto.Hash).init("sha1").update(["Te", new Buffer("st", "binary"), "123"]).digest("hex");
+test.assertEquals((new crypto.Hash).init("sha1").update("Test123").digest("hex"), chunked, "hash update with chunk array");
+chunked = (new crypto.Hmac).init("sha1", "Node").update(["Test", "123"]).digest("hex");
+test.assertEquals(crypto.hmac("sha1", "Node", "Test123", "hex"), chunked, "hmac update with chunk array");
+var chunkCipher = (new crypto.Cipher).init("aes192", "MySecretKey123");
+var chunkCt = chunkCipher.update(["Hello World!", " ", "and more text"], "utf8", "hex") + chunkCipher.final("hex");
+var wholeCipher = (new crypto.Cipher).init("aes192", "MySecretKey123");
+test.assertEquals(wholeCipher.update("Hello World! and more text", "utf8", "hex") + wholeCipher.final("hex"), chunkCt, "cipher update with chunk array");
+var chunkDecipher = (new crypto.Decipher).init("aes192", "MySecretKey123");
+var chunkPt = chunkDecipher.update([chunkCt.slice(0, 5), chunkCt.slice(5, 40), chunkCt.slice(40)], "hex", "utf8") + chunkDecipher.final("utf8");
+test.assertEquals("Hello World! and more text", chunkPt, "decipher update with hex chunk array");
+var s4 = (new crypto.Sign).init("RSA-SHA1").update(["Test", "123"]).sign(keyPem, "hex");
+test.assertTrue((new crypto.Verify).init("RSA-SHA1").update(["Te", "st123"]).verify(certPem, s4, "hex"), "sign and verify with chunk arrays");
+
+// Test context pooling and reset()
+// The counts are checked once no thread pool work can return contexts.
+process.addListener("exit", function () {
+  crypto.setContextPoolSize(0);
+  crypto.setContextPoolSize(16);
+  var pooled = (new crypto.Hash).init("sha1");
+  pooled.update("Test123");
+  test.assertEquals(0, crypto.getContextPoolStats().digest, "context borrowed at init");
+  var firstDigest = pooled.digest("hex");
+  test.assertEquals(1, crypto.getContextPoolStats().digest, "context returned at digest");
+  test.assertEquals(firstDigest, pooled.reset().update("Test123").digest("hex"), "hash reset");
+  test.assertEquals(1, crypto.getContextPoolStats().digest, "context reused after reset");
+});
+var pooledHmac = (new crypto.Hmac).init("sha1", "Node");
+var firstMac = pooledHmac.update("some data").digest("hex");
+test.assertEquals(firstMac, pooledHmac.reset().update("some data").digest("hex"), "hmac reset keeps the key");
+var pooledSign = (new crypto.Sign).init("RSA-SHA1");
+var sig1 = pooledSign.update("Test123").sign(keyPem, "hex");
+test.assertEquals(sig1, pooledSign.reset().update("Test123").sign(keyPem, "hex"), "sign reset");
+var pooledVerify = (new crypto.Verify).init("RSA-SHA1");
+test.assertTrue(pooledVerify.update("Test123").verify(certPem, sig1, "hex"), "verify before reset");
+test.assertTrue(pooledVerify.reset().update("Test123").verify(certPem, sig1, "hex"), "verify reset");
+threw = false;
+try {
+  crypto.setContextPoolSize(4294967296);
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "setContextPoolSize rejects sizes past INT_MAX");
+crypto.setContextPoolSize(2147483647);
+test.assertEquals(h1, (new crypto.Hmac).init("sha1", "Node").update("some data").update("to hmac").digest("hex"), "hmac with a very large context pool");
+crypto.setContextPoolSize(256);
+threw = false;
+try {
+  (new crypto.Hash).reset();
+} catch (e) {
+  threw = true;
+}
+test.assertTrue(threw, "reset() needs an earlier init()");